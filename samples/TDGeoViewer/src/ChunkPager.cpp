@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include "ChunkPager.hpp"
+
+static const size_t BLOCK_BYTES = 4 << 20;
+static const size_t DONE_CHUNKS = 4; // loaded chunks waiting for upload
+
+bool ChunkPager::start(const std::string& path, size_t budgetBytes) {
+	stop();
+	if (!mFile.open(path)) {
+		std::cout << "Can't open chunk file " << path << std::endl;
+		return false;
+	}
+	mPath = path;
+	mBudget = budgetBytes;
+	for (uint32_t i = 0; i < mFile.get_chunk_num(); ++i) {
+		if (chunk_bytes(i) > mBudget) {
+			std::cout << "Chunk " << i << " alone exceeds the memory budget and won't be shown" << std::endl;
+		}
+	}
+	Resident none = {};
+	mResident.assign(mFile.get_chunk_num(), none);
+	mResidentBytes = 0;
+	mResidentNum = 0;
+	mFrame = 0;
+	mLoading = NO_CHUNK;
+	mStop = false;
+	mThread = std::thread(&ChunkPager::run, this);
+	return true;
+}
+
+void ChunkPager::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mWake.notify_all();
+	if (mThread.joinable()) {
+		mThread.join();
+	}
+	mRequests.clear();
+	mDone.clear();
+	for (Resident& res : mResident) {
+		if (res.pMesh) {
+			res.pMesh->destroy();
+			delete res.pMesh;
+		}
+	}
+	mResident.clear();
+	mResidentBytes = 0;
+	mResidentNum = 0;
+	mFile.close();
+}
+
+void ChunkPager::run() {
+	TDChunkFile file;
+	if (!file.open(mPath)) { return; }
+	while (true) {
+		uint32_t chunk;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWake.wait(lock, [this] { return mStop || (!mRequests.empty() && mDone.size() < DONE_CHUNKS); });
+			if (mStop) { return; }
+			chunk = mRequests.front();
+			mRequests.pop_front();
+			mLoading = chunk;
+		}
+		std::unique_ptr<Loaded> pLoaded(new Loaded());
+		pLoaded->chunk = chunk;
+		TDGeometry geo;
+		if (file.load_chunk(chunk, geo)) {
+			GLDraw::Mesh::Streamer streamer(geo);
+			pLoaded->layout = streamer.layout();
+			GLDraw::Mesh::Block blk;
+			while (streamer.next(blk, BLOCK_BYTES)) {
+				pLoaded->blocks.push_back(std::move(blk));
+			}
+		} else {
+			std::cout << "Couldn't read chunk " << chunk << " of " << mPath << std::endl;
+		}
+		std::lock_guard<std::mutex> lock(mMutex);
+		mDone.push_back(std::move(pLoaded));
+		mLoading = NO_CHUNK;
+	}
+}
+
+size_t ChunkPager::chunk_bytes(uint32_t idx) const {
+	const TDChunkFile::Chunk& chunk = mFile.chunks()[idx];
+	size_t idxBytes = chunk.pntNum <= (1 << 16) ? 2 : 4;
+	return (size_t)chunk.pntNum * sizeof(GLDraw::Mesh::Vtx) + (size_t)chunk.triNum * 3 * idxBytes;
+}
+
+static float bbox_dist2(const TDGeometry::BBox& bbox, const glm::vec3& pos) {
+	float d2 = 0.0f;
+	for (int i = 0; i < 3; ++i) {
+		float d = std::max(std::max(bbox.min[i] - pos[i], pos[i] - bbox.max[i]), 0.0f);
+		d2 += d * d;
+	}
+	return d2;
+}
+
+void ChunkPager::update(const glm::vec3& viewPos, int budgetMs) {
+	using namespace std::chrono;
+	steady_clock::time_point t0 = steady_clock::now();
+	++mFrame;
+	const std::vector<TDChunkFile::Chunk>& chunks = mFile.chunks();
+	uint32_t nchunk = (uint32_t)chunks.size();
+	std::vector<float> dist(nchunk);
+	mOrder.resize(nchunk);
+	for (uint32_t i = 0; i < nchunk; ++i) {
+		dist[i] = bbox_dist2(chunks[i].bbox, viewPos);
+		mOrder[i] = i;
+	}
+	std::sort(mOrder.begin(), mOrder.end(), [&dist](uint32_t a, uint32_t b) { return dist[a] < dist[b]; });
+
+	// the nearest chunks that fit are wanted
+	mMissing.clear();
+	size_t wantBytes = 0;
+	for (uint32_t idx : mOrder) {
+		wantBytes += chunk_bytes(idx);
+		if (wantBytes > mBudget) { break; }
+		if (mResident[idx].pMesh) {
+			mResident[idx].lastWanted = mFrame;
+		} else {
+			mMissing.push_back(idx);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mRequests.clear();
+		for (uint32_t idx : mMissing) {
+			bool inFlight = idx == mLoading;
+			for (size_t i = 0; !inFlight && i < mDone.size(); ++i) {
+				inFlight = mDone[i]->chunk == idx;
+			}
+			if (!inFlight) {
+				mRequests.push_back(idx);
+			}
+		}
+	}
+	mWake.notify_one();
+
+	while (steady_clock::now() - t0 < milliseconds(budgetMs)) {
+		std::unique_ptr<Loaded> pLoaded;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (mDone.empty()) { break; }
+			pLoaded = std::move(mDone.front());
+			mDone.pop_front();
+		}
+		mWake.notify_one();
+		make_resident(std::move(pLoaded));
+	}
+	evict();
+}
+
+void ChunkPager::make_resident(std::unique_ptr<Loaded> pLoaded) {
+	Resident& res = mResident[pLoaded->chunk];
+	if (res.pMesh || pLoaded->layout.vtxNum == 0) { return; }
+	res.pMesh = GLDraw::Mesh::create(pLoaded->layout);
+	if (!res.pMesh) { return; }
+	for (const GLDraw::Mesh::Block& blk : pLoaded->blocks) {
+		res.pMesh->upload(blk);
+	}
+	res.bytes = res.pMesh->get_gpu_bytes();
+	res.lastWanted = mFrame;
+	mResidentBytes += res.bytes;
+	++mResidentNum;
+	evict();
+}
+
+// Chunks wanted in the current frame are never evicted, the wanted set
+// itself fits in the budget.
+void ChunkPager::evict() {
+	while (mResidentBytes > mBudget) {
+		uint32_t victim = NO_CHUNK;
+		for (uint32_t i = 0; i < (uint32_t)mResident.size(); ++i) {
+			const Resident& res = mResident[i];
+			if (res.pMesh && res.lastWanted != mFrame && (victim == NO_CHUNK || res.lastWanted < mResident[victim].lastWanted)) {
+				victim = i;
+			}
+		}
+		if (victim == NO_CHUNK) { break; }
+		Resident& res = mResident[victim];
+		res.pMesh->destroy();
+		delete res.pMesh;
+		res.pMesh = nullptr;
+		mResidentBytes -= res.bytes;
+		--mResidentNum;
+	}
+}
+
+void ChunkPager::draw(float roughness) {
+	glm::mat4x4 world(1.0f);
+	for (Resident& res : mResident) {
+		if (res.pMesh) {
+			res.pMesh->set_roughness(roughness);
+			res.pMesh->draw(world);
+		}
+	}
+}
+
+bool ChunkPager::is_idle() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mRequests.empty() && mLoading == NO_CHUNK && mDone.empty();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "GLDraw.hpp"
+#include "TDChunkFile.hpp"
+
+// Out-of-core viewing of a TDChunkFile. Every frame the render thread ranks
+// the chunks by distance from the camera and wants the nearest ones that
+// fit in the memory budget; missing ones are requested from a worker thread
+// which reads and converts them, nearest first. Resident meshes form an LRU
+// cache under the same budget: chunks that drop out of the wanted set stay
+// until their space is needed, the least recently wanted go first.
+class ChunkPager {
+	static const uint32_t NO_CHUNK = 0xFFFFFFFFu;
+
+	struct Loaded {
+		uint32_t chunk;
+		GLDraw::Mesh::Layout layout;
+		std::vector<GLDraw::Mesh::Block> blocks;
+	};
+
+	struct Resident {
+		GLDraw::Mesh* pMesh;
+		size_t bytes;
+		uint32_t lastWanted; // frame
+	};
+
+	std::string mPath;
+	TDChunkFile mFile; // chunk table; the worker reads through its own copy
+	size_t mBudget;
+	std::vector<Resident> mResident; // per chunk
+	std::vector<uint32_t> mOrder;
+	std::vector<uint32_t> mMissing;
+	size_t mResidentBytes;
+	uint32_t mResidentNum;
+	uint32_t mFrame;
+
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::deque<uint32_t> mRequests;
+	std::deque<std::unique_ptr<Loaded>> mDone;
+	uint32_t mLoading;
+	bool mStop;
+
+	void run();
+	size_t chunk_bytes(uint32_t idx) const;
+	void make_resident(std::unique_ptr<Loaded> pLoaded);
+	void evict();
+
+public:
+	ChunkPager() : mBudget(0), mResidentBytes(0), mResidentNum(0), mFrame(0), mLoading(NO_CHUNK), mStop(false) {}
+	~ChunkPager() { stop(); }
+
+	bool start(const std::string& path, size_t budgetBytes);
+	// Also destroys the resident meshes, call while GL is up.
+	void stop();
+	bool valid() const { return mThread.joinable(); }
+
+	TDGeometry::BBox bbox() const { return mFile.bbox(); }
+	uint32_t get_chunk_num() const { return mFile.get_chunk_num(); }
+	uint32_t get_resident_num() const { return mResidentNum; }
+	size_t get_resident_bytes() const { return mResidentBytes; }
+
+	// Once per frame: ranks chunks for viewPos, updates the requests and
+	// uploads finished loads for up to budgetMs.
+	void update(const glm::vec3& viewPos, int budgetMs);
+	void draw(float roughness);
+	// True when every wanted chunk is resident.
+	bool is_idle();
+};
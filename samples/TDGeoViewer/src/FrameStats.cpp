@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cstdio>
+#include "FrameStats.hpp"
+
+static const char* s_phaseNames[FrameStats::PHASE_NUM] = { "upload", "draw", "swap" };
+
+FrameStats::FrameStats() : mNext(0), mFrameNo(0), mPhase(-1) {
+	mHistory.reserve(HISTORY);
+	mCur = Sample();
+}
+
+bool FrameStats::open_csv(const std::string& path) {
+	mCsv.open(path);
+	if (!mCsv.is_open()) { return false; }
+	mCsv << "frame,frame_ms";
+	for (int i = 0; i < PHASE_NUM; ++i) {
+		mCsv << "," << s_phaseNames[i] << "_ms";
+	}
+	mCsv << ",gpu_ms,draw_calls,tris,instances\n";
+	return true;
+}
+
+void FrameStats::reset() {
+	mHistory.clear();
+	mNext = 0;
+	mFrameNo = 0;
+	mPhase = -1;
+	mCur = Sample();
+}
+
+static float elapsed_ms(std::chrono::steady_clock::time_point t0, std::chrono::steady_clock::time_point t1) {
+	return std::chrono::duration<float, std::milli>(t1 - t0).count();
+}
+
+void FrameStats::begin_frame() {
+	mPhaseStart = Clock::now();
+	mPhase = -1;
+	for (int i = 0; i < PHASE_NUM; ++i) {
+		mCur.phaseMs[i] = 0.0f;
+	}
+}
+
+void FrameStats::begin_phase(Phase phase) {
+	Clock::time_point now = Clock::now();
+	if (mPhase >= 0) {
+		mCur.phaseMs[mPhase] += elapsed_ms(mPhaseStart, now);
+	}
+	mPhaseStart = now;
+	mPhase = phase;
+}
+
+// The frame time is the period between two end_frame() calls, so it
+// includes everything the loop does, vsync waits too.
+void FrameStats::end_frame(const GLDraw::DrawStats& drawStats, float gpuMs) {
+	Clock::time_point now = Clock::now();
+	if (mPhase >= 0) {
+		mCur.phaseMs[mPhase] += elapsed_ms(mPhaseStart, now);
+	}
+	mPhase = -1;
+	if (mFrameNo == 0) {
+		float busyMs = 0.0f;
+		for (int i = 0; i < PHASE_NUM; ++i) {
+			busyMs += mCur.phaseMs[i];
+		}
+		mCur.frameMs = busyMs;
+	} else {
+		mCur.frameMs = elapsed_ms(mFrameEnd, now);
+	}
+	mFrameEnd = now;
+	mCur.gpuMs = gpuMs;
+	mCur.drawCalls = drawStats.drawCalls;
+	mCur.tris = drawStats.trisDrawn;
+	mCur.instances = drawStats.instancesDrawn;
+	if (mHistory.size() < HISTORY) {
+		mHistory.push_back(mCur);
+	} else {
+		mHistory[mNext] = mCur;
+	}
+	mNext = (mNext + 1) % HISTORY;
+	++mFrameNo;
+
+	if (mCsv.is_open()) {
+		char buf[256];
+		snprintf(buf, sizeof(buf), "%llu,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d,%d\n", (unsigned long long)mFrameNo, mCur.frameMs,
+		         mCur.phaseMs[PHASE_UPLOAD], mCur.phaseMs[PHASE_DRAW], mCur.phaseMs[PHASE_SWAP], mCur.gpuMs, mCur.drawCalls, mCur.tris, mCur.instances);
+		mCsv << buf;
+	}
+}
+
+const FrameStats::Sample& FrameStats::last() const {
+	return mHistory[(mNext + HISTORY - 1) % HISTORY % mHistory.size()];
+}
+
+float FrameStats::percentile(float Sample::* pField, float pct) const {
+	if (mHistory.empty()) { return 0.0f; }
+	std::vector<float> vals;
+	vals.reserve(mHistory.size());
+	for (const Sample& smp : mHistory) {
+		vals.push_back(smp.*pField);
+	}
+	size_t k = std::min((size_t)(pct * 0.01f * vals.size()), vals.size() - 1);
+	std::nth_element(vals.begin(), vals.begin() + k, vals.end());
+	return vals[k];
+}
+
+float FrameStats::phase_percentile(int phase, float pct) const {
+	if (mHistory.empty()) { return 0.0f; }
+	std::vector<float> vals;
+	vals.reserve(mHistory.size());
+	for (const Sample& smp : mHistory) {
+		vals.push_back(smp.phaseMs[phase]);
+	}
+	size_t k = std::min((size_t)(pct * 0.01f * vals.size()), vals.size() - 1);
+	std::nth_element(vals.begin(), vals.begin() + k, vals.end());
+	return vals[k];
+}
+
+std::string FrameStats::summary() const {
+	if (mHistory.empty()) { return std::string(); }
+	std::string text;
+	char buf[128];
+	snprintf(buf, sizeof(buf), "frame  p50 %6.2f p99 %6.2f ms\n", percentile(&Sample::frameMs, 50.0f), percentile(&Sample::frameMs, 99.0f));
+	text += buf;
+	for (int i = 0; i < PHASE_NUM; ++i) {
+		snprintf(buf, sizeof(buf), "%-6s p50 %6.2f p99 %6.2f ms\n", s_phaseNames[i], phase_percentile(i, 50.0f), phase_percentile(i, 99.0f));
+		text += buf;
+	}
+	if (last().gpuMs >= 0.0f) {
+		snprintf(buf, sizeof(buf), "gpu    p50 %6.2f p99 %6.2f ms\n", percentile(&Sample::gpuMs, 50.0f), percentile(&Sample::gpuMs, 99.0f));
+	} else {
+		snprintf(buf, sizeof(buf), "gpu    n/a\n");
+	}
+	text += buf;
+	const Sample& smp = last();
+	snprintf(buf, sizeof(buf), "draws %d  tris %d  instances %d", smp.drawCalls, smp.tris, smp.instances);
+	text += buf;
+	return text;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "GLDraw.hpp"
+
+// CPU frame and phase times, GPU time and draw counters of the last
+// HISTORY frames, with percentiles for display and an optional per-frame
+// CSV log.
+class FrameStats {
+public:
+	enum Phase {
+		PHASE_UPLOAD,
+		PHASE_DRAW,
+		PHASE_SWAP,
+		PHASE_NUM
+	};
+
+	struct Sample {
+		float frameMs;
+		float phaseMs[PHASE_NUM];
+		float gpuMs;
+		int drawCalls;
+		int tris;
+		int instances;
+	};
+
+	enum { HISTORY = 300 };
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	std::vector<Sample> mHistory;
+	size_t mNext;
+	uint64_t mFrameNo;
+	Clock::time_point mFrameEnd;
+	Clock::time_point mPhaseStart;
+	int mPhase;
+	Sample mCur;
+	std::ofstream mCsv;
+
+	float percentile(float Sample::* pField, float pct) const;
+	float phase_percentile(int phase, float pct) const;
+
+public:
+	FrameStats();
+
+	bool open_csv(const std::string& path);
+	// Drops the history, the CSV log goes on.
+	void reset();
+
+	void begin_frame();
+	void begin_phase(Phase phase);
+	void end_frame(const GLDraw::DrawStats& drawStats, float gpuMs);
+
+	uint64_t get_frame_num() const { return mFrameNo; }
+	const Sample& last() const;
+	// p50/p99 of every metric, one line each.
+	std::string summary() const;
+};
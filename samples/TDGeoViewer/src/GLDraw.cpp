@@ -5,6 +5,14 @@
 #include <iostream>
 #include <cstdarg>
 #include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <chrono>
+#include <thread>
 
 // undefine _CONSOLE for DynamicGles.h include to avoid PVR SDK R2
 // compilation problem with win32 console apps
@@ -18,6 +26,7 @@
 
 #include "GLSys.hpp"
 #include "GLDraw.hpp"
+#include <TDRadixSort.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <gtx/euler_angles.hpp>
 
@@ -29,6 +38,89 @@
 #endif
 
 
+// GL_EXT_multi_draw_arrays
+typedef void (GL_APIENTRY* PFN_MULTI_DRAW_ELEMENTS)(GLenum mode, const GLsizei* count, GLenum type, const void* const* indices, GLsizei drawcount);
+
+// EXT_disjoint_timer_query
+typedef void (GL_APIENTRY* PFN_GEN_QUERIES)(GLsizei n, GLuint* ids);
+typedef void (GL_APIENTRY* PFN_DELETE_QUERIES)(GLsizei n, const GLuint* ids);
+typedef void (GL_APIENTRY* PFN_BEGIN_QUERY)(GLenum target, GLuint id);
+typedef void (GL_APIENTRY* PFN_END_QUERY)(GLenum target);
+typedef void (GL_APIENTRY* PFN_GET_QUERY_OBJECT_UI)(GLuint id, GLenum pname, GLuint* params);
+typedef void (GL_APIENTRY* PFN_GET_QUERY_OBJECT_UI64)(GLuint id, GLenum pname, uint64_t* params);
+static const GLenum QUERY_TIME_ELAPSED = 0x88BF;
+static const GLenum QUERY_RESULT = 0x8866;
+static const GLenum QUERY_RESULT_AVAILABLE = 0x8867;
+static const GLenum QUERY_GPU_DISJOINT = 0x8FBB;
+static const int GPU_QUERY_NUM = 4; // frames in flight
+
+// Plain count so GLESApp stays trivial, it is cleared with memset.
+static uint64_t steady_ns() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Overlay text uses a 3x5 pixel font, one 15-bit row-major mask per glyph.
+static const struct {
+	char ch;
+	uint16_t mask;
+} s_font[] = {
+	{ '%', 0x52A5 },
+	{ '(', 0x2922 },
+	{ ')', 0x224A },
+	{ '-', 0x01C0 },
+	{ '.', 0x0002 },
+	{ '/', 0x12A4 },
+	{ '0', 0x7B6F },
+	{ '1', 0x2C97 },
+	{ '2', 0x73E7 },
+	{ '3', 0x73CF },
+	{ '4', 0x5BC9 },
+	{ '5', 0x79CF },
+	{ '6', 0x79EF },
+	{ '7', 0x7249 },
+	{ '8', 0x7BEF },
+	{ '9', 0x7BCF },
+	{ ':', 0x0410 },
+	{ '=', 0x0E38 },
+	{ 'A', 0x2BED },
+	{ 'B', 0x6BAE },
+	{ 'C', 0x3923 },
+	{ 'D', 0x6B6E },
+	{ 'E', 0x79A7 },
+	{ 'F', 0x79A4 },
+	{ 'G', 0x396B },
+	{ 'H', 0x5BED },
+	{ 'I', 0x7497 },
+	{ 'J', 0x126A },
+	{ 'K', 0x5BAD },
+	{ 'L', 0x4927 },
+	{ 'M', 0x5FED },
+	{ 'N', 0x6B6D },
+	{ 'O', 0x2B6A },
+	{ 'P', 0x6BA4 },
+	{ 'Q', 0x2B73 },
+	{ 'R', 0x6BAD },
+	{ 'S', 0x388E },
+	{ 'T', 0x7492 },
+	{ 'U', 0x5B6F },
+	{ 'V', 0x5B6A },
+	{ 'W', 0x5BFD },
+	{ 'X', 0x5AAD },
+	{ 'Y', 0x5A92 },
+	{ 'Z', 0x72A7 },
+};
+static const int GLYPH_W = 3;
+static const int GLYPH_H = 5;
+static const int OVERLAY_SCALE = 2;
+
+static const uint32_t CHUNK_TRIS = 4096;
+static const uint32_t CHUNK_PNTS = 16384;
+static const float POINT_LOD_PX = 2.0f; // on-screen spacing kept by the drawn subset
+static const uint32_t POINT_LOD_MIN = 64;
+static const int MAX_CHUNK_GRID = 32;
+static const uint32_t PART_VTX_MAX = 1 << 16;
+static const size_t STAGE_BYTES = 4 << 20;
+
 std::string load_text(const std::string& path) {
 	std::ifstream is(path);
 	return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
@@ -44,7 +136,9 @@ static struct GLESApp {
 		GLint attrLocPos;
 		GLint attrLocNrm;
 		GLint attrLocClr;
-		GLint prmLocWMtx;
+		GLint attrLocWMtx[3];
+		GLint prmLocPosBase;
+		GLint prmLocPosScale;
 		GLint prmLocViewProj;
 		GLint prmLocViewPos;
 		GLint prmLocHemiSky;
@@ -54,8 +148,37 @@ static struct GLESApp {
 		GLint prmSpecClr;
 		GLint prmSpecRough;
 		GLint prmLocInvGamma;
+		GLint prmLocPointSize;
+		GLint prmLocLit;
+
+		GLuint overlayShaderIdVtx;
+		GLuint overlayShaderIdFrag;
+		GLuint overlayProgId;
+		GLint overlayAttrLocPosUV;
+		GLint overlayPrmLocText;
+		GLuint overlayTexId;
+		GLuint overlayBuffId;
+		int overlayW;
+		int overlayH;
 	} mGPU;
 
+	struct TIMER {
+		PFN_GEN_QUERIES pGenQueries;
+		PFN_DELETE_QUERIES pDeleteQueries;
+		PFN_BEGIN_QUERY pBeginQuery;
+		PFN_END_QUERY pEndQuery;
+		PFN_GET_QUERY_OBJECT_UI pGetQueryObjectui;
+		PFN_GET_QUERY_OBJECT_UI64 pGetQueryObjectui64;
+		GLuint ids[GPU_QUERY_NUM];
+		bool pending[GPU_QUERY_NUM];
+		uint64_t startNs[GPU_QUERY_NUM];
+		int next;
+		bool active;
+		float gpuMs;
+
+		bool valid() const { return pGenQueries != nullptr; }
+	} mTimer;
+
 	struct VIEW {
 		glm::mat4x4 mViewMtx;
 		glm::mat4x4 mProjMtx;
@@ -108,6 +231,82 @@ static struct GLESApp {
 
 	glm::vec3 mClearColor;
 
+	float mPointScale;
+
+	char mSavePath[256];
+
+	PFN_MULTI_DRAW_ELEMENTS mpMultiDrawElements;
+	bool mES3; // vertex array objects and instancing
+	bool mFrameBound;
+	GLDraw::DrawStats mStats;
+
+	void init_ext() {
+		const char* pVer = (const char*)glGetString(GL_VERSION);
+		mES3 = pVer && strstr(pVer, "OpenGL ES 3");
+		const char* pExts = (const char*)glGetString(GL_EXTENSIONS);
+		if (pExts && strstr(pExts, "GL_EXT_multi_draw_arrays")) {
+			mpMultiDrawElements = (PFN_MULTI_DRAW_ELEMENTS)eglGetProcAddress("glMultiDrawElementsEXT");
+		}
+		mTimer.gpuMs = -1.0f;
+		if (pExts && strstr(pExts, "GL_EXT_disjoint_timer_query")) {
+			mTimer.pGenQueries = (PFN_GEN_QUERIES)eglGetProcAddress("glGenQueriesEXT");
+			mTimer.pDeleteQueries = (PFN_DELETE_QUERIES)eglGetProcAddress("glDeleteQueriesEXT");
+			mTimer.pBeginQuery = (PFN_BEGIN_QUERY)eglGetProcAddress("glBeginQueryEXT");
+			mTimer.pEndQuery = (PFN_END_QUERY)eglGetProcAddress("glEndQueryEXT");
+			mTimer.pGetQueryObjectui = (PFN_GET_QUERY_OBJECT_UI)eglGetProcAddress("glGetQueryObjectuivEXT");
+			mTimer.pGetQueryObjectui64 = (PFN_GET_QUERY_OBJECT_UI64)eglGetProcAddress("glGetQueryObjectui64vEXT");
+			if (mTimer.pGenQueries && mTimer.pDeleteQueries && mTimer.pBeginQuery && mTimer.pEndQuery && mTimer.pGetQueryObjectui && mTimer.pGetQueryObjectui64) {
+				mTimer.pGenQueries(GPU_QUERY_NUM, mTimer.ids);
+			} else {
+				mTimer.pGenQueries = nullptr;
+			}
+		}
+	}
+
+	void reset_ext() {
+		if (mTimer.valid()) {
+			mTimer.pDeleteQueries(GPU_QUERY_NUM, mTimer.ids);
+		}
+	}
+
+	// One query per frame, results are read back a few frames later so the
+	// CPU never waits for them.
+	void timer_begin() {
+		if (!mTimer.valid()) { return; }
+		mTimer.active = !mTimer.pending[mTimer.next];
+		if (mTimer.active) {
+			mTimer.pBeginQuery(QUERY_TIME_ELAPSED, mTimer.ids[mTimer.next]);
+			mTimer.startNs[mTimer.next] = steady_ns();
+		}
+	}
+
+	void timer_end() {
+		if (!mTimer.valid()) { return; }
+		if (mTimer.active) {
+			mTimer.pEndQuery(QUERY_TIME_ELAPSED);
+			mTimer.pending[mTimer.next] = true;
+			mTimer.next = (mTimer.next + 1) % GPU_QUERY_NUM;
+		}
+		GLint disjoint = 0;
+		glGetIntegerv(QUERY_GPU_DISJOINT, &disjoint);
+		for (int i = 0; i < GPU_QUERY_NUM; ++i) {
+			int idx = (mTimer.next + i) % GPU_QUERY_NUM; // oldest first
+			if (!mTimer.pending[idx]) { continue; }
+			GLuint avail = 0;
+			mTimer.pGetQueryObjectui(mTimer.ids[idx], QUERY_RESULT_AVAILABLE, &avail);
+			if (!avail) { break; }
+			uint64_t ns = 0;
+			mTimer.pGetQueryObjectui64(mTimer.ids[idx], QUERY_RESULT, &ns);
+			mTimer.pending[idx] = false;
+			// some drivers return junk for the very first query, a frame
+			// can't take longer on the GPU than on the wall clock
+			uint64_t wallNs = steady_ns() - mTimer.startNs[idx];
+			if (!disjoint && ns <= wallNs) {
+				mTimer.gpuMs = (float)((double)ns * 1e-6);
+			}
+		}
+	}
+
 	bool init_gpu() {
 		using namespace std;
 		GLint status;
@@ -126,13 +325,18 @@ static struct GLESApp {
 		std::string srcFrag = load_text(fragPath);
 		if (srcFrag.length() < 1) { return false; }
 
-		mGPU.programId = GLSys::compile_prog_strs(srcVtx, srcFrag, &mGPU.shaderIdVtx, &mGPU.shaderIdFrag);
+		std::string cachePath = wkFolder + PATH_SEPARATOR + "hemidir.bin";
+		mGPU.programId = GLSys::load_prog_cached(srcVtx, srcFrag, cachePath, &mGPU.shaderIdVtx, &mGPU.shaderIdFrag);
 
 		if (mGPU.programId) {
 			mGPU.attrLocPos = glGetAttribLocation(mGPU.programId, "vtxPos");
 			mGPU.attrLocNrm = glGetAttribLocation(mGPU.programId, "vtxNrm");
 			mGPU.attrLocClr = glGetAttribLocation(mGPU.programId, "vtxClr");
-			mGPU.prmLocWMtx = glGetUniformLocation(mGPU.programId, "prmWMtx");
+			mGPU.attrLocWMtx[0] = glGetAttribLocation(mGPU.programId, "vtxWMtx0");
+			mGPU.attrLocWMtx[1] = glGetAttribLocation(mGPU.programId, "vtxWMtx1");
+			mGPU.attrLocWMtx[2] = glGetAttribLocation(mGPU.programId, "vtxWMtx2");
+			mGPU.prmLocPosBase = glGetUniformLocation(mGPU.programId, "prmPosBase");
+			mGPU.prmLocPosScale = glGetUniformLocation(mGPU.programId, "prmPosScale");
 			mGPU.prmLocViewProj = glGetUniformLocation(mGPU.programId, "prmViewProj");
 			mGPU.prmLocViewPos = glGetUniformLocation(mGPU.programId, "prmViewPos");
 			mGPU.prmLocHemiSky = glGetUniformLocation(mGPU.programId, "prmHemiSky");
@@ -142,15 +346,131 @@ static struct GLESApp {
 			mGPU.prmSpecClr = glGetUniformLocation(mGPU.programId, "prmSpecClr");
 			mGPU.prmSpecRough = glGetUniformLocation(mGPU.programId, "prmSpecRough");
 			mGPU.prmLocInvGamma = glGetUniformLocation(mGPU.programId, "prmInvGamma");
+			mGPU.prmLocPointSize = glGetUniformLocation(mGPU.programId, "prmPointSize");
+			mGPU.prmLocLit = glGetUniformLocation(mGPU.programId, "prmLit");
+		}
+		if (mGPU.programId) {
+			init_overlay(wkFolder);
 		}
 		return mGPU.programId != 0;
 	}
+
+	// The overlay is optional, the viewer runs without its shaders.
+	void init_overlay(const std::string& wkFolder) {
+		std::string srcVtx = load_text(wkFolder + PATH_SEPARATOR + "overlay.vert");
+		std::string srcFrag = load_text(wkFolder + PATH_SEPARATOR + "overlay.frag");
+		if (srcVtx.empty() || srcFrag.empty()) { return; }
+		std::string cachePath = wkFolder + PATH_SEPARATOR + "overlay.bin";
+		mGPU.overlayProgId = GLSys::load_prog_cached(srcVtx, srcFrag, cachePath, &mGPU.overlayShaderIdVtx, &mGPU.overlayShaderIdFrag);
+		if (mGPU.overlayProgId) {
+			mGPU.overlayAttrLocPosUV = glGetAttribLocation(mGPU.overlayProgId, "vtxPosUV");
+			mGPU.overlayPrmLocText = glGetUniformLocation(mGPU.overlayProgId, "smpText");
+			glGenTextures(1, &mGPU.overlayTexId);
+			glGenBuffers(1, &mGPU.overlayBuffId);
+		}
+	}
+
 	void reset_gpu() {
+		if (mGPU.overlayProgId) {
+			glDeleteTextures(1, &mGPU.overlayTexId);
+			glDeleteBuffers(1, &mGPU.overlayBuffId);
+			glDeleteShader(mGPU.overlayShaderIdFrag);
+			glDeleteShader(mGPU.overlayShaderIdVtx);
+			glDeleteProgram(mGPU.overlayProgId);
+		}
 		glDeleteShader(mGPU.shaderIdFrag);
 		glDeleteShader(mGPU.shaderIdVtx);
 		glDeleteProgram(mGPU.programId);
 	}
 
+	// Text is rasterized on the CPU into a texture, white on a translucent
+	// dark background; lines are separated by '\n'.
+	void set_overlay(const std::string& text) {
+		if (!mGPU.overlayProgId) { return; }
+		int cols = 0;
+		int rows = text.empty() ? 0 : 1;
+		int col = 0;
+		for (char ch : text) {
+			if (ch == '\n') {
+				++rows;
+				col = 0;
+			} else {
+				cols = std::max(cols, ++col);
+			}
+		}
+		mGPU.overlayW = cols * (GLYPH_W + 1) + 1;
+		mGPU.overlayH = rows * (GLYPH_H + 1) + 1;
+		if (cols == 0) {
+			mGPU.overlayW = 0;
+			return;
+		}
+		std::vector<uint32_t> img(mGPU.overlayW * mGPU.overlayH, 0xA0000000);
+		int x = 1;
+		int y = 1;
+		for (char ch : text) {
+			if (ch == '\n') {
+				x = 1;
+				y += GLYPH_H + 1;
+				continue;
+			}
+			char uch = (char)toupper((unsigned char)ch);
+			uint16_t mask = 0;
+			for (const auto& glyph : s_font) {
+				if (glyph.ch == uch) {
+					mask = glyph.mask;
+					break;
+				}
+			}
+			for (int gy = 0; gy < GLYPH_H; ++gy) {
+				for (int gx = 0; gx < GLYPH_W; ++gx) {
+					if (mask & (1 << ((GLYPH_H - 1 - gy) * GLYPH_W + (GLYPH_W - 1 - gx)))) {
+						img[(y + gy) * mGPU.overlayW + x + gx] = 0xFFFFFFFF;
+					}
+				}
+			}
+			x += GLYPH_W + 1;
+		}
+		glBindTexture(GL_TEXTURE_2D, mGPU.overlayTexId);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, mGPU.overlayW, mGPU.overlayH, 0, GL_RGBA, GL_UNSIGNED_BYTE, img.data());
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	void draw_overlay() {
+		if (!mGPU.overlayProgId || mGPU.overlayW == 0) { return; }
+		// top-left corner, whole pixels
+		float x0 = -1.0f;
+		float y0 = 1.0f;
+		float x1 = x0 + 2.0f * mGPU.overlayW * OVERLAY_SCALE / mView.mWidth;
+		float y1 = y0 - 2.0f * mGPU.overlayH * OVERLAY_SCALE / mView.mHeight;
+		float quad[] = {
+			x0, y0, 0.0f, 0.0f,
+			x1, y0, 1.0f, 0.0f,
+			x0, y1, 0.0f, 1.0f,
+			x1, y1, 1.0f, 1.0f
+		};
+		glUseProgram(mGPU.overlayProgId);
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, mGPU.overlayTexId);
+		glUniform1i(mGPU.overlayPrmLocText, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, mGPU.overlayBuffId);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STREAM_DRAW);
+		glEnableVertexAttribArray(mGPU.overlayAttrLocPosUV);
+		glVertexAttribPointer(mGPU.overlayAttrLocPosUV, 4, GL_FLOAT, GL_FALSE, 0, 0);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		glDisableVertexAttribArray(mGPU.overlayAttrLocPosUV);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glDisable(GL_BLEND);
+	}
+
 	bool init(const GLDrawCfg& cfg)  {
 		GLSysCfg oglCfg;
 		::memset(&oglCfg, 0, sizeof(oglCfg));
@@ -158,6 +478,7 @@ static struct GLESApp {
 		oglCfg.y = cfg.y;
 		oglCfg.w = cfg.w;
 		oglCfg.h = cfg.h;
+		oglCfg.headless = cfg.headless;
 		GLSys::init(oglCfg);
 
 		if (!GLSys::valid()) { return false; }
@@ -167,6 +488,7 @@ static struct GLESApp {
 			sys_dbg_msg("GPU initialization failed\n");
 			return false;
 		}
+		init_ext();
 
 		mView.mWidth = cfg.w;
 		mView.mHeight = cfg.h;
@@ -175,15 +497,72 @@ static struct GLESApp {
 
 		mClearColor = glm::vec3(0.33f, 0.44f, 0.55f);
 		mGamma = glm::vec3(2.2f);
+		mPointScale = 1.0f;
 		return true;
 	}
 
 	void reset() {
-		GLSys::stop();
+		reset_ext();
 		reset_gpu();
+		GLSys::stop();
 		GLSys::reset();
 	}
 
+	// Program, view and light state is shared by all meshes and is set once
+	// per frame, on the first draw after begin().
+	void bind_frame() {
+		if (mFrameBound) { return; }
+		glUseProgram(mGPU.programId);
+
+		glUniform3f(mGPU.prmLocInvGamma, 1.0f / mGamma.r, 1.0f / mGamma.g, 1.0f / mGamma.b);
+		glUniform3fv(mGPU.prmLocHemiSky, 1, (float*)&mLight.sky);
+		glUniform3fv(mGPU.prmLocHemiGround, 1, (float*)&mLight.ground);
+		glUniform3fv(mGPU.prmLocHemiUp, 1, (float*)&mLight.up);
+
+		glUniform3fv(mGPU.prmSpecDir, 1, (float*)&mLight.specDir);
+		glUniform3fv(mGPU.prmSpecClr, 1, (float*)&mLight.specClr);
+
+		glUniform3fv(mGPU.prmLocViewPos, 1, (float*)&mView.mPos);
+
+		glm::mat4x4 tm = glm::transpose(mView.mViewProjMtx);
+		glUniformMatrix4fv(mGPU.prmLocViewProj, 1, GL_FALSE, (float*)&tm);
+
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(GL_LEQUAL);
+#if 0
+		glEnable(GL_CULL_FACE);
+		glFrontFace(GL_CCW); // TD
+		glCullFace(GL_BACK);
+#endif
+		mFrameBound = true;
+	}
+
+	// Bottom-up GL rows are flipped while writing.
+	void save_frame() {
+		int w = mView.mWidth;
+		int h = mView.mHeight;
+		std::vector<uint8_t> rgba(w * h * 4);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+		std::ofstream os(mSavePath, std::ios::binary);
+		if (os.is_open()) {
+			os << "P6\n" << w << " " << h << "\n255\n";
+			std::vector<uint8_t> row(w * 3);
+			for (int y = h - 1; y >= 0; --y) {
+				const uint8_t* pSrc = &rgba[y * w * 4];
+				for (int x = 0; x < w; ++x) {
+					row[x * 3] = pSrc[x * 4];
+					row[x * 3 + 1] = pSrc[x * 4 + 1];
+					row[x * 3 + 2] = pSrc[x * 4 + 2];
+				}
+				os.write((const char*)row.data(), row.size());
+			}
+		} else {
+			sys_dbg_msg("Can't write %s\n", mSavePath);
+		}
+		mSavePath[0] = 0;
+	}
+
 	void frame_clear() const {
 		glColorMask(true, true, true, true);
 		glDepthMask(true);
@@ -195,41 +574,48 @@ static struct GLESApp {
 
 static bool s_initFlg = false;
 
-static glm::vec3 geo_pnt_pos(const TDGeometry& geo, int ipnt) {
-	TDGeometry::Point p = geo.get_pnt(ipnt);
-	return glm::vec3(p.x, p.y, p.z);
+// merged index ranges of the mesh being drawn
+static std::vector<GLsizei> s_drawCounts;
+static std::vector<const void*> s_drawOffsets;
+static std::vector<uint32_t> s_drawParts;
+// world matrix rows of the visible instances
+static std::vector<glm::vec4> s_instRows;
+
+static uint16_t quantize_unorm16(float val, float base, float scale) {
+	float t = scale > 0.0f ? (val - base) / scale : 0.0f;
+	t = std::min(std::max(t, 0.0f), 1.0f);
+	return (uint16_t)(t * 65535.0f + 0.5f);
 }
 
-static int get_pol_tris(uint32_t vlst[6], const TDGeometry& geo, int polIdx) {
-	using namespace glm;
-	TDGeometry::Poly pol = geo.get_poly(polIdx);
-	int ntri = 0;
-	if (pol.nvtx == 3) {
-		for (int i = 0; i < 3; ++i) {
-			vlst[i] = pol.ipnt[i];
-		}
-		ntri = 1;
-	} else if (pol.nvtx == 4) {
-		vec3 v[4];
-		for (int i = 0; i < 4; ++i) {
-			v[i] = geo_pnt_pos(geo, pol.ipnt[i]);
-		}
-		vec3 e0 = v[0] - v[1];
-		vec3 e1 = v[1] - v[2];
-		vec3 e2 = v[2] - v[3];
-		vec3 e3 = v[3] - v[0];
-		int idiv = 0;
-		if (dot(cross(e1, e2), cross(e3, e0)) > 0) idiv = 1;
-		static int div[2][6] = {
-			{0, 1, 2,  0, 2, 3},
-			{0, 1, 3,  1, 2, 3}
-		};
-		for (int i = 0; i < 6; ++i) {
-			vlst[i] = pol.ipnt[div[idiv][i]];
+static int16_t quantize_snorm16(float val) {
+	val = std::min(std::max(val, -1.0f), 1.0f);
+	return (int16_t)std::floor(val * 32767.0f + 0.5f);
+}
+
+static uint8_t quantize_srgb8(float linear) {
+	float c = std::min(std::max(linear, 0.0f), 1.0f);
+	c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+	return (uint8_t)(c * 255.0f + 0.5f);
+}
+
+// Octahedral normal encoding: project onto the |x|+|y|+|z| = 1 octahedron
+// and fold the lower hemisphere over the diagonals.
+static void encode_oct_nrm(int16_t enc[2], float nx, float ny, float nz) {
+	float len = std::fabs(nx) + std::fabs(ny) + std::fabs(nz);
+	float x = 0.0f;
+	float y = 0.0f;
+	if (len > 0.0f) {
+		x = nx / len;
+		y = ny / len;
+		if (nz < 0.0f) {
+			float ox = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			float oy = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = ox;
+			y = oy;
 		}
-		ntri = 2;
 	}
-	return ntri;
+	enc[0] = quantize_snorm16(x);
+	enc[1] = quantize_snorm16(y);
 }
 
 namespace GLDraw {
@@ -252,13 +638,26 @@ namespace GLDraw {
 		GLSys::loop(pLoop);
 	}
 
+	void quit() {
+		GLSys::quit();
+	}
+
 	void begin() {
 		if (!s_initFlg) { return; }
+		::memset(&s_app.mStats, 0, sizeof(s_app.mStats));
+		s_app.mFrameBound = false;
+		s_app.timer_begin();
 		s_app.frame_clear();
 	}
 
 	void end() {
 		if (!s_initFlg) { return; }
+		s_app.draw_overlay();
+		if (s_app.mSavePath[0]) {
+			s_app.save_frame();
+		}
+		glUseProgram(0);
+		s_app.timer_end();
 		GLSys::swap();
 	}
 
@@ -288,25 +687,316 @@ namespace GLDraw {
 		s_app.mLight.specClr = clr;
 	}
 
-	int Mesh::idx_bytes() const { return is_idx16() ? sizeof(GLushort) : sizeof(GLuint); }
+	const DrawStats& get_stats() {
+		return s_app.mStats;
+	}
 
-	// Geo should contain triangles or quads. Quads will be triangulated.
-	Mesh* Mesh::create(const TDGeometry& geo) {
-		uint32_t vtxNum = geo.get_pnt_num();
-		if (vtxNum == 0) { return nullptr; }
-		uint32_t polNum = geo.get_poly_num();
-		if (polNum == 0) { return nullptr; }
-
-		uint32_t triNum = 0;
-		for (uint32_t i = 0; i < polNum; ++i) {
-			TDGeometry::Poly pol = geo.get_poly(i);
-			if (pol.nvtx == 3) {
-				triNum += 1;
-			} else if (pol.nvtx == 4) {
-				triNum += 2;
+	void set_title(const char* pTitle) {
+		GLSys::set_title(pTitle);
+	}
+
+	float get_gpu_ms() {
+		return s_app.mTimer.gpuMs;
+	}
+
+	void set_overlay(const std::string& text) {
+		if (!s_initFlg) { return; }
+		s_app.set_overlay(text);
+	}
+
+	void save_frame(const std::string& path) {
+		size_t len = std::min(path.length(), sizeof(s_app.mSavePath) - 1);
+		::memcpy(s_app.mSavePath, path.c_str(), len);
+		s_app.mSavePath[len] = 0;
+	}
+
+	void set_point_scale(float scale) {
+		s_app.mPointScale = scale;
+	}
+
+	// A box is outside when all of its corners lie beyond the same clip plane.
+	bool Mesh::chunk_visible(const Chunk& chunk, const glm::mat4x4& clipMtx) const {
+		int outMask = 0x3F;
+		for (int i = 0; i < 8; ++i) {
+			glm::vec4 pos((i & 1) ? chunk.bbMax.x : chunk.bbMin.x, (i & 2) ? chunk.bbMax.y : chunk.bbMin.y, (i & 4) ? chunk.bbMax.z : chunk.bbMin.z, 1.0f);
+			glm::vec4 clip = clipMtx * pos;
+			int mask = 0;
+			if (clip.x < -clip.w) { mask |= 1; }
+			if (clip.x > clip.w) { mask |= 2; }
+			if (clip.y < -clip.w) { mask |= 4; }
+			if (clip.y > clip.w) { mask |= 8; }
+			if (clip.z < -clip.w) { mask |= 0x10; }
+			if (clip.z > clip.w) { mask |= 0x20; }
+			outMask &= mask;
+			if (outMask == 0) { return true; }
+		}
+		return false;
+	}
+
+	// Chunks are runs of CHUNK_TRIS triangles in the order of the geometry,
+	// which the loader sorts along a space-filling curve so that runs stay
+	// compact. Walking them in that order, a new part is started whenever
+	// the next triangle would take the current one past PART_VTX_MAX
+	// vertices, which keeps the duplicated points down to those on the part
+	// borders. Only this layout is kept; vertices and indices are generated
+	// part by part in next().
+	Mesh::Streamer::Streamer(const TDGeometry& geo) : mGeo(geo), mPartIdx(0), mPartReady(false), mVtxDone(0), mTriDone(0) {
+		const std::vector<uint32_t>& tris = geo.tris();
+		uint32_t triNum = geo.get_tri_num();
+		TDGeometry::BBox bbox = geo.bbox();
+		mLayout.vtxNum = 0;
+		mLayout.triNum = triNum;
+		mLayout.posBase = glm::vec3(bbox.min[0], bbox.min[1], bbox.min[2]);
+		mLayout.posScale = glm::vec3(bbox.max[0], bbox.max[1], bbox.max[2]) - mLayout.posBase;
+		mLayout.lit = true;
+		if (triNum == 0) {
+			init_points();
+			return;
+		}
+
+		const std::vector<TDGeometry::Point>& pnts = geo.pnts();
+		// room for a part at half load, smaller meshes get a smaller table
+		uint32_t remapSize = 1;
+		while (remapSize < 2 * std::min(geo.get_pnt_num(), PART_VTX_MAX)) { remapSize <<= 1; }
+		mRemapKeys.resize(remapSize);
+		mRemapVals.resize(remapSize);
+		remap_clear();
+		Part part = { 0, 0, 0, 0 };
+		size_t chunkIdx = SIZE_MAX;
+		for (uint32_t i = 0; i < triNum; ++i) {
+			const uint32_t* pTri = &tris[i * 3];
+			uint32_t newNum = 0;
+			for (int k = 0; k < 3; ++k) {
+				if (mRemapKeys[remap_slot(pTri[k])] == 0) { ++newNum; }
+			}
+			if (part.vtxNum + newNum > PART_VTX_MAX) {
+				mLayout.parts.push_back(part);
+				part.vtxOrg += part.vtxNum;
+				part.vtxNum = 0;
+				part.idxOrg += part.idxNum;
+				part.idxNum = 0;
+				remap_clear();
+				chunkIdx = SIZE_MAX;
 			}
+			if (chunkIdx == SIZE_MAX || mLayout.chunks[chunkIdx].idxNum == CHUNK_TRIS * 3) {
+				Chunk chunk;
+				chunk.idxOrg = i * 3;
+				chunk.idxNum = 0;
+				chunk.part = (uint32_t)mLayout.parts.size();
+				chunk.spacing = 0.0f;
+				chunk.bbMin = glm::vec3(FLT_MAX);
+				chunk.bbMax = glm::vec3(-FLT_MAX);
+				chunkIdx = mLayout.chunks.size();
+				mLayout.chunks.push_back(chunk);
+			}
+			Chunk& chunk = mLayout.chunks[chunkIdx];
+			for (int k = 0; k < 3; ++k) {
+				uint32_t slot = remap_slot(pTri[k]);
+				if (mRemapKeys[slot] == 0) {
+					mRemapKeys[slot] = pTri[k] + 1;
+					++part.vtxNum;
+				}
+				const TDGeometry::Point& pnt = pnts[pTri[k]];
+				glm::vec3 pos(pnt.x, pnt.y, pnt.z);
+				chunk.bbMin = glm::min(chunk.bbMin, pos);
+				chunk.bbMax = glm::max(chunk.bbMax, pos);
+			}
+			chunk.idxNum += 3;
+			part.idxNum += 3;
 		}
-		if (triNum <= 0) { return nullptr; }
+		mLayout.parts.push_back(part);
+		mLayout.vtxNum = part.vtxOrg + part.vtxNum;
+	}
+
+	// Open addressing with linear probing over a power of two table at
+	// least twice the size of a part; keys are point + 1, 0 marks an empty
+	// slot.
+	uint32_t Mesh::Streamer::remap_slot(uint32_t pnt) const {
+		const uint32_t mask = (uint32_t)mRemapKeys.size() - 1;
+		uint32_t slot = (pnt * 2654435761u) & mask;
+		while (mRemapKeys[slot] != 0 && mRemapKeys[slot] != pnt + 1) {
+			slot = (slot + 1) & mask;
+		}
+		return slot;
+	}
+
+	void Mesh::Streamer::remap_clear() {
+		std::fill(mRemapKeys.begin(), mRemapKeys.end(), 0);
+	}
+
+	// Replays the part's triangles as the constructor did, numbering the
+	// vertices in order of first use.
+	void Mesh::Streamer::load_part(const Part& part) {
+		const std::vector<uint32_t>& tris = mGeo.tris();
+		remap_clear();
+		mVtxOrder.clear();
+		for (uint32_t i = part.idxOrg; i < part.idxOrg + part.idxNum; ++i) {
+			uint32_t slot = remap_slot(tris[i]);
+			if (mRemapKeys[slot] == 0) {
+				mRemapKeys[slot] = tris[i] + 1;
+				mRemapVals[slot] = (uint16_t)mVtxOrder.size();
+				mVtxOrder.push_back(tris[i]);
+			}
+		}
+		mVtxDone = 0;
+		mTriDone = part.idxOrg / 3;
+		mPartReady = true;
+	}
+
+	static uint32_t morton_spread10(uint32_t v) {
+		v &= 0x3FF;
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v << 8)) & 0x0300F00F;
+		v = (v | (v << 4)) & 0x030C30C3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+
+	static uint32_t reverse_bits(uint32_t v, int bits) {
+		uint32_t r = 0;
+		for (int i = 0; i < bits; ++i) {
+			r = (r << 1) | ((v >> i) & 1);
+		}
+		return r;
+	}
+
+	// Point clouds are binned into a uniform grid sized for about CHUNK_PNTS
+	// points per cell, every non-empty cell becomes one chunk. Points of a
+	// cell are sorted along a Morton curve and emitted in bit-reversed order
+	// of their rank, so every prefix of a chunk is an evenly spread subset of
+	// it and far away chunks draw just a prefix. Points are drawn without
+	// indices and need no vertex limit, a single part holds them all.
+	void Mesh::Streamer::init_points() {
+		const std::vector<TDGeometry::Point>& pnts = mGeo.pnts();
+		uint32_t pntNum = mGeo.get_pnt_num();
+		mLayout.lit = mGeo.has_normals();
+		if (pntNum == 0) { return; }
+
+		int dim = (int)std::ceil(std::cbrt((float)pntNum / CHUNK_PNTS));
+		dim = std::min(std::max(dim, 1), MAX_CHUNK_GRID);
+		glm::vec3 invScale = glm::vec3(1.0f) / glm::max(mLayout.posScale, glm::vec3(1e-20f));
+		// cell << 30 | Morton code of the position within the cell
+		std::vector<uint64_t> keys(pntNum);
+		std::vector<uint32_t> order(pntNum);
+		for (uint32_t i = 0; i < pntNum; ++i) {
+			const TDGeometry::Point& pnt = pnts[i];
+			glm::vec3 t = (glm::vec3(pnt.x, pnt.y, pnt.z) - mLayout.posBase) * invScale * (float)dim;
+			uint32_t cell = 0;
+			uint32_t code = 0;
+			for (int j = 2; j >= 0; --j) {
+				int c = std::min(std::max((int)t[j], 0), dim - 1);
+				int q = std::min(std::max((int)((t[j] - c) * 1024.0f), 0), 1023);
+				cell = cell * dim + c;
+				code |= morton_spread10(q) << j;
+			}
+			keys[i] = ((uint64_t)cell << 30) | code;
+			order[i] = i;
+		}
+		int cellBits = 1;
+		while ((1u << cellBits) < (uint32_t)(dim * dim * dim)) { ++cellBits; }
+		TDRadixSort::sort_pairs(keys, order, 30 + cellBits);
+
+		mVtxOrder.reserve(pntNum);
+		for (uint32_t org = 0; org < pntNum;) {
+			uint32_t end = org + 1;
+			while (end < pntNum && (keys[end] >> 30) == (keys[org] >> 30)) { ++end; }
+			uint32_t num = end - org;
+			int bits = 0;
+			while ((1u << bits) < num) { ++bits; }
+			Chunk chunk;
+			chunk.idxOrg = org;
+			chunk.idxNum = num;
+			chunk.part = 0;
+			chunk.bbMin = glm::vec3(FLT_MAX);
+			chunk.bbMax = glm::vec3(-FLT_MAX);
+			for (uint32_t i = 0; i < (1u << bits); ++i) {
+				uint32_t rank = reverse_bits(i, bits);
+				if (rank >= num) { continue; }
+				uint32_t pntIdx = order[org + rank];
+				mVtxOrder.push_back(pntIdx);
+				const TDGeometry::Point& pnt = pnts[pntIdx];
+				glm::vec3 pos(pnt.x, pnt.y, pnt.z);
+				chunk.bbMin = glm::min(chunk.bbMin, pos);
+				chunk.bbMax = glm::max(chunk.bbMax, pos);
+			}
+			// scans are surfaces: spread over the two largest extents
+			glm::vec3 ext = chunk.bbMax - chunk.bbMin;
+			float e[3] = { ext.x, ext.y, ext.z };
+			std::sort(e, e + 3);
+			chunk.spacing = std::max(std::sqrt(e[2] * e[1] / num), e[2] / num);
+			mLayout.chunks.push_back(chunk);
+			org = end;
+		}
+		Part part = { 0, pntNum, 0, 0 };
+		mLayout.parts.push_back(part);
+		mLayout.vtxNum = pntNum;
+	}
+
+	void Mesh::Streamer::fill_vtx(Block& blk, const uint32_t* pSrc, uint32_t num, uint32_t vtxOrg) const {
+		const std::vector<TDGeometry::Point>& pnts = mGeo.pnts();
+		blk.kind = Block::VTX;
+		blk.byteOffset = (size_t)vtxOrg * sizeof(Vtx);
+		blk.bytes.resize(num * sizeof(Vtx));
+		Vtx* pVtx = (Vtx*)blk.bytes.data();
+		for (uint32_t i = 0; i < num; i++) {
+			const TDGeometry::Point& pnt = pnts[pSrc[i]];
+			Vtx& v = pVtx[i];
+			v.pos[0] = quantize_unorm16(pnt.x, mLayout.posBase.x, mLayout.posScale.x);
+			v.pos[1] = quantize_unorm16(pnt.y, mLayout.posBase.y, mLayout.posScale.y);
+			v.pos[2] = quantize_unorm16(pnt.z, mLayout.posBase.z, mLayout.posScale.z);
+			v.pos[3] = 0;
+			encode_oct_nrm(v.nrm, pnt.nx, pnt.ny, pnt.nz);
+			v.clr[0] = quantize_srgb8(pnt.r);
+			v.clr[1] = quantize_srgb8(pnt.g);
+			v.clr[2] = quantize_srgb8(pnt.b);
+			v.clr[3] = (uint8_t)(std::min(std::max(pnt.a, 0.0f), 1.0f) * 255.0f + 0.5f);
+		}
+	}
+
+	// Each part goes out as its vertices, then its indices.
+	bool Mesh::Streamer::next(Block& blk, size_t maxBytes) {
+		const uint32_t maxVtx = (uint32_t)std::max(maxBytes / sizeof(Vtx), (size_t)1);
+		if (mLayout.triNum == 0) {
+			if (mVtxDone >= mLayout.vtxNum) { return false; }
+			uint32_t num = std::min(mLayout.vtxNum - mVtxDone, maxVtx);
+			fill_vtx(blk, &mVtxOrder[mVtxDone], num, mVtxDone);
+			mVtxDone += num;
+			return true;
+		}
+		const std::vector<uint32_t>& tris = mGeo.tris();
+		while (mPartIdx < (uint32_t)mLayout.parts.size()) {
+			const Part& part = mLayout.parts[mPartIdx];
+			if (!mPartReady) {
+				load_part(part);
+			}
+			if (mVtxDone < part.vtxNum) {
+				uint32_t num = std::min(part.vtxNum - mVtxDone, maxVtx);
+				fill_vtx(blk, &mVtxOrder[mVtxDone], num, part.vtxOrg + mVtxDone);
+				mVtxDone += num;
+				return true;
+			}
+			uint32_t triEnd = (part.idxOrg + part.idxNum) / 3;
+			if (mTriDone < triEnd) {
+				const size_t triBytes = 3 * sizeof(uint16_t);
+				uint32_t num = std::min(triEnd - mTriDone, (uint32_t)std::max(maxBytes / triBytes, (size_t)1));
+				blk.kind = Block::IDX;
+				blk.byteOffset = (size_t)mTriDone * triBytes;
+				blk.bytes.resize(num * triBytes);
+				uint16_t* pIdx = (uint16_t*)blk.bytes.data();
+				for (uint32_t i = 0; i < num * 3; ++i) {
+					pIdx[i] = mRemapVals[remap_slot(tris[(size_t)mTriDone * 3 + i])];
+				}
+				mTriDone += num;
+				return true;
+			}
+			++mPartIdx;
+			mPartReady = false;
+		}
+		return false;
+	}
+
+	Mesh* Mesh::create(const Layout& layout) {
+		if (layout.vtxNum == 0) { return nullptr; }
 
 		uint32_t id[2];
 		glGenBuffers(2, id);
@@ -316,52 +1006,81 @@ namespace GLDraw {
 		}
 
 		Mesh* pMsh = new Mesh();
-		pMsh->mNumVtx = vtxNum;
-		pMsh->mNumTri = triNum;
+		pMsh->mNumVtx = layout.vtxNum;
+		pMsh->mNumTri = layout.triNum;
 		pMsh->mBuffIdVtx = id[0];
 		pMsh->mBuffIdIdx = id[1];
-
-		Mesh::Vtx* pVtx = new Vtx[vtxNum];
-		for (uint32_t i = 0; i < vtxNum; i++) {
-			TDGeometry::Point pnt = geo.get_pnt(i);
-			pVtx[i].pos = glm::vec3(pnt.x, pnt.y, pnt.z);
-			pVtx[i].nrm = glm::vec3(pnt.nx, pnt.ny, pnt.nz);
-			pVtx[i].clr = glm::vec3(pnt.r, pnt.g, pnt.b);
+		pMsh->mPosBase = layout.posBase;
+		pMsh->mPosScale = layout.posScale;
+		pMsh->mLit = layout.lit;
+		pMsh->mParts = layout.parts;
+		pMsh->mChunks = layout.chunks;
+		pMsh->mBounds.bbMin = glm::vec3(FLT_MAX);
+		pMsh->mBounds.bbMax = glm::vec3(-FLT_MAX);
+		for (const Chunk& chunk : layout.chunks) {
+			pMsh->mBounds.bbMin = glm::min(pMsh->mBounds.bbMin, chunk.bbMin);
+			pMsh->mBounds.bbMax = glm::max(pMsh->mBounds.bbMax, chunk.bbMax);
 		}
+		pMsh->mBounds.idxOrg = 0;
+		pMsh->mBounds.idxNum = layout.triNum > 0 ? layout.triNum * 3 : layout.vtxNum;
+		pMsh->mBounds.part = 0;
+		pMsh->mBounds.spacing = 0.0f;
+
 		glBindBuffer(GL_ARRAY_BUFFER, pMsh->mBuffIdVtx);
-		glBufferData(GL_ARRAY_BUFFER, vtxNum * sizeof(Vtx), pVtx, GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, layout.vtxNum * sizeof(Vtx), nullptr, GL_STATIC_DRAW);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		delete[] pVtx;
-
-		uint32_t vlst[6];
-		size_t sizeIB = triNum * 3 * pMsh->idx_bytes();
-		char* pIdx = new char[sizeIB];
-		if (pMsh->is_idx16()) {
-			uint16_t* pIB16 = (uint16_t*)pIdx;
-			for (uint32_t i = 0; i < polNum; i++) {
-				uint16_t n = get_pol_tris(vlst, geo, i);
-				for (uint16_t j = 0; j < 3 * n; j++) {
-					*pIB16++ = (uint16_t)vlst[j];
-				}
-			}
-		} else {
-			uint32_t* pIB32 = (uint32_t*)pIdx;
-			for (uint16_t i = 0; i < polNum; i++) {
-				int n = get_pol_tris(vlst, geo, i);
-				for (int j = 0; j < 3 * n; j++) {
-					*pIB32++ = (uint32_t)vlst[j];
-				}
-			}
-		}
+
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pMsh->mBuffIdIdx);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeIB, pIdx, GL_STATIC_DRAW);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, (size_t)layout.triNum * 3 * sizeof(uint16_t), nullptr, GL_STATIC_DRAW);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-		delete[] pIdx;
+
+		if (s_app.mES3) {
+			pMsh->mVAOs.resize(layout.parts.size());
+			glGenVertexArrays((GLsizei)pMsh->mVAOs.size(), pMsh->mVAOs.data());
+			for (size_t i = 0; i < layout.parts.size(); ++i) {
+				glBindVertexArray(pMsh->mVAOs[i]);
+				pMsh->bind_attrs(layout.parts[i]);
+			}
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		}
 
 		return pMsh;
 	}
 
+	void Mesh::upload(const Block& blk) {
+		GLenum target = blk.kind == Block::VTX ? GL_ARRAY_BUFFER : GL_ELEMENT_ARRAY_BUFFER;
+		glBindBuffer(target, blk.kind == Block::VTX ? mBuffIdVtx : mBuffIdIdx);
+		glBufferSubData(target, blk.byteOffset, blk.bytes.size(), blk.bytes.data());
+		glBindBuffer(target, 0);
+	}
+
+	Mesh* Mesh::create(const TDGeometry& geo) {
+		Streamer streamer(geo);
+		Mesh* pMsh = create(streamer.layout());
+		if (pMsh == nullptr) { return nullptr; }
+		Block blks[2];
+		bool more = streamer.next(blks[0], STAGE_BYTES);
+		for (int cur = 0; more; cur ^= 1) {
+			bool nextMore = false;
+			std::thread worker([&] { nextMore = streamer.next(blks[cur ^ 1], STAGE_BYTES); });
+			pMsh->upload(blks[cur]);
+			worker.join();
+			more = nextMore;
+		}
+		return pMsh;
+	}
+
 	void Mesh::destroy() {
+		if (!mVAOs.empty()) {
+			glDeleteVertexArrays((GLsizei)mVAOs.size(), mVAOs.data());
+			mVAOs.clear();
+		}
+		if (0 != mBuffIdInst) {
+			glDeleteBuffers(1, &mBuffIdInst);
+			mBuffIdInst = 0;
+		}
 		if (0 != mBuffIdIdx) {
 			glDeleteBuffers(1, &mBuffIdIdx);
 			mBuffIdIdx = 0;
@@ -370,60 +1089,220 @@ namespace GLDraw {
 			glDeleteBuffers(1, &mBuffIdVtx);
 			mBuffIdVtx = 0;
 		}
+		mParts.clear();
+		mChunks.clear();
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	}
 
-	void Mesh::draw(const glm::mat4x4& worldMtx) {
-		if (!GLSys::valid()) { return; }
-		if (0 == mBuffIdVtx) { return; }
-		if (0 == mBuffIdIdx) { return; }
-
-		glUseProgram(s_app.mGPU.programId);
-
-		glUniform3f(s_app.mGPU.prmLocInvGamma, 1.0f / s_app.mGamma.r, 1.0f / s_app.mGamma.g, 1.0f / s_app.mGamma.b);
-		glUniform3fv(s_app.mGPU.prmLocHemiSky, 1, (float*)&s_app.mLight.sky);
-		glUniform3fv(s_app.mGPU.prmLocHemiGround, 1, (float*)&s_app.mLight.ground);
-		glUniform3fv(s_app.mGPU.prmLocHemiUp, 1, (float*)&s_app.mLight.up);
-
-		glUniform3fv(s_app.mGPU.prmSpecDir, 1, (float*)&s_app.mLight.specDir);
-		glUniform3fv(s_app.mGPU.prmSpecClr, 1, (float*)&s_app.mLight.specClr);
-		glUniform1f(s_app.mGPU.prmSpecRough, mRoughness);
-
-		glUniform3fv(s_app.mGPU.prmLocViewPos, 1, (float*)&s_app.mView.mPos);
-
-		glm::mat4x4 tm = glm::transpose(s_app.mView.mViewProjMtx);
-		glUniformMatrix4fv(s_app.mGPU.prmLocViewProj, 1, GL_FALSE, (float*)&tm);
-		tm = glm::transpose(worldMtx);
-		glUniform4fv(s_app.mGPU.prmLocWMtx, 3, (float*)&tm);
-
-		glEnable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LEQUAL);
-#if 0
-		glEnable(GL_CULL_FACE);
-		glFrontFace(GL_CCW); // TD
-		glCullFace(GL_BACK);
-#endif
-
+	// The part's vertex base goes into the attribute offsets, so its 16-bit
+	// indices work without glDrawElementsBaseVertex (ES 3.2).
+	void Mesh::bind_attrs(const Part& part) const {
 		const GLsizei vstride = (GLsizei)sizeof(Mesh::Vtx);
+		const size_t vbase = (size_t)part.vtxOrg * sizeof(Mesh::Vtx);
 		glBindBuffer(GL_ARRAY_BUFFER, mBuffIdVtx);
 		glEnableVertexAttribArray(s_app.mGPU.attrLocPos);
-		glVertexAttribPointer(s_app.mGPU.attrLocPos, 3, GL_FLOAT, GL_FALSE, vstride, (const void*)offsetof(Mesh::Vtx, pos));
+		glVertexAttribPointer(s_app.mGPU.attrLocPos, 4, GL_UNSIGNED_SHORT, GL_TRUE, vstride, (const void*)(vbase + offsetof(Mesh::Vtx, pos)));
 		glEnableVertexAttribArray(s_app.mGPU.attrLocNrm);
-		glVertexAttribPointer(s_app.mGPU.attrLocNrm, 3, GL_FLOAT, GL_FALSE, vstride, (const void*)offsetof(Mesh::Vtx, nrm));
+		glVertexAttribPointer(s_app.mGPU.attrLocNrm, 2, GL_SHORT, GL_TRUE, vstride, (const void*)(vbase + offsetof(Mesh::Vtx, nrm)));
 		glEnableVertexAttribArray(s_app.mGPU.attrLocClr);
-		glVertexAttribPointer(s_app.mGPU.attrLocClr, 3, GL_FLOAT, GL_FALSE, vstride, (const void*)offsetof(Mesh::Vtx, clr));
-
+		glVertexAttribPointer(s_app.mGPU.attrLocClr, 4, GL_UNSIGNED_BYTE, GL_TRUE, vstride, (const void*)(vbase + offsetof(Mesh::Vtx, clr)));
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mBuffIdIdx);
-		glDrawElements(GL_TRIANGLES, mNumTri * 3, is_idx16() ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, 0);
+	}
 
-		glDisableVertexAttribArray(s_app.mGPU.attrLocPos);
-		glDisableVertexAttribArray(s_app.mGPU.attrLocNrm);
-		glDisableVertexAttribArray(s_app.mGPU.attrLocClr);
+	bool Mesh::bind() const {
+		if (!GLSys::valid()) { return false; }
+		if (0 == mBuffIdVtx) { return false; }
+		if (0 == mBuffIdIdx) { return false; }
 
+		s_app.bind_frame();
+		glUniform1f(s_app.mGPU.prmSpecRough, mRoughness);
+		glUniform3fv(s_app.mGPU.prmLocPosBase, 1, (float*)&mPosBase);
+		glUniform3fv(s_app.mGPU.prmLocPosScale, 1, (float*)&mPosScale);
+		glUniform1f(s_app.mGPU.prmLocLit, mLit ? 1.0f : 0.0f);
+		return true;
+	}
+
+	void Mesh::bind_part(uint32_t idx) const {
+		if (!mVAOs.empty()) {
+			glBindVertexArray(mVAOs[idx]);
+		} else {
+			bind_attrs(mParts[idx]);
+		}
+	}
+
+	void Mesh::unbind() const {
+		if (!mVAOs.empty()) {
+			glBindVertexArray(0);
+		} else {
+			glDisableVertexAttribArray(s_app.mGPU.attrLocPos);
+			glDisableVertexAttribArray(s_app.mGPU.attrLocNrm);
+			glDisableVertexAttribArray(s_app.mGPU.attrLocClr);
+		}
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+
+	void Mesh::draw(const glm::mat4x4& worldMtx) {
+		if (mNumTri == 0) {
+			draw_points(worldMtx);
+			return;
+		}
+		glm::mat4x4 clipMtx = s_app.mView.mViewProjMtx * worldMtx;
+		if (!chunk_visible(mBounds, clipMtx)) {
+			++s_app.mStats.instancesCulled;
+			s_app.mStats.chunksCulled += (int)mChunks.size();
+			return;
+		}
+		s_drawCounts.clear();
+		s_drawOffsets.clear();
+		s_drawParts.clear();
+		uint32_t rangeEnd = 0;
+		for (const Chunk& chunk : mChunks) {
+			if (!chunk_visible(chunk, clipMtx)) {
+				++s_app.mStats.chunksCulled;
+				continue;
+			}
+			++s_app.mStats.chunksDrawn;
+			s_app.mStats.trisDrawn += chunk.idxNum / 3;
+			if (!s_drawCounts.empty() && rangeEnd == chunk.idxOrg && s_drawParts.back() == chunk.part) {
+				s_drawCounts.back() += chunk.idxNum;
+			} else {
+				s_drawCounts.push_back(chunk.idxNum);
+				s_drawOffsets.push_back((const void*)(chunk.idxOrg * sizeof(uint16_t)));
+				s_drawParts.push_back(chunk.part);
+			}
+			rangeEnd = chunk.idxOrg + chunk.idxNum;
+		}
+		if (s_drawCounts.empty()) { return; }
+		if (!bind()) { return; }
+		++s_app.mStats.instancesDrawn;
 
+		// the world matrix rows are instanced attributes, without an array
+		// bound they take these constant values
+		glm::mat4x4 tm = glm::transpose(worldMtx);
+		for (int i = 0; i < 3; ++i) {
+			glVertexAttrib4fv(s_app.mGPU.attrLocWMtx[i], (float*)&tm[i]);
+		}
+
+		// ranges are in part order, each run of one part is a batch
+		GLsizei rangeNum = (GLsizei)s_drawCounts.size();
+		for (GLsizei org = 0; org < rangeNum;) {
+			GLsizei end = org + 1;
+			while (end < rangeNum && s_drawParts[end] == s_drawParts[org]) { ++end; }
+			bind_part(s_drawParts[org]);
+			GLsizei drawNum = end - org;
+			if (drawNum > 1 && s_app.mpMultiDrawElements) {
+				s_app.mpMultiDrawElements(GL_TRIANGLES, &s_drawCounts[org], GL_UNSIGNED_SHORT, &s_drawOffsets[org], drawNum);
+				++s_app.mStats.drawCalls;
+			} else {
+				for (GLsizei i = org; i < end; ++i) {
+					glDrawElements(GL_TRIANGLES, s_drawCounts[i], GL_UNSIGNED_SHORT, s_drawOffsets[i]);
+				}
+				s_app.mStats.drawCalls += drawNum;
+			}
+			org = end;
+		}
+		unbind();
+	}
+
+	// Point chunks pick their density from the distance to the camera, so
+	// each point cloud instance is drawn on its own.
+	void Mesh::draw_points(const glm::mat4x4& worldMtx) {
+		glm::mat4x4 clipMtx = s_app.mView.mViewProjMtx * worldMtx;
+		if (!chunk_visible(mBounds, clipMtx)) {
+			++s_app.mStats.instancesCulled;
+			s_app.mStats.chunksCulled += (int)mChunks.size();
+			return;
+		}
+		if (!bind()) { return; }
+		++s_app.mStats.instancesDrawn;
+
+		glm::mat4x4 tm = glm::transpose(worldMtx);
+		for (int i = 0; i < 3; ++i) {
+			glVertexAttrib4fv(s_app.mGPU.attrLocWMtx[i], (float*)&tm[i]);
+		}
+		bind_part(0);
+
+		const GLESApp::VIEW& view = s_app.mView;
+		float pxPerUnit = (float)view.mHeight / (2.0f * std::tan(view.mFOVY * 0.5f));
+		float worldScale = std::cbrt(glm::length(glm::vec3(worldMtx[0])) * glm::length(glm::vec3(worldMtx[1])) * glm::length(glm::vec3(worldMtx[2])));
+		for (const Chunk& chunk : mChunks) {
+			if (!chunk_visible(chunk, clipMtx)) {
+				++s_app.mStats.chunksCulled;
+				continue;
+			}
+			// nearest the chunk can get, so its front isn't drawn too sparse
+			glm::vec3 center = glm::vec3(worldMtx * glm::vec4((chunk.bbMin + chunk.bbMax) * 0.5f, 1.0f));
+			float radius = glm::length(chunk.bbMax - chunk.bbMin) * 0.5f * worldScale;
+			float dist = std::max(glm::distance(center, view.mPos) - radius, view.mNear);
+			float spacingPx = chunk.spacing * worldScale * pxPerUnit / dist;
+			float frac = std::min(1.0f, spacingPx * spacingPx / (POINT_LOD_PX * POINT_LOD_PX));
+			uint32_t num = std::max((uint32_t)(chunk.idxNum * frac), std::min(chunk.idxNum, POINT_LOD_MIN));
+			// sparser subsets get bigger points to close the gaps
+			float size = s_app.mPointScale * chunk.spacing * worldScale * pxPerUnit * std::sqrt((float)chunk.idxNum / num);
+			glUniform1f(s_app.mGPU.prmLocPointSize, size);
+			glDrawArrays(GL_POINTS, chunk.idxOrg, num);
+			++s_app.mStats.chunksDrawn;
+			++s_app.mStats.drawCalls;
+			s_app.mStats.pointsDrawn += num;
+		}
+		unbind();
+	}
+
+	// Whole instances are culled against the mesh bounds, the visible ones
+	// go out in a single instanced draw. Without ES3 or with one instance
+	// this falls back to draw(), which also culls individual chunks; point
+	// clouds always do.
+	void Mesh::draw_instances(const glm::mat4x4* pWorldMtx, int num) {
+		if (num == 1 || !s_app.mES3 || mNumTri == 0) {
+			for (int i = 0; i < num; ++i) {
+				draw(pWorldMtx[i]);
+			}
+			return;
+		}
+
+		s_instRows.clear();
+		for (int i = 0; i < num; ++i) {
+			if (!chunk_visible(mBounds, s_app.mView.mViewProjMtx * pWorldMtx[i])) {
+				++s_app.mStats.instancesCulled;
+				continue;
+			}
+			glm::mat4x4 tm = glm::transpose(pWorldMtx[i]);
+			s_instRows.push_back(tm[0]);
+			s_instRows.push_back(tm[1]);
+			s_instRows.push_back(tm[2]);
+		}
+		GLsizei instNum = (GLsizei)(s_instRows.size() / 3);
+		if (instNum == 0) { return; }
+		if (!bind()) { return; }
+
+		if (0 == mBuffIdInst) {
+			glGenBuffers(1, &mBuffIdInst);
+		}
+		const GLsizei istride = (GLsizei)(sizeof(glm::vec4) * 3);
+		glBindBuffer(GL_ARRAY_BUFFER, mBuffIdInst);
+		glBufferData(GL_ARRAY_BUFFER, s_instRows.size() * sizeof(glm::vec4), s_instRows.data(), GL_STREAM_DRAW);
+		for (uint32_t p = 0; p < (uint32_t)mParts.size(); ++p) {
+			const Part& part = mParts[p];
+			bind_part(p);
+			glBindBuffer(GL_ARRAY_BUFFER, mBuffIdInst);
+			for (int i = 0; i < 3; ++i) {
+				GLint loc = s_app.mGPU.attrLocWMtx[i];
+				glEnableVertexAttribArray(loc);
+				glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, istride, (const void*)(sizeof(glm::vec4) * i));
+				glVertexAttribDivisor(loc, 1);
+			}
+			glDrawElementsInstanced(GL_TRIANGLES, part.idxNum, GL_UNSIGNED_SHORT, (const void*)(part.idxOrg * sizeof(uint16_t)), instNum);
+			++s_app.mStats.drawCalls;
+			for (int i = 0; i < 3; ++i) {
+				glDisableVertexAttribArray(s_app.mGPU.attrLocWMtx[i]);
+			}
+		}
+		s_app.mStats.instancesDrawn += instNum;
+		s_app.mStats.chunksDrawn += instNum * (int)mChunks.size();
+		s_app.mStats.trisDrawn += instNum * mNumTri;
+		unbind();
 	}
 
 	glm::mat4x4 scl(const glm::vec3& s) { return glm::scale(glm::mat4x4(1.0f), s); }
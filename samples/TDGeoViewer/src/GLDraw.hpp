@@ -1,3 +1,5 @@
+#pragma once
+
 #include <glm.hpp>
 #define GLM_FORCE_RADIANS
 #include <gtc/matrix_transform.hpp>
@@ -9,6 +11,7 @@ struct GLDrawCfg {
 	int y;
 	int w;
 	int h;
+	bool headless;
 };
 
 namespace GLDraw {
@@ -17,6 +20,7 @@ namespace GLDraw {
 	void begin();
 	void end();
 	void loop(void(*pLoop)());
+	void quit();
 
 	void set_view(const glm::vec3& pos, const glm::vec3& tgt, const glm::vec3& up = glm::vec3(0, 1, 0));
 	void set_FOVY_degrees(float deg);
@@ -25,29 +29,157 @@ namespace GLDraw {
 	void set_hemi_light(const glm::vec3& sky, const glm::vec3& ground, const glm::vec3& up);
 	void set_spec_light(const glm::vec3& dir, const glm::vec3& clr);
 
+	// Per-frame counters, reset by begin().
+	struct DrawStats {
+		int chunksDrawn;
+		int chunksCulled;
+		int drawCalls;
+		int trisDrawn;
+		int pointsDrawn;
+		int instancesDrawn;
+		int instancesCulled;
+	};
+	const DrawStats& get_stats();
+	void set_title(const char* pTitle);
+	// Frame time measured on the GPU a few frames ago, -1 when the driver
+	// has no EXT_disjoint_timer_query or no result has arrived yet.
+	float get_gpu_ms();
+	// Text drawn over the top-left corner of every frame until changed.
+	void set_overlay(const std::string& text);
+	// Writes the next finished frame to a binary PPM file.
+	void save_frame(const std::string& path);
+	// Point clouds: point size relative to the estimated point spacing, 1
+	// by default.
+	void set_point_scale(float scale);
+
 	class Mesh {
+	public:
+		// Packed vertex, 16 bytes:
+		// pos - position quantized to 16 bits against the mesh bbox (w unused),
+		// nrm - octahedral-encoded normal, snorm16,
+		// clr - sRGB-encoded color and alpha.
+		// The vertex shader decodes all three.
+		struct Vtx {
+			uint16_t pos[4];
+			int16_t nrm[2];
+			uint8_t clr[4];
+		};
+
+		// Range of the vertex buffer with at most 65536 vertices and the
+		// triangles indexing it: indices are 16-bit and relative to vtxOrg.
+		// Points used by several parts are duplicated.
+		struct Part {
+			uint32_t vtxOrg;
+			uint32_t vtxNum;
+			uint32_t idxOrg;
+			uint32_t idxNum;
+		};
+
+		// Run of consecutive triangles, a contiguous range of the index buffer
+		// within a single part. Meshes without triangles are point clouds:
+		// their chunks are ranges of vertices (idxOrg, idxNum) drawn as
+		// points, in an order where every prefix is an even subsample.
+		struct Chunk {
+			glm::vec3 bbMin;
+			glm::vec3 bbMax;
+			uint32_t idxOrg;
+			uint32_t idxNum;
+			uint32_t part;
+			float spacing; // point clouds: distance between points, estimated
+		};
+
+		// Everything about a mesh except its vertex and index data.
+		struct Layout {
+			uint32_t vtxNum; // GPU vertices, including duplicates
+			uint32_t triNum;
+			glm::vec3 posBase;
+			glm::vec3 posScale;
+			std::vector<Part> parts;
+			std::vector<Chunk> chunks;
+			bool lit; // false for point clouds without normals, drawn in plain color
+		};
+
+		// Piece of GPU-ready vertex or index data placed at byteOffset.
+		struct Block {
+			enum Kind {
+				VTX,
+				IDX
+			};
+			Kind kind;
+			size_t byteOffset;
+			std::vector<uint8_t> bytes;
+		};
+
+		// Converts geometry into Blocks of bounded size. Only the layout is
+		// built up front, the vertices and 16-bit indices of a part are
+		// generated when its blocks are requested, so for triangle meshes
+		// host memory beyond the geometry and the layout stays constant
+		// however large the mesh is. Chunks follow the triangle order of geo,
+		// sorting it along a space-filling curve first (TDGeometry::reorder)
+		// keeps them compact. Point clouds keep their whole draw order, 4
+		// bytes per point.
+		// Makes no GL calls and may run on any thread; geo must outlive it.
+		class Streamer {
+			const TDGeometry& mGeo;
+			Layout mLayout;
+			std::vector<uint32_t> mVtxOrder; // source point of every vertex of the current part, of all for points
+			std::vector<uint32_t> mRemapKeys; // point to part-local vertex
+			std::vector<uint16_t> mRemapVals;
+			uint32_t mPartIdx;
+			bool mPartReady;
+			uint32_t mVtxDone; // within the current part
+			uint32_t mTriDone;
+
+			void init_points();
+			uint32_t remap_slot(uint32_t pnt) const;
+			void remap_clear();
+			void load_part(const Part& part);
+			void fill_vtx(Block& blk, const uint32_t* pSrc, uint32_t num, uint32_t vtxOrg) const;
+		public:
+			Streamer(const TDGeometry& geo);
+			const Layout& layout() const { return mLayout; }
+			// Returns false once all data has been produced.
+			bool next(Block& blk, size_t maxBytes);
+		};
 
 	private:
-		Mesh() : mNumVtx(0), mNumTri(0), mBuffIdVtx(0), mBuffIdIdx(0), mRoughness(0.001){};
+		Mesh() : mNumVtx(0), mNumTri(0), mBuffIdVtx(0), mBuffIdIdx(0), mBuffIdInst(0), mRoughness(0.001), mPosBase(0.0f), mPosScale(1.0f), mLit(true) {};
 
-		bool is_idx16() const { return mNumVtx <= (1 << 16); }
-		int idx_bytes() const;
+		bool chunk_visible(const Chunk& chunk, const glm::mat4x4& clipMtx) const;
+		void bind_attrs(const Part& part) const;
+		bool bind() const;
+		void bind_part(uint32_t idx) const;
+		void unbind() const;
+		void draw_points(const glm::mat4x4& worldMtx);
 		int mNumVtx;
 		int mNumTri;
 		uint32_t mBuffIdVtx;
 		uint32_t mBuffIdIdx;
+		uint32_t mBuffIdInst;
+		std::vector<uint32_t> mVAOs; // one per part
 		float mRoughness;
+		glm::vec3 mPosBase;
+		glm::vec3 mPosScale;
+		bool mLit;
+		std::vector<Part> mParts;
+		std::vector<Chunk> mChunks;
+		Chunk mBounds;
 	public:
-		struct Vtx {
-			glm::vec3 pos;
-			glm::vec3 nrm;
-			glm::vec3 clr;
-		};
-
+		// Allocates GPU storage only, the data follows with upload().
+		static Mesh* create(const Layout& layout);
+		void upload(const Block& blk);
+		// Streams geo through two staging blocks, the next one is converted
+		// on a worker thread while the current one uploads.
 		static Mesh* create(const TDGeometry& geo);
 		void destroy();
+		// Chunks outside the view frustum are skipped, the rest are
+		// merged into as few index ranges as possible. Point cloud chunks
+		// draw only as many points as their size on screen needs.
 		void draw(const glm::mat4x4& worldMtx);
+		// Draws num copies, one per world matrix, instanced where supported.
+		void draw_instances(const glm::mat4x4* pWorldMtx, int num);
 		void set_roughness(float roughness) { mRoughness = roughness; }
+		size_t get_gpu_bytes() const { return (size_t)mNumVtx * sizeof(Vtx) + (size_t)mNumTri * 3 * sizeof(uint16_t); }
 	};
 
 	glm::mat4x4 xformSRTXYZ(const glm::vec3& translate, const glm::vec3& rotateDegrees, const glm::vec3& scale = glm::vec3(1.0f));
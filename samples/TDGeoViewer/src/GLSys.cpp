@@ -22,7 +22,10 @@ extern const char* s_applicationName;
 #endif
 
 #include <iostream>
+#include <fstream>
+#include <vector>
 #include <cstdarg>
+#include <cstring>
 
 #include "GLSys.hpp"
 
@@ -54,6 +57,32 @@ bool gl_error() {
 	return false;
 }
 
+// OES_get_program_binary, same entry points in ES3 core
+typedef void (GL_APIENTRY* PFN_GET_PROGRAM_BINARY)(GLuint program, GLsizei bufSize, GLsizei* pLength, GLenum* pFormat, void* pBinary);
+typedef void (GL_APIENTRY* PFN_PROGRAM_BINARY)(GLuint program, GLenum format, const void* pBinary, GLint length);
+static const GLenum PROGRAM_BINARY_LENGTH = 0x8741;
+static const GLenum NUM_PROGRAM_BINARY_FORMATS = 0x87FE;
+static const uint32_t PROG_CACHE_MAGIC = 0x42504454; // "TDPB"
+static const uint32_t PROG_CACHE_VERSION = 1;
+
+struct ProgCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t size;
+};
+
+struct ProgBinFuncs {
+	PFN_GET_PROGRAM_BINARY pGetProgramBinary;
+	PFN_PROGRAM_BINARY pProgramBinary;
+};
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#	define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+typedef EGLDisplay (EGLAPIENTRY* PFN_GET_PLATFORM_DISPLAY)(EGLenum platform, void* pNativeDisplay, const EGLint* pAttribs);
+
 bool egl_has_extention(EGLDisplay eglDisplay, const char* name) {
 	const char* extns = eglQueryString(eglDisplay, EGL_EXTENSIONS);
 	return extns != NULL && strstr(extns, name);
@@ -78,6 +107,8 @@ static struct GLSysGlobal {
 	int mWndH;
 	int mWidth;
 	int mHeight;
+	bool mHeadless;
+	bool mQuit;
 
 	struct EGL {
 		EGLDisplay display;
@@ -107,6 +138,8 @@ static struct GLSysGlobal {
 	void init_sys();
 	void init_wnd();
 	void init_egl();
+	void init_egl_headless();
+	bool init_egl_ctx(EGLint surfaceType);
 
 	void reset_sys();
 	void reset_wnd();
@@ -123,17 +156,26 @@ namespace GLSys {
 		s_global.mWndOrgY = cfg.y;
 		s_global.mWidth = cfg.w;
 		s_global.mHeight = cfg.h;
-		s_global.init_sys();
-		s_global.init_wnd();
-		s_global.init_egl();
+		s_global.mHeadless = cfg.headless;
+		if (cfg.headless) {
+			s_global.init_egl_headless();
+		} else {
+			s_global.init_sys();
+			s_global.init_wnd();
+			s_global.init_egl();
+		}
 		s_initFlg = true;
 	}
 
 	void reset() {
 		if (!s_initFlg) return;
-		s_global.reset_sys();
-		s_global.reset_egl();
-		s_global.reset_wnd();
+		if (s_global.mHeadless) {
+			s_global.reset_egl();
+		} else {
+			s_global.reset_sys();
+			s_global.reset_egl();
+			s_global.reset_wnd();
+		}
 		s_initFlg = false;
 	}
 
@@ -141,14 +183,36 @@ namespace GLSys {
 		s_global.stop_egl();
 	}
 
+	// A pbuffer swap is a no-op, finishing the frame instead keeps headless
+	// timings honest.
 	void swap() {
-		eglSwapBuffers(s_global.mEGL.display, s_global.mEGL.surface);
+		if (s_global.mHeadless) {
+			glFinish();
+		} else {
+			eglSwapBuffers(s_global.mEGL.display, s_global.mEGL.surface);
+		}
+	}
+
+	void quit() {
+		s_global.mQuit = true;
 	}
 
 	bool valid() {
 		return s_global.valid_egl();
 	}
 
+	void set_title(const char* pTitle) {
+#ifdef _WIN32
+		if (s_global.mNativeWindow) {
+			SetWindowTextA(s_global.mNativeWindow, pTitle);
+		}
+#elif defined(X11)
+		if (s_global.mpNativeDisplay) {
+			XStoreName(s_global.mpNativeDisplay, s_global.mNativeWindow, pTitle);
+		}
+#endif
+	}
+
 	GLuint compile_shader_str(const std::string& src, GLenum kind) {
 		GLuint sid = 0;
 		if (valid() && !src.empty()) {
@@ -251,6 +315,117 @@ namespace GLSys {
 		return pid;
 	}
 
+	static bool get_prog_bin_funcs(ProgBinFuncs& fn) {
+		fn.pGetProgramBinary = nullptr;
+		fn.pProgramBinary = nullptr;
+		const char* pVer = (const char*)glGetString(GL_VERSION);
+		const char* pExts = (const char*)glGetString(GL_EXTENSIONS);
+		if (pExts && strstr(pExts, "GL_OES_get_program_binary")) {
+			fn.pGetProgramBinary = (PFN_GET_PROGRAM_BINARY)eglGetProcAddress("glGetProgramBinaryOES");
+			fn.pProgramBinary = (PFN_PROGRAM_BINARY)eglGetProcAddress("glProgramBinaryOES");
+		} else if (pVer && strstr(pVer, "OpenGL ES 3")) {
+			fn.pGetProgramBinary = (PFN_GET_PROGRAM_BINARY)eglGetProcAddress("glGetProgramBinary");
+			fn.pProgramBinary = (PFN_PROGRAM_BINARY)eglGetProcAddress("glProgramBinary");
+		}
+		if (!fn.pGetProgramBinary || !fn.pProgramBinary) { return false; }
+		GLint numFormats = 0;
+		glGetIntegerv(NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+		return numFormats > 0;
+	}
+
+	static uint64_t hash_str(const char* pStr, uint64_t h) {
+		// FNV-1a, terminator included so "ab"+"c" != "a"+"bc"
+		do {
+			h ^= (uint8_t)*pStr;
+			h *= 0x100000001B3ull;
+		} while (*pStr++);
+		return h;
+	}
+
+	static uint64_t prog_cache_key(const std::string& srcVtx, const std::string& srcFrag) {
+		uint64_t h = 0xCBF29CE484222325ull;
+		h = hash_str(srcVtx.c_str(), h);
+		h = hash_str(srcFrag.c_str(), h);
+		const GLenum strs[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		for (GLenum str : strs) {
+			const char* pStr = (const char*)glGetString(str);
+			h = hash_str(pStr ? pStr : "", h);
+		}
+		return h;
+	}
+
+	static GLuint load_prog_binary(const ProgBinFuncs& fn, const std::string& cachePath, uint64_t key) {
+		std::ifstream is(cachePath, std::ios::binary);
+		if (!is.good()) { return 0; }
+		ProgCacheHeader hdr;
+		if (!is.read((char*)&hdr, sizeof(hdr))) { return 0; }
+		if (hdr.magic != PROG_CACHE_MAGIC || hdr.version != PROG_CACHE_VERSION || hdr.key != key || hdr.size == 0) {
+			sys_dbg_msg("%s is stale", cachePath.c_str());
+			return 0;
+		}
+		std::vector<char> bin(hdr.size);
+		if (!is.read(bin.data(), bin.size())) { return 0; }
+
+		GLuint pid = glCreateProgram();
+		if (!pid) { return 0; }
+		while (glGetError() != GL_NO_ERROR) {}
+		fn.pProgramBinary(pid, hdr.format, bin.data(), (GLint)bin.size());
+		GLint status = 0;
+		if (glGetError() == GL_NO_ERROR) {
+			glGetProgramiv(pid, GL_LINK_STATUS, &status);
+		}
+		if (!status) {
+			sys_dbg_msg("%s rejected by the driver", cachePath.c_str());
+			glDeleteProgram(pid);
+			return 0;
+		}
+		return pid;
+	}
+
+	static void save_prog_binary(const ProgBinFuncs& fn, GLuint pid, const std::string& cachePath, uint64_t key) {
+		GLint len = 0;
+		glGetProgramiv(pid, PROGRAM_BINARY_LENGTH, &len);
+		if (len <= 0) { return; }
+		std::vector<char> bin(len);
+		GLsizei got = 0;
+		GLenum format = 0;
+		fn.pGetProgramBinary(pid, len, &got, &format, bin.data());
+		if (got <= 0) { return; }
+		ProgCacheHeader hdr;
+		hdr.magic = PROG_CACHE_MAGIC;
+		hdr.version = PROG_CACHE_VERSION;
+		hdr.key = key;
+		hdr.format = format;
+		hdr.size = (uint32_t)got;
+		std::ofstream os(cachePath, std::ios::binary);
+		os.write((const char*)&hdr, sizeof(hdr));
+		os.write(bin.data(), got);
+	}
+
+	GLuint load_prog_cached(const std::string& srcVtx, const std::string& srcFrag, const std::string& cachePath, GLuint* pSIdVtx, GLuint* pSIdFrag) {
+		if (!valid() || srcVtx.empty() || srcFrag.empty()) { return 0; }
+		ProgBinFuncs fn;
+		bool cacheable = get_prog_bin_funcs(fn);
+		uint64_t key = cacheable ? prog_cache_key(srcVtx, srcFrag) : 0;
+		if (cacheable) {
+			GLuint pid = load_prog_binary(fn, cachePath, key);
+			if (pid) {
+				if (pSIdVtx) {
+					*pSIdVtx = 0;
+				}
+				if (pSIdFrag) {
+					*pSIdFrag = 0;
+				}
+				return pid;
+			}
+		}
+		GLuint pid = compile_prog_strs(srcVtx, srcFrag, pSIdVtx, pSIdFrag);
+		if (pid && cacheable) {
+			save_prog_binary(fn, pid, cachePath, key);
+		}
+		return pid;
+	}
+
 }
 
 void GLSysGlobal::init_egl() {
@@ -264,26 +439,54 @@ void GLSysGlobal::init_egl() {
 		sys_dbg_msg("Failed to get and EGLDisplay");
 		return;
 	}
+	if (init_egl_ctx(EGL_WINDOW_BIT)) {
+		eglSwapInterval(mEGL.display, 1);
+	}
+	sys_dbg_msg("finished");
+}
+
+// Mesa's surfaceless platform needs neither a display server nor a GPU
+// (llvmpipe); other drivers get the default display.
+void GLSysGlobal::init_egl_headless() {
+	sys_dbg_msg("init_egl_headless()");
+	const char* clientExts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (clientExts && strstr(clientExts, "EGL_MESA_platform_surfaceless")) {
+		PFN_GET_PLATFORM_DISPLAY pGetPlatformDisplay = (PFN_GET_PLATFORM_DISPLAY)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (pGetPlatformDisplay) {
+			mEGL.display = pGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+		}
+	}
+	if (!valid_display()) {
+		mEGL.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+	if (!valid_display()) {
+		sys_dbg_msg("Failed to get and EGLDisplay");
+		return;
+	}
+	init_egl_ctx(EGL_PBUFFER_BIT);
+	sys_dbg_msg("finished");
+}
 
+bool GLSysGlobal::init_egl_ctx(EGLint surfaceType) {
 	int verMaj = 0;
 	int verMin = 0;
 	bool flg = eglInitialize(mEGL.display, &verMaj, &verMin);
-	if (!flg) return;
+	if (!flg) return false;
 	sys_dbg_msg("EGL %d.%d\n", verMaj, verMin);
 	flg = eglBindAPI(EGL_OPENGL_ES_API);
 	if (flg != EGL_TRUE) {
 		sys_dbg_msg("eglBindAPI failed");
-		return;
+		return false;
 	}
 	bool hasCreateCtxExt = egl_has_extention(mEGL.display, "EGL_KHR_create_context");
 	EGLint ctxType = hasCreateCtxExt ? EGL_OPENGL_ES3_BIT_KHR : EGL_OPENGL_ES2_BIT;
-	static EGLint cfgAttrs[] = {
+	EGLint cfgAttrs[] = {
 		EGL_RED_SIZE, 8,
 		EGL_GREEN_SIZE, 8,
 		EGL_BLUE_SIZE, 8,
 		EGL_ALPHA_SIZE, 8,
 		EGL_DEPTH_SIZE, 24,
-		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+		EGL_SURFACE_TYPE, surfaceType,
 		EGL_RENDERABLE_TYPE, ctxType,
 		EGL_NONE
 	};
@@ -292,16 +495,25 @@ void GLSysGlobal::init_egl() {
 	if (flg) flg = ncfg == 1;
 	if (!flg) {
 		sys_dbg_msg("eglChooseConfig failed");
-		return;
+		return false;
 	}
 
-	mEGL.surface = eglCreateWindowSurface(mEGL.display, mEGL.config, (EGLNativeWindowType)mNativeWindow, nullptr);
+	if (surfaceType == EGL_PBUFFER_BIT) {
+		EGLint pbufAttrs[] = {
+			EGL_WIDTH, mWidth,
+			EGL_HEIGHT, mHeight,
+			EGL_NONE
+		};
+		mEGL.surface = eglCreatePbufferSurface(mEGL.display, mEGL.config, pbufAttrs);
+	} else {
+		mEGL.surface = eglCreateWindowSurface(mEGL.display, mEGL.config, (EGLNativeWindowType)mNativeWindow, nullptr);
+	}
 	if (!valid_surface()) {
-		sys_dbg_msg("eglCreateWindowSurface failed");
-		return;
+		sys_dbg_msg("eglCreate*Surface failed");
+		return false;
 	}
 
-	static EGLint ctxAttrs[] = {
+	EGLint ctxAttrs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, hasCreateCtxExt ? 3 : 2,
 		EGL_NONE
 	};
@@ -309,14 +521,14 @@ void GLSysGlobal::init_egl() {
 	mEGL.context = eglCreateContext(mEGL.display, mEGL.config, nullptr, ctxAttrs);
 	if (!valid_context()) {
 		sys_dbg_msg("eglCreateContext failed");
-		return;
+		return false;
 	}
 
 	if (!eglMakeCurrent(mEGL.display, mEGL.surface, mEGL.surface, mEGL.context)) {
 		sys_dbg_msg("eglMakeCurrent failed");
+		return false;
 	}
-	eglSwapInterval(mEGL.display, 1);
-	sys_dbg_msg("finished");
+	return true;
 }
 
 void GLSysGlobal::reset_egl() {
@@ -392,9 +604,15 @@ void GLSysGlobal::reset_wnd() {
 }
 
 void GLSys::loop(void(*pLoop)()) {
+	if (s_global.mHeadless) {
+		while (!s_global.mQuit && pLoop) {
+			pLoop();
+		}
+		return;
+	}
 	MSG msg;
 	bool done = false;
-	while (!done) {
+	while (!done && !s_global.mQuit) {
 		if (PeekMessage(&msg, 0, 0, 0, PM_NOREMOVE)) {
 			if (GetMessage(&msg, NULL, 0, 0)) {
 				TranslateMessage(&msg);
@@ -484,9 +702,15 @@ void GLSysGlobal::reset_wnd() {
 }
 
 void GLSys::loop(void(*pLoop)()) {
+	if (s_global.mHeadless) {
+		while (!s_global.mQuit && pLoop) {
+			pLoop();
+		}
+		return;
+	}
 	XEvent event;
 	bool done = false;
-	while (!done) {
+	while (!done && !s_global.mQuit) {
 		KeySym key;
 		while (XPending(s_global.mpNativeDisplay)) {
 			XNextEvent(s_global.mpNativeDisplay, &event);
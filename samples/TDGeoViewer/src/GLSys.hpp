@@ -5,6 +5,7 @@ struct GLSysCfg {
 	int y;
 	int w;
 	int h;
+	bool headless; // offscreen pbuffer, no window
 };
 
 namespace GLSys {
@@ -13,11 +14,20 @@ namespace GLSys {
 	void stop();
 	void swap();
 	void loop(void (*pLoop)());
+	// Makes loop() return after the current iteration.
+	void quit();
 	bool valid();
+	void set_title(const char* pTitle);
 
 	//GLuint compile_shader_str(const char* pSrc, size_t srcSize, GLenum kind); // TODO: use std:string
 	GLuint compile_shader_str(const std::string& src, GLenum kind);
 	GLuint compile_prog_strs(const std::string& srcVtx, const std::string& srcFrag, GLuint* pSIdVtx, GLuint* pSIdFrag);
+	// Like compile_prog_strs, but first tries the linked binary cached in
+	// cachePath (OES_get_program_binary) and writes it there after a
+	// compile. Entries are keyed by the sources and the GL driver strings;
+	// stale or rejected ones fall back to compiling. Shader ids are 0 when
+	// the program came from the cache.
+	GLuint load_prog_cached(const std::string& srcVtx, const std::string& srcFrag, const std::string& cachePath, GLuint* pSIdVtx, GLuint* pSIdFrag);
 }
 
 void sys_dbg_msg(const char* pFmt, ...);
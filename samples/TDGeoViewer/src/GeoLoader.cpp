@@ -0,0 +1,448 @@
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN 1
+#	define NOMINMAX
+#	include <windows.h>
+#elif defined(__linux__)
+#	include <poll.h>
+#	include <unistd.h>
+#	include <sys/inotify.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <unordered_map>
+#include "GeoLoader.hpp"
+
+// Editors and TD write tables in several steps, reload only after the
+// folder has been quiet for this long.
+static const int SETTLE_MS = 300;
+static const int POLL_MS = 100;
+static const size_t BLOCK_BYTES = 4 << 20;
+static const size_t QUEUE_BLOCKS = 4;
+// Points are published to the polygon side in blocks of this many rows.
+static const uint32_t PNT_BLOCK_ROWS = 4096;
+// The first preview piece is small so something shows up at once, the
+// following ones double in size up to the maximum.
+static const uint32_t PIECE_POLS_MIN = 2048;
+static const uint32_t PIECE_POLS_MAX = 65536;
+
+void GeoLoader::start(const std::vector<std::string>& folders) {
+	stop();
+	mFolders = folders;
+	mStop = false;
+	mInitialDone = false;
+	mThread = std::thread(&GeoLoader::run, this);
+}
+
+void GeoLoader::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mCanPush.notify_all();
+	if (mThread.joinable()) {
+		mThread.join();
+	}
+	mQueue.clear();
+}
+
+std::unique_ptr<GeoLoader::Packet> GeoLoader::fetch() {
+	std::unique_ptr<Packet> pPkt;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mQueue.empty()) { return pPkt; }
+		pPkt = std::move(mQueue.front());
+		mQueue.pop_front();
+	}
+	mCanPush.notify_one();
+	return pPkt;
+}
+
+bool GeoLoader::is_idle() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mInitialDone && mQueue.empty();
+}
+
+bool GeoLoader::push(std::unique_ptr<Packet> pPkt) {
+	std::unique_lock<std::mutex> lock(mMutex);
+	mCanPush.wait(lock, [this] { return mStop || mQueue.size() < QUEUE_BLOCKS; });
+	if (mStop) { return false; }
+	mQueue.push_back(std::move(pPkt));
+	return true;
+}
+
+// Preview mesh of the given polygons (CSR in polPnts/polOrg) with their
+// points copied out of the published blocks. When the table has no normals
+// they are computed per piece, so seams between pieces show until the full
+// mesh replaces them.
+static bool make_piece(const std::vector<uint32_t>& polys, const std::vector<int>& polPnts, const std::vector<uint32_t>& polOrg,
+                       const std::vector<const TDGeometry::Point*>& pntBlocks, bool hasNrm, GeoLoader::Packet& pkt) {
+	std::unordered_map<int, int> remap;
+	std::vector<TDGeometry::Point> pnts;
+	std::vector<TDGeometry::Poly> pols;
+	std::vector<int> ngonPnts;
+	for (uint32_t ipol : polys) {
+		TDGeometry::Poly poly = {};
+		poly.nvtx = (int)(polOrg[ipol + 1] - polOrg[ipol]);
+		const int* pIdx = &polPnts[polOrg[ipol]];
+		for (int i = 0; i < poly.nvtx; ++i) {
+			auto res = remap.insert(std::make_pair(pIdx[i], (int)pnts.size()));
+			if (res.second) {
+				pnts.push_back(pntBlocks[pIdx[i] / PNT_BLOCK_ROWS][pIdx[i] % PNT_BLOCK_ROWS]);
+			}
+			if (i < TDGeometry::MAX_POLY_VERTS) {
+				poly.ipnt[i] = res.first->second;
+			}
+			if (poly.nvtx > TDGeometry::MAX_POLY_VERTS) {
+				ngonPnts.push_back(res.first->second);
+			}
+		}
+		pols.push_back(poly);
+	}
+	TDGeometry geo;
+	geo.assign(pnts, pols, ngonPnts, hasNrm);
+	if (!hasNrm) {
+		geo.calc_normals();
+	}
+	GLDraw::Mesh::Streamer streamer(geo);
+	if (streamer.layout().triNum == 0) { return false; }
+	pkt.layout = streamer.layout();
+	GLDraw::Mesh::Block blk;
+	while (streamer.next(blk, BLOCK_BYTES)) {
+		pkt.blocks.push_back(std::move(blk));
+		blk = GLDraw::Mesh::Block();
+	}
+	pkt.bbox = geo.bbox();
+	return true;
+}
+
+// Points are parsed on a second thread and published block by block while
+// polygons are parsed here. A polygon is ready for the preview once the
+// points up to its highest index have arrived; ready polygons are collected
+// into pieces, the others wait in a heap ordered by that index. At the end
+// geo gets the same rows a regular load would give it.
+bool GeoLoader::load_progressive(uint32_t folder, TDGeometry& geo, float& firstMs) {
+	using namespace std;
+	typedef TDGeometry::Point Point;
+	auto t0 = chrono::steady_clock::now();
+	firstMs = 0.0f;
+	const string& path = mFolders[folder];
+	TDGeometry::PntReader pntReader;
+	TDGeometry::PolReader polReader;
+	// the other columns are not even parsed
+	if (!pntReader.open(path + "/pnt.txt", { "P", "N", "Cd" })) {
+		cout << "Can't load points from " << path << "/pnt.txt" << endl;
+		return false;
+	}
+	if (!polReader.open(path + "/pol.txt")) {
+		cout << "Can't load polygons from " << path << "/pol.txt" << endl;
+		return false;
+	}
+	bool hasNrm = pntReader.has_normals();
+
+	mutex pntMutex;
+	condition_variable pntCond;
+	vector<vector<Point> > pntBlocks; // all PNT_BLOCK_ROWS long but the last
+	bool pntsDone = false;
+	thread pntThread([&] {
+		vector<Point> block;
+		Point pnt;
+		bool more = true;
+		while (more && !mStop) {
+			more = pntReader.next(pnt);
+			if (more) {
+				block.push_back(pnt);
+			}
+			if (block.size() == PNT_BLOCK_ROWS || (!more && !block.empty())) {
+				lock_guard<mutex> lock(pntMutex);
+				pntBlocks.push_back(vector<Point>());
+				pntBlocks.back().swap(block);
+				pntCond.notify_one();
+			}
+		}
+		lock_guard<mutex> lock(pntMutex);
+		pntsDone = true;
+		pntCond.notify_one();
+	});
+
+	// Block data doesn't move once published, so it is read without
+	// the lock through these pointers.
+	vector<const Point*> pntPtrs;
+	uint32_t pntNum = 0;
+	vector<int> polPnts;
+	vector<uint32_t> polOrg(1, 0);
+	typedef pair<int, uint32_t> Waiting; // highest point index, polygon
+	priority_queue<Waiting, vector<Waiting>, greater<Waiting> > waiting;
+	vector<uint32_t> ready;
+	uint32_t pieceSize = PIECE_POLS_MIN;
+	TDGeometry::BBox bbox = {};
+	bool sent = false;
+	bool polsMore = true;
+	bool pntsEnd = false;
+	bool stopped = false;
+	vector<int> pnts;
+	while (!stopped) {
+		if (polsMore) {
+			for (uint32_t i = 0; i < pieceSize && (polsMore = polReader.next(pnts)); ++i) {
+				uint32_t ipol = (uint32_t)polOrg.size() - 1;
+				polPnts.insert(polPnts.end(), pnts.begin(), pnts.end());
+				polOrg.push_back((uint32_t)polPnts.size());
+				if (!pnts.empty() && *min_element(pnts.begin(), pnts.end()) >= 0) {
+					waiting.push(Waiting(*max_element(pnts.begin(), pnts.end()), ipol));
+				}
+			}
+		}
+		{
+			unique_lock<mutex> lock(pntMutex);
+			if (!polsMore) {
+				pntCond.wait(lock, [&] { return pntsDone || pntBlocks.size() > pntPtrs.size(); });
+			}
+			for (size_t i = pntPtrs.size(); i < pntBlocks.size(); ++i) {
+				pntPtrs.push_back(pntBlocks[i].data());
+				pntNum += (uint32_t)pntBlocks[i].size();
+			}
+			pntsEnd = pntsDone;
+		}
+		while (!waiting.empty() && waiting.top().first < (int)pntNum) {
+			ready.push_back(waiting.top().second);
+			waiting.pop();
+		}
+		bool last = !polsMore && pntsEnd;
+		while (!ready.empty() && (ready.size() >= pieceSize || last)) {
+			size_t num = min(ready.size(), (size_t)pieceSize);
+			vector<uint32_t> polys(ready.begin(), ready.begin() + num);
+			ready.erase(ready.begin(), ready.begin() + num);
+			unique_ptr<Packet> pPkt(new Packet());
+			if (make_piece(polys, polPnts, polOrg, pntPtrs, hasNrm, *pPkt)) {
+				const TDGeometry::BBox& pieceBox = pPkt->bbox;
+				for (int i = 0; i < 3; ++i) {
+					bbox.min[i] = sent ? min(bbox.min[i], pieceBox.min[i]) : pieceBox.min[i];
+					bbox.max[i] = sent ? max(bbox.max[i], pieceBox.max[i]) : pieceBox.max[i];
+				}
+				if (!sent) {
+					firstMs = chrono::duration<float, milli>(chrono::steady_clock::now() - t0).count();
+				}
+				sent = true;
+				pPkt->kind = Packet::PIECE;
+				pPkt->folder = folder;
+				pPkt->bbox = bbox;
+				if (!push(move(pPkt))) {
+					stopped = true;
+					break;
+				}
+			}
+			pieceSize = min(pieceSize * 2, PIECE_POLS_MAX);
+		}
+		if (last || mStop) { break; }
+	}
+	pntThread.join();
+	if (stopped || mStop) { return false; }
+
+	// polygons with indices past the last point are left to the mesh
+	// builder, as after a regular load
+	vector<Point> allPnts;
+	allPnts.reserve(pntNum);
+	for (const vector<Point>& block : pntBlocks) {
+		allPnts.insert(allPnts.end(), block.begin(), block.end());
+	}
+	vector<vector<Point> >().swap(pntBlocks);
+	uint32_t polNum = (uint32_t)polOrg.size() - 1;
+	vector<TDGeometry::Poly> pols(polNum);
+	vector<int> ngonPnts;
+	for (uint32_t i = 0; i < polNum; ++i) {
+		TDGeometry::Poly& poly = pols[i];
+		poly.nvtx = (int)(polOrg[i + 1] - polOrg[i]);
+		for (int j = 0; j < poly.nvtx && j < TDGeometry::MAX_POLY_VERTS; ++j) {
+			poly.ipnt[j] = polPnts[polOrg[i] + j];
+		}
+		if (poly.nvtx > TDGeometry::MAX_POLY_VERTS) {
+			ngonPnts.insert(ngonPnts.end(), polPnts.begin() + polOrg[i], polPnts.begin() + polOrg[i + 1]);
+		}
+	}
+	vector<int>().swap(polPnts);
+	geo.assign(allPnts, pols, ngonPnts, hasNrm);
+	if (!hasNrm) {
+		geo.calc_normals();
+	}
+	return true;
+}
+
+bool GeoLoader::load(uint32_t folder, bool preview) {
+	using namespace std;
+	auto t0 = chrono::steady_clock::now();
+	TDGeometry geo;
+	float firstMs = 0.0f;
+	// point clouds have no polygons to show early, they load in one go
+	bool pieces = preview && ifstream(TDInStream::find(mFolders[folder] + "/pol.txt")).good();
+	if (pieces) {
+		if (!load_progressive(folder, geo, firstMs)) { return false; }
+	} else {
+		// the other columns are not even parsed
+		geo.set_load_attribs({ "P", "N", "Cd" });
+		if (!geo.load(mFolders[folder])) {
+			cout << "Couldn't load " << mFolders[folder] << endl;
+			return false;
+		}
+	}
+	// the streamer chunks triangles in geometry order
+	geo.sort_tris();
+	GLDraw::Mesh::Streamer streamer(geo);
+	if (streamer.layout().vtxNum == 0) {
+		cout << "Couldn't create mesh out of " << mFolders[folder] << endl;
+		return false;
+	}
+	unique_ptr<Packet> pPkt(new Packet());
+	pPkt->kind = Packet::BEGIN;
+	pPkt->folder = folder;
+	pPkt->bbox = geo.bbox();
+	pPkt->layout = streamer.layout();
+	if (!push(move(pPkt))) { return false; }
+	while (true) {
+		pPkt.reset(new Packet());
+		if (!streamer.next(pPkt->block, BLOCK_BYTES)) { break; }
+		pPkt->kind = Packet::BLOCK;
+		pPkt->folder = folder;
+		if (!push(move(pPkt))) { return false; }
+	}
+	pPkt.reset(new Packet());
+	pPkt->kind = Packet::END;
+	pPkt->folder = folder;
+	if (!push(move(pPkt))) { return false; }
+	if (pieces) {
+		float sec = chrono::duration<float>(chrono::steady_clock::now() - t0).count();
+		cout << "Loaded " << mFolders[folder] << " (" << geo.get_poly_num() << " polygons) in " << sec << " s, first preview after " << firstMs << " ms" << endl;
+	} else if (preview && geo.get_poly_num() == 0) {
+		float sec = chrono::duration<float>(chrono::steady_clock::now() - t0).count();
+		cout << "Loaded " << mFolders[folder] << " (" << geo.get_pnt_num() << " points) in " << sec << " s" << endl;
+	}
+	return true;
+}
+
+// Watches are opened before the first loads so that changes made while
+// loading are not lost.
+void GeoLoader::run() {
+	bool watching = open_watch();
+	uint32_t nfolders = (uint32_t)mFolders.size();
+	for (uint32_t i = 0; i < nfolders && !mStop; ++i) {
+		load(i, true);
+	}
+	mInitialDone = true;
+	std::vector<uint8_t> changed(nfolders);
+	while (watching && wait_change(changed)) {
+		for (uint32_t i = 0; i < nfolders && !mStop; ++i) {
+			if (changed[i]) {
+				load(i, false);
+			}
+		}
+	}
+	if (watching) {
+		close_watch();
+	}
+}
+
+#if defined(__linux__)
+
+bool GeoLoader::open_watch() {
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) { return false; }
+	mNotify = fd;
+	mWatches.assign(mFolders.size(), -1);
+	for (size_t i = 0; i < mFolders.size(); ++i) {
+		mWatches[i] = inotify_add_watch(fd, mFolders[i].c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+	}
+	return true;
+}
+
+void GeoLoader::close_watch() {
+	close((int)mNotify);
+	mNotify = -1;
+	mWatches.clear();
+}
+
+bool GeoLoader::wait_change(std::vector<uint8_t>& changed) {
+	std::fill(changed.begin(), changed.end(), 0);
+	bool any = false;
+	auto lastEvt = std::chrono::steady_clock::now();
+	alignas(inotify_event) char buf[4096];
+	while (!mStop) {
+		pollfd pfd = { (int)mNotify, POLLIN, 0 };
+		if (poll(&pfd, 1, POLL_MS) > 0) {
+			ssize_t len;
+			while ((len = read((int)mNotify, buf, sizeof(buf))) > 0) {
+				for (char* p = buf; p < buf + len; ) {
+					const inotify_event* pEvt = (const inotify_event*)p;
+					for (size_t i = 0; i < mWatches.size(); ++i) {
+						if (mWatches[i] == pEvt->wd) {
+							changed[i] = 1;
+							any = true;
+						}
+					}
+					p += sizeof(inotify_event) + pEvt->len;
+				}
+			}
+			lastEvt = std::chrono::steady_clock::now();
+		} else if (any && std::chrono::steady_clock::now() - lastEvt > std::chrono::milliseconds(SETTLE_MS)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#elif defined(_WIN32)
+
+bool GeoLoader::open_watch() {
+	mWatches.assign(mFolders.size(), (intptr_t)INVALID_HANDLE_VALUE);
+	for (size_t i = 0; i < mFolders.size(); ++i) {
+		mWatches[i] = (intptr_t)FindFirstChangeNotificationA(mFolders[i].c_str(), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+	}
+	return true;
+}
+
+void GeoLoader::close_watch() {
+	for (intptr_t hChange : mWatches) {
+		if ((HANDLE)hChange != INVALID_HANDLE_VALUE) {
+			FindCloseChangeNotification((HANDLE)hChange);
+		}
+	}
+	mWatches.clear();
+}
+
+// WaitForMultipleObjects is limited to 64 handles, so the handles are
+// polled in turn instead.
+bool GeoLoader::wait_change(std::vector<uint8_t>& changed) {
+	std::fill(changed.begin(), changed.end(), 0);
+	bool any = false;
+	auto lastEvt = std::chrono::steady_clock::now();
+	while (!mStop) {
+		bool evt = false;
+		for (size_t i = 0; i < mWatches.size(); ++i) {
+			HANDLE hChange = (HANDLE)mWatches[i];
+			if (hChange != INVALID_HANDLE_VALUE && WaitForSingleObject(hChange, 0) == WAIT_OBJECT_0) {
+				changed[i] = 1;
+				evt = true;
+				FindNextChangeNotification(hChange);
+			}
+		}
+		if (evt) {
+			any = true;
+			lastEvt = std::chrono::steady_clock::now();
+		} else if (any && std::chrono::steady_clock::now() - lastEvt > std::chrono::milliseconds(SETTLE_MS)) {
+			return true;
+		}
+		Sleep(POLL_MS);
+	}
+	return false;
+}
+
+#else
+
+// No change notifications, folders are loaded once.
+bool GeoLoader::open_watch() { return false; }
+void GeoLoader::close_watch() {}
+bool GeoLoader::wait_change(std::vector<uint8_t>& changed) { return false; }
+
+#endif
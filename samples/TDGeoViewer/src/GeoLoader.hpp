@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "GLDraw.hpp"
+
+// Loads TD geometry folders on a worker thread and loads each one again
+// whenever files in it are rewritten. The worker parses the tables and
+// converts them block by block; the render thread takes packets with fetch()
+// and does only the GL upload. At most QUEUE_BLOCKS converted blocks wait in
+// the queue, the worker blocks until the render thread catches up.
+// The first load of a folder is progressive: the point table is parsed on a
+// second thread, and polygons are sent as small preview meshes as soon as
+// their points have arrived, long before the full mesh is ready.
+class GeoLoader {
+public:
+	// Every load is delivered as BEGIN (layout), a sequence of BLOCKs and END,
+	// all tagged with the index of the folder. A first load starts with
+	// PIECEs: self-contained preview meshes (layout and all their blocks)
+	// of the polygons parsed so far, to be drawn until END; their bbox
+	// covers all pieces sent so far.
+	struct Packet {
+		enum Kind {
+			PIECE,
+			BEGIN,
+			BLOCK,
+			END
+		};
+		Kind kind;
+		uint32_t folder;
+		TDGeometry::BBox bbox;
+		GLDraw::Mesh::Layout layout;
+		GLDraw::Mesh::Block block;
+		std::vector<GLDraw::Mesh::Block> blocks; // PIECE
+	};
+
+private:
+	std::vector<std::string> mFolders;
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mCanPush;
+	std::deque<std::unique_ptr<Packet>> mQueue;
+	std::atomic<bool> mStop;
+	std::atomic<bool> mInitialDone;
+	intptr_t mNotify;                // inotify descriptor
+	std::vector<intptr_t> mWatches;  // per folder: inotify watch or change notification handle
+
+	void run();
+	bool load(uint32_t folder, bool preview);
+	// Parses the tables into geo, sending PIECEs on the way; firstMs is
+	// when the first one was sent.
+	bool load_progressive(uint32_t folder, TDGeometry& geo, float& firstMs);
+	bool push(std::unique_ptr<Packet> pPkt);
+	bool open_watch();
+	void close_watch();
+	// Blocks until some folders changed and settled, false on stop.
+	bool wait_change(std::vector<uint8_t>& changed);
+
+public:
+	GeoLoader() : mStop(false), mInitialDone(false), mNotify(-1) {}
+	~GeoLoader() { stop(); }
+
+	void start(const std::vector<std::string>& folders);
+	void stop();
+	// Next packet or nullptr if none is ready yet.
+	std::unique_ptr<Packet> fetch();
+	// True once every folder has been loaded (or failed) and all packets
+	// have been fetched.
+	bool is_idle();
+};
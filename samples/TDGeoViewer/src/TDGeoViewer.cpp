@@ -4,51 +4,241 @@
 #	define _WIN32_WINNT 0x0500
 #	include <tchar.h>
 #	include <windows.h>
-#elif defined(X11)
-	#include "X11/Xlib.h"
-	#include "X11/Xutil.h"
+#else
+#	include <dirent.h>
+#	if defined(X11)
+		#include "X11/Xlib.h"
+		#include "X11/Xutil.h"
+#	endif
 #endif
 
 #include <sstream>
+#include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
 #include "GLDraw.hpp"
+#include "GeoLoader.hpp"
+#include "ChunkPager.hpp"
+#include "FrameStats.hpp"
+#include "TDStream.hpp"
 
-static TDGeometry s_tdgeo;
-static GLDraw::Mesh* s_pMesh = nullptr;
+static GeoLoader s_loader;
+// out-of-core mode, replaces the loader when a .tdc file is given
+static ChunkPager s_pager;
+
+// One per distinct geometry folder; every folder is drawn instNum times.
+struct Asset {
+	GLDraw::Mesh* pMesh;
+	GLDraw::Mesh* pNextMesh; // being uploaded
+	std::vector<GLDraw::Mesh*> pieces; // preview while first loading
+	TDGeometry::BBox bbox;
+	TDGeometry::BBox nextBbox;
+	int instNum;
+};
+static std::vector<Asset> s_assets;
+static std::vector<glm::mat4x4> s_instMtx;
+static FrameStats s_stats;
+
+// headless benchmark: after loading, the camera orbits the scene once over
+// s_benchFrames frames, then timings are printed and the last frame saved
+static int s_benchFrames = 0;
+static int s_benchFrame = 0;
+static std::string s_benchImage;
+static std::chrono::steady_clock::time_point s_benchStart;
+
+static const int UPLOAD_BUDGET_MS = 4;
+// paged mode orbits the camera so chunks keep paging in and out
+static const float PAGED_ORBIT_DEG = 0.25f;
+static const int OVERLAY_UPDATE_FRAMES = 15;
 
 const char* s_applicationName = "TDGeoViewer";
 
-static bool data_init(const std::string& folder) {
-	using namespace std;
+static bool is_geo_folder(const std::string& path) {
+	return std::ifstream(TDInStream::find(path + "/pnt.txt")).good();
+}
 
-	if (!s_tdgeo.load(folder)) {
-		cout << "Couldn't load " << folder.c_str() << endl;
+// A folder without pnt.txt is scanned for geometry subfolders.
+static void collect_folders(const std::string& path, std::vector<std::string>& folders) {
+	if (is_geo_folder(path)) {
+		folders.push_back(path);
+		return;
 	}
-	s_pMesh = GLDraw::Mesh::create(s_tdgeo);
-	if (s_pMesh == nullptr) {
-		cout << "Couldn't create mesh out of " << folder.c_str() << endl;
-		return false;
+	std::vector<std::string> subs;
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE hFind = FindFirstFileA((path + "\\*").c_str(), &fd);
+	if (hFind != INVALID_HANDLE_VALUE) {
+		do {
+			if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && fd.cFileName[0] != '.') {
+				subs.push_back(path + "/" + fd.cFileName);
+			}
+		} while (FindNextFileA(hFind, &fd));
+		FindClose(hFind);
+	}
+#else
+	DIR* pDir = opendir(path.c_str());
+	if (pDir) {
+		while (dirent* pEnt = readdir(pDir)) {
+			if (pEnt->d_name[0] != '.') {
+				subs.push_back(path + "/" + pEnt->d_name);
+			}
+		}
+		closedir(pDir);
+	}
+#endif
+	std::sort(subs.begin(), subs.end());
+	for (const std::string& sub : subs) {
+		if (is_geo_folder(sub)) {
+			folders.push_back(sub);
+		}
 	}
+}
+
+// Repeated folders become extra instances of one asset.
+static bool data_init(const std::vector<std::string>& paths, int copies) {
+	std::vector<std::string> folders;
+	for (const std::string& path : paths) {
+		std::vector<std::string> found;
+		collect_folders(path, found);
+		if (found.empty()) {
+			std::cout << "No geometry found in " << path << std::endl;
+		}
+		for (const std::string& folder : found) {
+			auto it = std::find(folders.begin(), folders.end(), folder);
+			if (it == folders.end()) {
+				folders.push_back(folder);
+				Asset asset = {};
+				asset.instNum = copies;
+				s_assets.push_back(asset);
+			} else {
+				s_assets[it - folders.begin()].instNum += copies;
+			}
+		}
+	}
+	if (folders.empty()) { return false; }
+	s_loader.start(folders);
 	return true;
 }
 
+static void release_mesh(GLDraw::Mesh*& pMesh) {
+	if (pMesh) {
+		pMesh->destroy();
+		delete pMesh;
+		pMesh = nullptr;
+	}
+}
+
+static bool is_shown(const Asset& asset) {
+	return asset.pMesh != nullptr || !asset.pieces.empty();
+}
+
+// Called between frames. A new mesh is uploaded over several frames within
+// a time budget and replaces the current one once its last block is in.
+// Preview pieces are drawn until then, the asset bbox grows with them.
+static void data_update() {
+	using namespace std::chrono;
+	steady_clock::time_point t0 = steady_clock::now();
+	while (steady_clock::now() - t0 < milliseconds(UPLOAD_BUDGET_MS)) {
+		std::unique_ptr<GeoLoader::Packet> pPkt = s_loader.fetch();
+		if (!pPkt) { break; }
+		Asset& asset = s_assets[pPkt->folder];
+		switch (pPkt->kind) {
+			case GeoLoader::Packet::PIECE:
+				if (GLDraw::Mesh* pPiece = GLDraw::Mesh::create(pPkt->layout)) {
+					for (const GLDraw::Mesh::Block& blk : pPkt->blocks) {
+						pPiece->upload(blk);
+					}
+					asset.pieces.push_back(pPiece);
+					if (asset.pMesh == nullptr) {
+						asset.bbox = pPkt->bbox;
+					}
+				}
+				break;
+			case GeoLoader::Packet::BEGIN:
+				release_mesh(asset.pNextMesh);
+				asset.pNextMesh = GLDraw::Mesh::create(pPkt->layout);
+				asset.nextBbox = pPkt->bbox;
+				break;
+			case GeoLoader::Packet::BLOCK:
+				if (asset.pNextMesh) {
+					asset.pNextMesh->upload(pPkt->block);
+				}
+				break;
+			case GeoLoader::Packet::END:
+				if (asset.pNextMesh) {
+					release_mesh(asset.pMesh);
+					asset.pMesh = asset.pNextMesh;
+					asset.pNextMesh = nullptr;
+					asset.bbox = asset.nextBbox;
+				}
+				for (GLDraw::Mesh*& pPiece : asset.pieces) {
+					release_mesh(pPiece);
+				}
+				asset.pieces.clear();
+				break;
+		}
+	}
+}
+
 static void data_reset() {
-	s_pMesh->destroy();
-	s_pMesh = nullptr;
+	s_pager.stop();
+	s_loader.stop();
+	for (Asset& asset : s_assets) {
+		release_mesh(asset.pMesh);
+		release_mesh(asset.pNextMesh);
+		for (GLDraw::Mesh*& pPiece : asset.pieces) {
+			release_mesh(pPiece);
+		}
+	}
+	s_assets.clear();
 }
 
-static void main_loop() {
+static glm::vec3 bbox_min(const TDGeometry::BBox& bbox) { return glm::vec3(bbox.min[0], bbox.min[1], bbox.min[2]); }
+static glm::vec3 bbox_max(const TDGeometry::BBox& bbox) { return glm::vec3(bbox.max[0], bbox.max[1], bbox.max[2]); }
 
-	// view update
-	TDGeometry::BBox bbox = s_tdgeo.bbox();
-	glm::vec3 vmin(bbox.min[0], bbox.min[1], bbox.min[2]);
-	glm::vec3 vmax(bbox.max[0], bbox.max[1], bbox.max[2]);
+static void bench_report() {
+	using namespace std;
+	float sec = chrono::duration<float>(chrono::steady_clock::now() - s_benchStart).count();
+	cout << "Frames : " << s_benchFrames << endl;
+	cout << "Time : " << sec << " s" << endl;
+	cout << "FPS : " << (sec > 0.0f ? s_benchFrames / sec : 0.0f) << endl;
+	cout << s_stats.summary() << endl;
+	if (!s_benchImage.empty()) {
+		cout << "Last frame saved to " << s_benchImage << endl;
+	}
+}
+
+static void frame_done() {
+	s_stats.end_frame(GLDraw::get_stats(), GLDraw::get_gpu_ms());
+	// no overlay in benchmark images
+	if (s_benchFrames == 0 && s_stats.get_frame_num() % OVERLAY_UPDATE_FRAMES == 0) {
+		GLDraw::set_overlay(s_stats.summary());
+	}
+	if (s_benchFrames > 0 && ++s_benchFrame == s_benchFrames) {
+		bench_report();
+		GLDraw::quit();
+	}
+}
+
+// Camera in front of the scene and slightly above, orbiting it by angleDeg.
+static glm::vec3 view_pos(const glm::vec3& vmin, const glm::vec3& vmax, float angleDeg) {
 	glm::vec3 vsize = vmax - vmin;
 	glm::vec3 vc = (vmin + vmax) * 0.5f;
-	float shift = (vmax - vmin).z;
-	glm::vec3 tgt = vc;
-	glm::vec3 pos = vc + glm::vec3(0, vsize.y * 0.2f, std::max(std::max(vsize.x, vsize.y), vsize.z) * 1.75f);
+	glm::vec3 viewOffs(0, vsize.y * 0.2f, std::max(std::max(vsize.x, vsize.y), vsize.z) * 1.75f);
+	float angle = glm::radians(angleDeg);
+	viewOffs = glm::vec3(viewOffs.z * std::sin(angle), viewOffs.y, viewOffs.z * std::cos(angle));
+	return vc + viewOffs;
+}
+
+static glm::vec3 view_update(const glm::vec3& vmin, const glm::vec3& vmax, float angleDeg) {
+	glm::vec3 tgt = (vmin + vmax) * 0.5f;
+	glm::vec3 pos = view_pos(vmin, vmax, angleDeg);
 	GLDraw::set_view(pos, tgt);
 
 	// light update
@@ -61,51 +251,229 @@ static void main_loop() {
 	glm::vec3 specDir = glm::normalize(tgt - (pos + glm::vec3(0.0f, 1.0f, 0.0f)));
 	glm::vec3 specClr(1, 0.9f, 0.5f);
 	specClr *= 0.5f;
-	float roughness = 0.45f;
 	GLDraw::set_hemi_light(sky, ground, up);
 	GLDraw::set_spec_light(specDir, specClr);
+	return pos;
+}
+
+static void main_loop();
+static void paged_loop();
+
+// Benchmark frames start only when everything is on the GPU; in paged mode
+// when the chunks wanted from the first camera position are.
+static void bench_loop() {
+	if (s_benchFrame == 0 && s_benchStart == std::chrono::steady_clock::time_point()) {
+		if (s_pager.valid()) {
+			TDGeometry::BBox bbox = s_pager.bbox();
+			glm::vec3 pos = view_pos(bbox_min(bbox), bbox_max(bbox), 0.0f);
+			do {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				s_pager.update(pos, UPLOAD_BUDGET_MS);
+			} while (!s_pager.is_idle());
+		} else {
+			while (!s_loader.is_idle()) {
+				data_update();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			data_update();
+		}
+		s_stats.reset();
+		s_benchStart = std::chrono::steady_clock::now();
+	}
+	if (s_benchFrame == s_benchFrames - 1 && !s_benchImage.empty()) {
+		GLDraw::save_frame(s_benchImage);
+	}
+	if (s_pager.valid()) {
+		paged_loop();
+	} else {
+		main_loop();
+	}
+}
 
-	s_pMesh->set_roughness(roughness);
+static void main_loop() {
+	s_stats.begin_frame();
+	s_stats.begin_phase(FrameStats::PHASE_UPLOAD);
+	data_update();
+	s_stats.begin_phase(FrameStats::PHASE_DRAW);
+
+	// instances are centered in the cells of a square grid on the XZ plane
+	int instTotal = 0;
+	float cell = 0.0f;
+	for (const Asset& asset : s_assets) {
+		if (!is_shown(asset)) { continue; }
+		glm::vec3 vsize = bbox_max(asset.bbox) - bbox_min(asset.bbox);
+		cell = std::max(cell, std::max(std::max(vsize.x, vsize.y), vsize.z) * 1.25f);
+		instTotal += asset.instNum;
+	}
+	if (instTotal == 0) {
+		GLDraw::begin();
+		s_stats.begin_phase(FrameStats::PHASE_SWAP);
+		GLDraw::end();
+		frame_done();
+		return;
+	}
+	int side = (int)std::ceil(std::sqrt((float)instTotal));
+	auto cell_pos = [&](int slot) {
+		return glm::vec3(((slot % side) - (side - 1) * 0.5f) * cell, 0.0f, ((slot / side) - (side - 1) * 0.5f) * cell);
+	};
+
+	// view update
+	glm::vec3 vmin(FLT_MAX);
+	glm::vec3 vmax(-FLT_MAX);
+	int slot = 0;
+	for (const Asset& asset : s_assets) {
+		if (!is_shown(asset)) { continue; }
+		glm::vec3 half = (bbox_max(asset.bbox) - bbox_min(asset.bbox)) * 0.5f;
+		for (int i = 0; i < asset.instNum; ++i, ++slot) {
+			vmin = glm::min(vmin, cell_pos(slot) - half);
+			vmax = glm::max(vmax, cell_pos(slot) + half);
+		}
+	}
+	float angle = s_benchFrames > 0 ? 360.0f * s_benchFrame / s_benchFrames : 0.0f;
+	view_update(vmin, vmax, angle);
+	float roughness = 0.45f;
 
 	GLDraw::begin();
-	glm::mat4x4 mtx = glm::mat4x4(1.0f);
 	static float rotDY = 0.0f;
-	mtx = GLDraw::xformSRTXYZ(0.0f, 0.0f, 0.0f, 0.0f, rotDY, 0.0f);
-	rotDY += 1.0f;
-	s_pMesh->draw(mtx);
+	glm::mat4x4 rot = GLDraw::xformSRTXYZ(0.0f, 0.0f, 0.0f, 0.0f, rotDY, 0.0f);
+	if (s_benchFrames == 0) {
+		rotDY += 1.0f;
+	}
+	slot = 0;
+	for (const Asset& asset : s_assets) {
+		if (!is_shown(asset)) { continue; }
+		glm::vec3 center = (bbox_min(asset.bbox) + bbox_max(asset.bbox)) * 0.5f;
+		glm::mat4x4 toOrigin = glm::translate(glm::mat4x4(1.0f), -center);
+		s_instMtx.clear();
+		for (int i = 0; i < asset.instNum; ++i, ++slot) {
+			s_instMtx.push_back(glm::translate(glm::mat4x4(1.0f), cell_pos(slot)) * rot * toOrigin);
+		}
+		if (asset.pMesh) {
+			asset.pMesh->set_roughness(roughness);
+			asset.pMesh->draw_instances(s_instMtx.data(), asset.instNum);
+		} else {
+			for (GLDraw::Mesh* pPiece : asset.pieces) {
+				pPiece->set_roughness(roughness);
+				pPiece->draw_instances(s_instMtx.data(), asset.instNum);
+			}
+		}
+	}
+	s_stats.begin_phase(FrameStats::PHASE_SWAP);
+	GLDraw::end();
+	frame_done();
+
+	static int frame = 0;
+	if (frame++ % 30 == 0) {
+		const GLDraw::DrawStats& stats = GLDraw::get_stats();
+		std::ostringstream title;
+		title << s_applicationName << " - instances drawn: " << stats.instancesDrawn << " culled: " << stats.instancesCulled
+		      << " chunks drawn: " << stats.chunksDrawn << " culled: " << stats.chunksCulled
+		      << " tris: " << stats.trisDrawn << " points: " << stats.pointsDrawn << " draws: " << stats.drawCalls;
+		GLDraw::set_title(title.str().c_str());
+	}
+}
+
+static void paged_loop() {
+	s_stats.begin_frame();
+	TDGeometry::BBox bbox = s_pager.bbox();
+	static float orbit = 0.0f;
+	float angle = s_benchFrames > 0 ? 360.0f * s_benchFrame / s_benchFrames : orbit;
+	orbit += PAGED_ORBIT_DEG;
+	glm::vec3 pos = view_update(bbox_min(bbox), bbox_max(bbox), angle);
+
+	s_stats.begin_phase(FrameStats::PHASE_UPLOAD);
+	s_pager.update(pos, UPLOAD_BUDGET_MS);
+	s_stats.begin_phase(FrameStats::PHASE_DRAW);
+	GLDraw::begin();
+	s_pager.draw(0.45f);
+	s_stats.begin_phase(FrameStats::PHASE_SWAP);
 	GLDraw::end();
+	frame_done();
+
+	static int frame = 0;
+	if (frame++ % 30 == 0) {
+		const GLDraw::DrawStats& stats = GLDraw::get_stats();
+		std::ostringstream title;
+		title << s_applicationName << " - resident chunks: " << s_pager.get_resident_num() << "/" << s_pager.get_chunk_num()
+		      << " (" << (s_pager.get_resident_bytes() >> 20) << " MB)"
+		      << " chunks drawn: " << stats.chunksDrawn << " culled: " << stats.chunksCulled
+		      << " tris: " << stats.trisDrawn << " draws: " << stats.drawCalls;
+		GLDraw::set_title(title.str().c_str());
+	}
 }
 
 void show_help() {
 	using namespace std;
 	cout << "Usage:\n";
-	cout << "TDGeoViewer <path_to_geo_folder>:\n";
+	cout << "TDGeoViewer [options] <path_to_geo_folder> [<path_to_geo_folder> ...]\n";
+	cout << "OR\n";
+	cout << "TDGeoViewer [options] <file.tdc>\n";
+	cout << "A folder without pnt.txt is scanned for geometry subfolders. A .tdc file (tab2geo -chunks) is paged in by view distance.\n";
+	cout << "Options:\n";
+	cout << "-copies <n> : draw every geometry n times\n";
+	cout << "-csv <file> : write per-frame timings to a CSV file\n";
+	cout << "-size <w>x<h> : window or offscreen size\n";
+	cout << "-bench <frames> : render offscreen, orbit the camera over the given number of frames and print timings\n";
+	cout << "-image <file.ppm> : with -bench, save the last frame\n";
+	cout << "-budget <MB> : memory for resident chunks of a .tdc file\n";
+	cout << "-pointsize <scale> : size of point cloud points relative to their spacing, 1 by default\n";
 }
 
 int main(int argc, char **argv) {
 	using namespace std;
-	std::string args = argc < 2 ? "" : argv[1];
+	vector<string> paths;
+	int copies = 1;
+	int width = 1024;
+	int height = 768;
+	int budgetMB = 512;
+	float pointScale = 1.0f;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "-copies" && i + 1 < argc) {
+			copies = std::max(atoi(argv[++i]), 1);
+		} else if (arg == "-size" && i + 1 < argc) {
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		} else if (arg == "-bench" && i + 1 < argc) {
+			s_benchFrames = std::max(atoi(argv[++i]), 0);
+		} else if (arg == "-budget" && i + 1 < argc) {
+			budgetMB = std::max(atoi(argv[++i]), 1);
+		} else if (arg == "-pointsize" && i + 1 < argc) {
+			pointScale = std::max((float)atof(argv[++i]), 0.0f);
+		} else if (arg == "-image" && i + 1 < argc) {
+			s_benchImage = argv[++i];
+		} else if (arg == "-csv" && i + 1 < argc) {
+			if (!s_stats.open_csv(argv[++i])) {
+				cout << "Can't open " << argv[i] << endl;
+			}
+		} else {
+			paths.push_back(arg);
+		}
+	}
 
-	if (args.empty()) {
+	if (paths.empty()) {
 		show_help();
 		return -1;
 	}
 
-	istringstream ss(args);
-	string path;
-	getline(ss, path, ' ');
-
 	GLDrawCfg cfg;
 	cfg.x = 0;
 	cfg.y = 0;
-	cfg.w = 1024;
-	cfg.h = 768;
+	cfg.w = std::max(width, 1);
+	cfg.h = std::max(height, 1);
 	cfg.appPath = argv[0];
+	cfg.headless = s_benchFrames > 0;
+
+	bool paged = paths.size() == 1 && paths[0].size() > 4 && paths[0].compare(paths[0].size() - 4, 4, ".tdc") == 0;
 
 	if (!GLDraw::init(cfg)) { return -1; };
-	if (!data_init(path)) { return -1;}
+	GLDraw::set_point_scale(pointScale);
+	if (paged) {
+		if (!s_pager.start(paths[0], (size_t)budgetMB << 20)) { return -1; }
+	} else if (!data_init(paths, copies)) {
+		return -1;
+	}
 
-	GLDraw::loop(main_loop);
+	GLDraw::loop(s_benchFrames > 0 ? bench_loop : paged ? paged_loop : main_loop);
 
 	data_reset();
 	GLDraw::reset();
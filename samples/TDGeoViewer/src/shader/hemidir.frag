@@ -14,6 +14,8 @@ uniform vec3 prmViewPos;
 uniform vec3 prmSpecDir;
 uniform vec3 prmSpecClr;
 uniform float prmSpecRough;
+// 0 for point clouds without normals, shown in plain color
+uniform float prmLit;
 
 #define PI (3.141592653589793)
 
@@ -103,6 +105,7 @@ void main() {
 //	vec3 specClr = spec_GGX(wk);
 
 	clr += specClr;
+	clr = mix(wk.vclr, clr, prmLit);
 
 	clr = pow(clr, prmInvGamma);
 
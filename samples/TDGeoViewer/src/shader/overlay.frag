@@ -0,0 +1,9 @@
+precision mediump float;
+
+varying vec2 pixUV;
+
+uniform sampler2D smpText;
+
+void main() {
+	gl_FragColor = texture2D(smpText, pixUV);
+}
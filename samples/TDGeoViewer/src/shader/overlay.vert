@@ -0,0 +1,10 @@
+precision highp float;
+
+attribute vec4 vtxPosUV;
+
+varying vec2 pixUV;
+
+void main() {
+	pixUV = vtxPosUV.zw;
+	gl_Position = vec4(vtxPosUV.xy, 0.0, 1.0);
+}
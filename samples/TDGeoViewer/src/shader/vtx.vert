@@ -1,24 +1,31 @@
 precision highp float;
 
-attribute vec3 vtxPos;
-attribute vec3 vtxNrm;
-attribute vec3 vtxClr;
+attribute vec4 vtxPos;
+attribute vec2 vtxNrm;
+attribute vec4 vtxClr;
+// world matrix rows, per instance
+attribute vec4 vtxWMtx0;
+attribute vec4 vtxWMtx1;
+attribute vec4 vtxWMtx2;
 
 varying vec3 pixWPos;
 varying vec3 pixWNrm;
 varying vec3 pixClr;
 
-uniform vec4 prmWMtx[3];
-
 uniform mat4 prmViewProj;
 
+uniform vec3 prmPosBase;
+uniform vec3 prmPosScale;
+// point clouds: point diameter in pixels at unit distance
+uniform float prmPointSize;
+
 
 vec3 calcWVec(vec3 v, vec3 sr0, vec3 sr1, vec3 sr2) {
 	return vec3(dot(v, sr0), dot(v, sr1), dot(v, sr2));
 }
 
 vec3 calcWVec(vec3 v) {
-	return calcWVec(v, prmWMtx[0].xyz, prmWMtx[1].xyz, prmWMtx[2].xyz);
+	return calcWVec(v, vtxWMtx0.xyz, vtxWMtx1.xyz, vtxWMtx2.xyz);
 }
 
 vec3 calcWPos(vec3 v, vec4 w0, vec4 w1, vec4 w2) {
@@ -27,15 +34,35 @@ vec3 calcWPos(vec3 v, vec4 w0, vec4 w1, vec4 w2) {
 }
 
 vec3 calcWPos(vec3 v) {
-	return calcWPos(v, prmWMtx[0], prmWMtx[1], prmWMtx[2]);
+	return calcWPos(v, vtxWMtx0, vtxWMtx1, vtxWMtx2);
+}
+
+vec3 decodePos(vec4 q) {
+	return prmPosBase + q.xyz * prmPosScale;
+}
+
+vec3 decodeOctNrm(vec2 e) {
+	vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0) {
+		vec2 s = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+		n.xy = (1.0 - abs(n.yx)) * s;
+	}
+	return normalize(n);
+}
+
+vec3 decodeSRGB(vec3 c) {
+	vec3 lo = c / 12.92;
+	vec3 hi = pow((c + 0.055) / 1.055, vec3(2.4));
+	return mix(lo, hi, step(vec3(0.04045), c));
 }
 
 void main() {
-	vec3 wpos = calcWPos(vtxPos);
-	vec3 wnrm = calcWVec(vtxNrm);
+	vec3 wpos = calcWPos(decodePos(vtxPos));
+	vec3 wnrm = calcWVec(decodeOctNrm(vtxNrm));
 	pixWPos = wpos;
 	pixWNrm = wnrm;
-	pixClr = vtxClr;
+	pixClr = decodeSRGB(vtxClr.rgb);
 	vec4 cpos = vec4(wpos, 1.0) * prmViewProj;
 	gl_Position = cpos;
+	gl_PointSize = clamp(prmPointSize / cpos.w, 1.0, 64.0);
 }
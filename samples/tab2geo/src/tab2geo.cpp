@@ -1,56 +1,1161 @@
-/*
- * TouchDesigner geometry: conversion to Houdini geo/hclassic format
- * Author: Gleb Novodran <novodran@gmail.com>
- */
-
-#include "TDGeometry.hpp"
-#include <iostream>
-#include <fstream>
-
-using namespace std;
-
-void show_help() {
-	cout << "Usage:" << endl;
-	cout << "tab2geo <td geo folder>" << endl;
-	cout << "OR\n";
-	cout << "tab2geo <points file path> <polygons file path>" << endl;
-}
-void display_stats(const TDGeometry& geo) {
-	cout << "Polygons : " << geo.get_poly_num() << endl;
-	cout << "Points : " << geo.get_pnt_num() << endl;
-	cout << "BBox : " << endl;
-	TDGeometry::BBox bbox = geo.bbox();
-	cout << bbox.min[0] << " " << bbox.min[1] << " " << bbox.min[2] << endl;
-	cout << bbox.max[0] << " " << bbox.max[1] << " " << bbox.max[2] << endl;
-}
-
-int main(int argc, char* argv[]) {
-	TDGeometry tdgeo;
-	if (argc == 2) {
-		string inFolder = argv[1];
-		if (tdgeo.load(inFolder)) {
-			ofstream os("dump.geo");
-			os << tdgeo;
-			os.close();
-			cout << "Saved to dump.geo" << endl;
-		} else {
-			cout << "Can't load geometry info" << endl;
-		}
-	} else if (argc == 3) {
-		string ptsPath = argv[1];
-		string polyPath = argv[2];
-		if (tdgeo.load(ptsPath, polyPath)) {
-			ofstream os("dump.geo");
-			os << tdgeo;
-			os.close();
-		} else {
-			cout << "Can't load geometry info" << endl;
-		}
-	} else {
-		show_help();
-	}
-
-	display_stats(tdgeo);
-
-	return 0;
-}
+/*
+ * TouchDesigner geometry: conversion to Houdini geo/hclassic format
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+
+#include "TDGeometry.hpp"
+#include "TDAdjacency.hpp"
+#include "TDPointGrid.hpp"
+#include "TDSimplify.hpp"
+#include "TDRaster.hpp"
+#include "TDChunkFile.hpp"
+#include "TDSchema.hpp"
+#include "TDStream.hpp"
+#include "TDParallel.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
+#ifdef _WIN32
+#	define NOMINMAX
+#	include <windows.h>
+#	include <direct.h>
+#else
+#	include <csignal>
+#	include <dirent.h>
+#	include <unistd.h>
+#	include <sys/socket.h>
+#	include <sys/time.h>
+#	include <sys/un.h>
+#endif
+
+using namespace std;
+
+void show_help() {
+	cout << "Usage:" << endl;
+	cout << "tab2geo [options] <td geo folder>" << endl;
+	cout << "OR\n";
+	cout << "tab2geo [options] <points file path> <polygons file path>" << endl;
+	cout << "Options:" << endl;
+	cout << "-lod <r1,r2,...> : also write simplified LODs with the given triangle ratios to dump_lod<N>.geo" << endl;
+	cout << "-reorder <morton|hilbert> : sort points and polygons along a space-filling curve before saving" << endl;
+	cout << "-thumb <size> : also render a size x size shaded thumbnail to thumb.png" << endl;
+	cout << "-chunks <file.tdc> : only convert to a spatially chunked file for out-of-core viewing, tables are streamed" << endl;
+	cout << "-fast : only convert P, N and Cd with the typed loader, no other processing" << endl;
+	cout << "-attribs <a,b,...> : only load these point attributes (P always), other columns are skipped" << endl;
+	cout << "-library <output folder> : convert every td geo folder under the input folder, only those changed since the last run" << endl;
+	cout << "-out <folder> : write dump.geo (LODs, thumbnail) to this folder instead of the current one" << endl;
+	cout << "-serve <socket path> : run as a conversion server on a Unix domain socket" << endl;
+	cout << "-cache <MB> : memory for the server's cache of loaded geometry (default 1024)" << endl;
+	cout << "-client <socket path> : send the conversion to a server instead of running it" << endl;
+	cout << "-stats : also print boundary and non-manifold edge counts; with -client, only load the geometry and print its stats" << endl;
+	cout << "-status : with -client, print the server's request and cache statistics" << endl;
+	cout << "-shutdown : with -client, stop the server" << endl;
+}
+// Mean distance from a point to its nearest neighbour, over an even sample
+// of at most SPACING_SAMPLES points.
+static const uint32_t SPACING_SAMPLES = 1 << 16;
+
+float point_spacing(const TDGeometry& geo) {
+	TDPointGrid grid;
+	if (!grid.build(geo)) { return 0.0f; }
+	const vector<TDGeometry::Point>& pnts = geo.pnts();
+	uint32_t step = max((uint32_t)pnts.size() / SPACING_SAMPLES, 1u);
+	vector<float> pos;
+	for (size_t i = 0; i < pnts.size(); i += step) {
+		pos.push_back(pnts[i].x);
+		pos.push_back(pnts[i].y);
+		pos.push_back(pnts[i].z);
+	}
+	uint32_t num = (uint32_t)pos.size() / 3;
+	vector<TDPointGrid::Neighbor> nbrs(num * 2);
+	vector<uint32_t> found(num);
+	grid.knn_batch(pos.data(), num, 2, nbrs.data(), found.data()); // the first one is the point itself
+	double sum = 0.0;
+	uint32_t cnt = 0;
+	for (uint32_t i = 0; i < num; ++i) {
+		if (found[i] < 2) { continue; }
+		sum += sqrt(nbrs[i * 2 + 1].dist2);
+		++cnt;
+	}
+	return cnt > 0 ? (float)(sum / cnt) : 0.0f;
+}
+
+// Topology stats come from pAdj, they are only printed with -stats: the
+// adjacency is a full pass over the polygons.
+void display_stats(const TDGeometry& geo, ostream& os = cout, const TDAdjacency* pAdj = nullptr) {
+	os << "Polygons : " << geo.get_poly_num() << endl;
+	os << "Points : " << geo.get_pnt_num() << endl;
+	os << "BBox : " << endl;
+	TDGeometry::BBox bbox = geo.bbox();
+	os << bbox.min[0] << " " << bbox.min[1] << " " << bbox.min[2] << endl;
+	os << bbox.max[0] << " " << bbox.max[1] << " " << bbox.max[2] << endl;
+	if (!geo.pnt_attribs().empty()) {
+		os << "Extra point attributes :";
+		for (const TDGeometry::Attrib& attr : geo.pnt_attribs()) {
+			os << " " << attr.name << "[" << attr.size << "]";
+		}
+		os << endl;
+	}
+	if (!geo.pol_attribs().empty()) {
+		os << "Primitive attributes :";
+		for (const TDGeometry::Attrib& attr : geo.pol_attribs()) {
+			os << " " << attr.name << "[" << attr.size << "]";
+		}
+		os << endl;
+	}
+	if (geo.get_poly_num() == 0 && geo.get_pnt_num() > 1) {
+		os << "Point spacing : " << point_spacing(geo) << endl;
+	}
+
+	if (pAdj != nullptr) {
+		os << "Boundary edges : " << pAdj->boundary().size() << endl;
+		os << "Non-manifold half-edges : " << pAdj->non_manifold().size() << endl;
+		if (pAdj->get_flipped_num() > 0) {
+			os << "Edges with inconsistent winding : " << pAdj->get_flipped_num() << endl;
+		}
+	}
+}
+
+vector<float> parse_ratios(const string& str) {
+	vector<float> ratios;
+	istringstream ss(str);
+	string item;
+	while (getline(ss, item, ',')) {
+		float r = (float)atof(item.c_str());
+		if (r > 0.0f && r < 1.0f) {
+			ratios.push_back(r);
+		}
+	}
+	return ratios;
+}
+
+vector<string> parse_names(const string& str) {
+	vector<string> names;
+	istringstream ss(str);
+	string item;
+	while (getline(ss, item, ',')) {
+		if (!item.empty()) {
+			names.push_back(item);
+		}
+	}
+	return names;
+}
+
+// Everything that changes the output of a conversion.
+struct ConvertOptions {
+	vector<float> lodRatios;
+	string reorder;
+	int thumbSize;
+	vector<string> attribs;
+
+	ConvertOptions() : thumbSize(0) {}
+
+	// Canonical form for the -library manifest.
+	string key() const {
+		ostringstream ss;
+		ss << "reorder=" << reorder << " lod=";
+		for (size_t i = 0; i < lodRatios.size(); ++i) {
+			ss << (i ? "," : "") << lodRatios[i];
+		}
+		ss << " thumb=" << thumbSize << " attribs=";
+		for (size_t i = 0; i < attribs.size(); ++i) {
+			ss << (i ? "," : "") << attribs[i];
+		}
+		return ss.str();
+	}
+};
+
+// Output files go to outDir (a path ending with '/', or empty for the
+// current folder). Progress is only printed when verbose.
+bool save_lods(const TDGeometry& geo, const vector<float>& ratios, const string& outDir = "", bool verbose = true) {
+	vector<TDGeometry> lods;
+	if (!TDSimplify::build_lods(geo, ratios, lods)) {
+		cout << "Can't build LODs" << endl;
+		return false;
+	}
+	for (size_t i = 0; i < lods.size(); ++i) {
+		ostringstream name;
+		name << "dump_lod" << i + 1 << ".geo";
+		ofstream os(outDir + name.str());
+		os << lods[i];
+		os.close();
+		if (!os) { return false; }
+		if (verbose) {
+			cout << "Saved LOD " << ratios[i] << " (" << lods[i].get_poly_num() << " polygons) to " << name.str() << endl;
+		}
+	}
+	return true;
+}
+
+bool save_thumb(const TDGeometry& geo, int size, const string& outDir = "", bool verbose = true) {
+	TDRaster::Cfg cfg;
+	cfg.width = size;
+	cfg.height = size;
+	TDRaster::Image img;
+	auto t0 = chrono::steady_clock::now();
+	if (!TDRaster::render(geo, img, cfg)) {
+		cout << "Can't render thumbnail" << endl;
+		return false;
+	}
+	float ms = chrono::duration<float, milli>(chrono::steady_clock::now() - t0).count();
+	if (!img.save_png(outDir + "thumb.png")) {
+		cout << "Can't write " << outDir << "thumb.png" << endl;
+		return false;
+	}
+	if (verbose) {
+		cout << "Saved " << size << "x" << size << " thumbnail to thumb.png (" << ms << " ms)" << endl;
+	}
+	return true;
+}
+
+// -1 when opts don't ask for a reorder.
+int reorder_curve(const ConvertOptions& opts) {
+	if (opts.reorder == "morton") { return TDGeometry::CURVE_MORTON; }
+	if (opts.reorder == "hilbert") { return TDGeometry::CURVE_HILBERT; }
+	return -1;
+}
+
+// Writes dump.geo, LODs and the thumbnail of geometry that is already in
+// output order.
+bool write_outputs(const TDGeometry& geo, const ConvertOptions& opts, const string& outDir = "", bool verbose = true) {
+	ofstream os(outDir + "dump.geo");
+	os << geo;
+	os.close();
+	if (!os) {
+		cout << "Can't write " << outDir << "dump.geo" << endl;
+		return false;
+	}
+	if (verbose) {
+		cout << "Saved to dump.geo" << endl;
+	}
+	bool res = true;
+	if (geo.get_poly_num() == 0 && (!opts.lodRatios.empty() || opts.thumbSize > 0)) {
+		// LODs and thumbnails are built from polygons
+		if (verbose) {
+			cout << "Point cloud, no LODs or thumbnail" << endl;
+		}
+		return res;
+	}
+	if (!opts.lodRatios.empty()) {
+		res = save_lods(geo, opts.lodRatios, outDir, verbose) && res;
+	}
+	if (opts.thumbSize > 0) {
+		res = save_thumb(geo, opts.thumbSize, outDir, verbose) && res;
+	}
+	return res;
+}
+
+// Reorders the loaded geometry and writes its outputs.
+bool save_outputs(TDGeometry& geo, const ConvertOptions& opts, const string& outDir = "", bool verbose = true) {
+	int curve = reorder_curve(opts);
+	if (curve >= 0) {
+		geo.reorder((TDGeometry::CurveKind)curve);
+	}
+	return write_outputs(geo, opts, outDir, verbose);
+}
+
+// Bump when the output for the same tables and options changes, so that
+// -library rebuilds everything converted by an older tab2geo.
+static const int CONVERTER_VERSION = 1;
+static const char* MANIFEST_FNAME = "tab2geo.manifest";
+
+// One line per converted geometry folder: relative path, converter version,
+// options key, input stamp and input hash, tab separated.
+struct ManifestEntry {
+	int version;
+	string options;
+	string stamp;  // size and modification time of the input files
+	uint64_t hash; // content of the input files
+};
+
+typedef map<string, ManifestEntry> Manifest;
+
+bool load_manifest(const string& path, Manifest& manifest) {
+	ifstream is(path);
+	if (!is.good()) { return false; }
+	string line;
+	while (getline(is, line)) {
+		vector<string> fields;
+		istringstream ss(line);
+		string field;
+		while (getline(ss, field, '\t')) {
+			fields.push_back(field);
+		}
+		if (fields.size() != 5) { continue; }
+		ManifestEntry entry;
+		entry.version = atoi(fields[1].c_str());
+		entry.options = fields[2];
+		entry.stamp = fields[3];
+		entry.hash = strtoull(fields[4].c_str(), nullptr, 16);
+		manifest[fields[0]] = entry;
+	}
+	return true;
+}
+
+// Written to a temporary file first so an interrupted run leaves the old
+// manifest intact.
+bool save_manifest(const string& path, const Manifest& manifest) {
+	string tmpPath = path + ".tmp";
+	ofstream os(tmpPath);
+	for (const auto& item : manifest) {
+		const ManifestEntry& entry = item.second;
+		os << item.first << '\t' << entry.version << '\t' << entry.options << '\t' << entry.stamp << '\t' << hex << entry.hash << dec << endl;
+	}
+	os.close();
+	if (!os) { return false; }
+	if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+		remove(path.c_str()); // Windows doesn't replace existing files
+		return rename(tmpPath.c_str(), path.c_str()) == 0;
+	}
+	return true;
+}
+
+string file_stamp(const string& path) {
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) { return "-"; }
+	ostringstream ss;
+	ss << (uint64_t)st.st_size << ":" << (int64_t)st.st_mtime;
+#ifdef __linux__
+	ss << "." << st.st_mtim.tv_nsec;
+#endif
+	return ss.str();
+}
+
+// FNV-1a over the file bytes, as stored (compressed tables are not inflated).
+void hash_file(const string& path, uint64_t& hash) {
+	ifstream is(path, ios::binary);
+	vector<char> buf(1 << 20);
+	while (is.good()) {
+		is.read(buf.data(), buf.size());
+		size_t num = (size_t)is.gcount();
+		for (size_t i = 0; i < num; ++i) {
+			hash ^= (unsigned char)buf[i];
+			hash *= 0x100000001B3ULL;
+		}
+	}
+}
+
+bool is_geo_folder(const string& path) {
+	ifstream is(TDInStream::find(path + "/pnt.txt"));
+	return is.good();
+}
+
+// Geometry folders at or under path, sorted; a geometry folder's own
+// subfolders are not searched.
+void collect_geo_folders(const string& path, vector<string>& folders) {
+	if (is_geo_folder(path)) {
+		folders.push_back(path);
+		return;
+	}
+	vector<string> subs;
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE hFind = FindFirstFileA((path + "/*").c_str(), &fd);
+	if (hFind == INVALID_HANDLE_VALUE) { return; }
+	do {
+		string name = fd.cFileName;
+		if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && name != "." && name != "..") {
+			subs.push_back(path + "/" + name);
+		}
+	} while (FindNextFileA(hFind, &fd));
+	FindClose(hFind);
+#else
+	DIR* pDir = opendir(path.c_str());
+	if (pDir == nullptr) { return; }
+	while (struct dirent* pEnt = readdir(pDir)) {
+		string name = pEnt->d_name;
+		struct stat st;
+		if (name != "." && name != ".." && stat((path + "/" + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+			subs.push_back(path + "/" + name);
+		}
+	}
+	closedir(pDir);
+#endif
+	sort(subs.begin(), subs.end());
+	for (const string& sub : subs) {
+		collect_geo_folders(sub, folders);
+	}
+}
+
+bool make_dirs(const string& path) {
+	for (size_t pos = 1; pos <= path.size(); ++pos) {
+		if (pos < path.size() && path[pos] != '/') { continue; }
+		string dir = path.substr(0, pos);
+#ifdef _WIN32
+		_mkdir(dir.c_str());
+#else
+		mkdir(dir.c_str(), 0777);
+#endif
+	}
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+// path in outDir (empty or ending with '/') unless it is absolute.
+string out_path(const string& outDir, const string& path) {
+	bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+	return absolute ? path : outDir + path;
+}
+
+// Converts every geometry folder under root to the same relative folder
+// under outRoot. A folder is skipped when the manifest has it with the same
+// converter version and options, its dump.geo exists and its tables are
+// unchanged: the size and time stamp are compared first, the content hash
+// only when the stamp differs. The rest are converted in parallel, one
+// folder per worker; the passes of a conversion run on that worker alone
+// unless there are fewer folders than workers.
+int convert_library(const string& root, const string& outRoot, const ConvertOptions& opts) {
+	auto t0 = chrono::steady_clock::now();
+	vector<string> folders;
+	collect_geo_folders(root, folders);
+	if (folders.empty()) {
+		cout << "No td geo folders in " << root << endl;
+		return -1;
+	}
+	if (!make_dirs(outRoot)) {
+		cout << "Can't create " << outRoot << endl;
+		return -1;
+	}
+	string manifestPath = outRoot + "/" + MANIFEST_FNAME;
+	Manifest manifest;
+	load_manifest(manifestPath, manifest);
+	string optKey = opts.key();
+
+	uint32_t num = (uint32_t)folders.size();
+	vector<string> rels(num);
+	vector<ManifestEntry> entries(num);
+	vector<char> valid(num, 0);
+	atomic<uint32_t> next(0);
+	atomic<uint32_t> convertedNum(0);
+	atomic<uint32_t> failedNum(0);
+	mutex outMutex;
+	// Workers take the next folder as they finish one, conversion times
+	// vary a lot between assets.
+	TDParallel::for_slices(num, TDParallel::num_workers(), [&](uint32_t, uint32_t, uint32_t) {
+		for (uint32_t i = next++; i < num; i = next++) {
+			const string& folder = folders[i];
+			string rel = folder.size() > root.size() ? folder.substr(root.size() + 1) : ".";
+			rels[i] = rel;
+			string pntsPath = TDInStream::find(folder + "/pnt.txt");
+			string polsPath = TDInStream::find(folder + "/pol.txt");
+			string outDir = outRoot + "/" + rel + "/";
+			ManifestEntry& entry = entries[i];
+			entry.version = CONVERTER_VERSION;
+			entry.options = optKey;
+			entry.stamp = file_stamp(pntsPath) + " " + file_stamp(polsPath);
+			entry.hash = 0;
+
+			Manifest::const_iterator it = manifest.find(rel);
+			bool current = it != manifest.end() && it->second.version == CONVERTER_VERSION && it->second.options == optKey && ifstream(outDir + "dump.geo").good();
+			bool hashed = false;
+			if (current && it->second.stamp != entry.stamp) {
+				entry.hash = 0xCBF29CE484222325ULL;
+				hash_file(pntsPath, entry.hash);
+				hash_file(polsPath, entry.hash);
+				hashed = true;
+				current = entry.hash == it->second.hash;
+			}
+			if (current) {
+				entry.hash = it->second.hash;
+				valid[i] = 1;
+				continue;
+			}
+			if (!hashed) {
+				entry.hash = 0xCBF29CE484222325ULL;
+				hash_file(pntsPath, entry.hash);
+				hash_file(polsPath, entry.hash);
+			}
+
+			TDGeometry geo;
+			geo.set_load_attribs(opts.attribs);
+			bool res = make_dirs(outDir.substr(0, outDir.size() - 1)) && geo.load(pntsPath, polsPath) && save_outputs(geo, opts, outDir, false);
+			lock_guard<mutex> lock(outMutex);
+			if (res) {
+				valid[i] = 1;
+				++convertedNum;
+				cout << "Converted " << rel << " (" << geo.get_poly_num() << " polygons)" << endl;
+			} else {
+				++failedNum;
+				cout << "Can't convert " << folder << endl;
+			}
+		}
+	});
+
+	// Folders that are gone or failed drop out, failed ones are retried
+	// on the next run.
+	Manifest updated;
+	for (uint32_t i = 0; i < num; ++i) {
+		if (valid[i]) {
+			updated[rels[i]] = entries[i];
+		}
+	}
+	if (!save_manifest(manifestPath, updated)) {
+		cout << "Can't write " << manifestPath << endl;
+	}
+	float sec = chrono::duration<float>(chrono::steady_clock::now() - t0).count();
+	cout << num << " geometry folders: " << convertedNum << " converted, " << num - convertedNum - failedNum << " up to date, " << failedNum << " failed (" << sec << " s)" << endl;
+	return failedNum > 0 ? -1 : 0;
+}
+
+bool save_chunks(const vector<string>& paths, const string& chunkPath) {
+	auto t0 = chrono::steady_clock::now();
+	bool res = false;
+	if (paths.size() == 1) {
+		res = TDChunkFile::build(paths[0], chunkPath);
+	} else if (paths.size() == 2) {
+		res = TDChunkFile::build(paths[0], paths[1], chunkPath);
+	}
+	TDChunkFile file;
+	if (!res || !file.open(chunkPath)) {
+		cout << "Can't convert to " << chunkPath << endl;
+		return false;
+	}
+	uint64_t triNum = 0;
+	uint64_t pntNum = 0;
+	for (const TDChunkFile::Chunk& chunk : file.chunks()) {
+		triNum += chunk.triNum;
+		pntNum += chunk.pntNum;
+	}
+	float sec = chrono::duration<float>(chrono::steady_clock::now() - t0).count();
+	cout << "Saved " << file.get_chunk_num() << " chunks, " << (triNum > 0 ? triNum : pntNum) << (triNum > 0 ? " triangles" : " points") << " to " << chunkPath << " (" << sec << " s)" << endl;
+	return true;
+}
+
+typedef TDSchema::Geometry<TDSchema::Schema<TDSchema::P, TDSchema::N, TDSchema::Cd> > PNCGeometry;
+
+// False when the points table doesn't have all of P, N and Cd.
+// loaded is false when the tables don't fit the schema, nothing is written
+// then.
+bool save_fast(const vector<string>& paths, const string& outDir, bool& loaded) {
+	auto t0 = chrono::steady_clock::now();
+	PNCGeometry geo;
+	loaded = paths.size() == 1 ? geo.load(paths[0]) : geo.load(paths[0], paths[1]);
+	if (!loaded) { return false; }
+	string path = outDir + "dump.geo";
+	ofstream os(path);
+	bool res = os.good() && geo.dump_geo(os);
+	os.close();
+	if (!res || !os) {
+		cout << "Can't write " << path << endl;
+		return false;
+	}
+	float sec = chrono::duration<float>(chrono::steady_clock::now() - t0).count();
+	cout << "Saved " << geo.get_pnt_num() << " points, " << geo.get_poly_num() << " polygons to " << path << " (" << sec << " s)" << endl;
+	return true;
+}
+
+struct Args {
+	vector<string> paths;
+	ConvertOptions opts;
+	string outDir; // empty or ending with '/'
+	string chunkPath;
+	string libraryPath;
+	string servePath;
+	string clientPath;
+	size_t cacheMB;
+	bool fast;
+	bool stats;
+	bool status;
+	bool shutdown;
+
+	Args() : cacheMB(1024), fast(false), stats(false), status(false), shutdown(false) {}
+};
+
+void parse_args(const vector<string>& args, Args& res) {
+	size_t num = args.size();
+	for (size_t i = 0; i < num; ++i) {
+		const string& arg = args[i];
+		if (arg == "-lod" && i + 1 < num) {
+			res.opts.lodRatios = parse_ratios(args[++i]);
+		} else if (arg == "-reorder" && i + 1 < num) {
+			res.opts.reorder = args[++i];
+		} else if (arg == "-thumb" && i + 1 < num) {
+			res.opts.thumbSize = atoi(args[++i].c_str());
+		} else if (arg == "-chunks" && i + 1 < num) {
+			res.chunkPath = args[++i];
+		} else if (arg == "-fast") {
+			res.fast = true;
+		} else if (arg == "-attribs" && i + 1 < num) {
+			res.opts.attribs = parse_names(args[++i]);
+		} else if (arg == "-library" && i + 1 < num) {
+			res.libraryPath = args[++i];
+		} else if (arg == "-out" && i + 1 < num) {
+			res.outDir = args[++i];
+			if (!res.outDir.empty() && res.outDir.back() != '/' && res.outDir.back() != '\\') {
+				res.outDir += "/";
+			}
+		} else if (arg == "-serve" && i + 1 < num) {
+			res.servePath = args[++i];
+		} else if (arg == "-cache" && i + 1 < num) {
+			res.cacheMB = (size_t)atoi(args[++i].c_str());
+		} else if (arg == "-client" && i + 1 < num) {
+			res.clientPath = args[++i];
+		} else if (arg == "-stats") {
+			res.stats = true;
+		} else if (arg == "-status") {
+			res.status = true;
+		} else if (arg == "-shutdown") {
+			res.shutdown = true;
+		} else {
+			res.paths.push_back(arg);
+		}
+	}
+}
+
+#ifndef _WIN32
+// Conversion server. A client connects, sends one request and reads the
+// reply until the server closes the connection. The request is a line of
+// tab separated tab2geo arguments (with absolute paths); the reply is the
+// conversion output followed by a last line "ok <ms>" or "failed <ms>".
+// Connections are handled by a pool of worker threads that share a cache of
+// recently loaded geometry, so repeated requests for the same tables skip
+// parsing. Requests only read the cached geometry: the reordered copies a
+// conversion needs are cached along with it.
+
+// A client that doesn't send its request line in time, or sends a longer
+// one, is dropped so it can't hold a worker.
+static const int REQUEST_TIMEOUT_SEC = 10;
+static const size_t REQUEST_MAX = 64 << 10;
+
+// Approximate, for the cache budget.
+size_t geo_bytes(const TDGeometry& geo) {
+	size_t bytes = geo.pnts().size() * sizeof(TDGeometry::Point) + geo.pols().size() * sizeof(TDGeometry::Poly);
+	bytes += (geo.tris().size() + geo.tri_pols().size()) * sizeof(uint32_t);
+	for (const TDGeometry::Attrib& attr : geo.pnt_attribs()) {
+		bytes += attr.data.size() * sizeof(float) + attr.ints.size() * sizeof(int32_t);
+	}
+	for (const TDGeometry::Attrib& attr : geo.pol_attribs()) {
+		bytes += attr.data.size() * sizeof(float) + attr.ints.size() * sizeof(int32_t);
+	}
+	return bytes;
+}
+
+size_t adj_bytes(const TDAdjacency& adj) {
+	return (size_t)adj.get_hedge_num() * (sizeof(uint32_t) + sizeof(int32_t)) + adj.get_poly_num() * sizeof(uint32_t);
+}
+
+struct CachedGeo {
+	string key;
+	TDGeometry geo; // in table order
+	bool loaded;
+	once_flag loadOnce;
+	TDGeometry reordered[2]; // per CurveKind, built for the first request asking for it
+	once_flag reorderOnce[2];
+	TDAdjacency adj; // built for the first stats request
+	bool adjBuilt;
+	once_flag adjOnce;
+	size_t bytes;
+
+	CachedGeo() : loaded(false), adjBuilt(false), bytes(0) {}
+};
+
+// Loaded geometry keyed by the table paths, their stamps and the loaded
+// attributes, so edited tables are loaded again. Least recently used
+// entries are dropped above the budget. Concurrent requests for a
+// geometry that is being loaded wait for that load.
+class GeoCache {
+protected:
+	typedef list<pair<string, shared_ptr<CachedGeo> > > Lru;
+	mutex mMutex;
+	Lru mLru; // most recently used first
+	map<string, Lru::iterator> mIndex;
+	size_t mBytes;
+	size_t mMaxBytes;
+	uint64_t mHitNum;
+	uint64_t mMissNum;
+
+	bool is_cached(const string& key, const shared_ptr<CachedGeo>& pEntry) const {
+		map<string, Lru::iterator>::const_iterator it = mIndex.find(key);
+		return it != mIndex.end() && it->second->second == pEntry;
+	}
+
+	// The most recent entry stays even when it is over the budget alone.
+	void evict() {
+		while (mBytes > mMaxBytes && mLru.size() > 1) {
+			mBytes -= mLru.back().second->bytes;
+			mIndex.erase(mLru.back().first);
+			mLru.pop_back();
+		}
+	}
+
+public:
+	GeoCache(size_t maxBytes) : mBytes(0), mMaxBytes(maxBytes), mHitNum(0), mMissNum(0) {}
+
+	// nullptr when the tables can't be loaded.
+	shared_ptr<CachedGeo> get(const string& pntsPath, const string& polsPath, const vector<string>& attribs, bool& hit) {
+		string key = pntsPath + "\t" + file_stamp(pntsPath) + "\t" + polsPath + "\t" + file_stamp(polsPath) + "\t";
+		for (const string& attr : attribs) {
+			key += attr + ",";
+		}
+		shared_ptr<CachedGeo> pEntry;
+		{
+			lock_guard<mutex> lock(mMutex);
+			map<string, Lru::iterator>::iterator it = mIndex.find(key);
+			hit = it != mIndex.end();
+			if (hit) {
+				mLru.splice(mLru.begin(), mLru, it->second);
+				pEntry = it->second->second;
+				++mHitNum;
+			} else {
+				pEntry = make_shared<CachedGeo>();
+				pEntry->key = key;
+				mLru.push_front(make_pair(key, pEntry));
+				mIndex[key] = mLru.begin();
+				++mMissNum;
+			}
+		}
+		call_once(pEntry->loadOnce, [&] {
+			pEntry->geo.set_load_attribs(attribs);
+			pEntry->loaded = pEntry->geo.load(pntsPath, polsPath);
+			pEntry->bytes = pEntry->loaded ? geo_bytes(pEntry->geo) : 0;
+			lock_guard<mutex> lock(mMutex);
+			if (!is_cached(key, pEntry)) { return; } // evicted while loading
+			if (pEntry->loaded) {
+				mBytes += pEntry->bytes;
+				evict();
+			} else {
+				mLru.erase(mIndex[key]);
+				mIndex.erase(key);
+			}
+		});
+		return pEntry->loaded ? pEntry : nullptr;
+	}
+
+	// Accounts for data built on a loaded entry after the fact.
+	void grow(const shared_ptr<CachedGeo>& pEntry, size_t bytes) {
+		lock_guard<mutex> lock(mMutex);
+		pEntry->bytes += bytes;
+		if (!is_cached(pEntry->key, pEntry)) { return; }
+		mBytes += bytes;
+		evict();
+	}
+
+	void status(ostream& os) {
+		lock_guard<mutex> lock(mMutex);
+		os << "Cache : " << mLru.size() << " geometries, " << mBytes / (1 << 20) << " of " << mMaxBytes / (1 << 20) << " MB, ";
+		os << mHitNum << " hits, " << mMissNum << " misses" << endl;
+	}
+};
+
+class Server {
+protected:
+	string mPath;
+	int mListenFd;
+	GeoCache mCache;
+	mutex mMutex;
+	condition_variable mCond;
+	deque<int> mConns;
+	bool mStop;
+	chrono::steady_clock::time_point mStart;
+	uint64_t mRequestNum;
+	uint64_t mFailedNum;
+	double mBusyMs;
+
+	// Fails on a timeout (SO_RCVTIMEO is set on accepted sockets) or a line
+	// over REQUEST_MAX.
+	static bool read_line(int fd, string& line) {
+		line.clear();
+		char buf[4096];
+		size_t end = string::npos;
+		while (end == string::npos) {
+			ssize_t num = recv(fd, buf, sizeof(buf), 0);
+			if (num <= 0) { return false; }
+			size_t org = line.size();
+			line.append(buf, (size_t)num);
+			end = line.find('\n', org);
+			if ((end == string::npos ? line.size() : end) > REQUEST_MAX) { return false; }
+		}
+		line.resize(end);
+		return true;
+	}
+
+	static void write_all(int fd, const string& str) {
+		size_t org = 0;
+		while (org < str.size()) {
+			ssize_t num = send(fd, str.data() + org, str.size() - org, 0);
+			if (num <= 0) { break; }
+			org += (size_t)num;
+		}
+	}
+
+	// The server doesn't share the client's current folder: outputs go to
+	// the -out folder, which the client always sends as an absolute path.
+	bool convert(const Args& args, ostream& os, bool& hit) {
+		hit = false;
+		if (args.paths.empty() || args.paths.size() > 2) {
+			os << "Expected a td geo folder or points and polygons file paths" << endl;
+			return false;
+		}
+		if (args.fast || !args.libraryPath.empty() || !args.servePath.empty() || !args.clientPath.empty()) {
+			os << "-fast, -library, -serve and -client aren't supported in server requests" << endl;
+			return false;
+		}
+		if (args.outDir.empty() || args.outDir[0] != '/') {
+			os << "Expected an absolute -out folder" << endl;
+			return false;
+		}
+		if (!args.chunkPath.empty()) {
+			// streamed from the tables, nothing to cache
+			string chunkPath = out_path(args.outDir, args.chunkPath);
+			bool res = make_dirs(args.outDir.substr(0, args.outDir.size() - 1));
+			res = res && (args.paths.size() == 1 ? TDChunkFile::build(args.paths[0], chunkPath) : TDChunkFile::build(args.paths[0], args.paths[1], chunkPath));
+			os << (res ? "Saved to " : "Can't convert to ") << chunkPath << endl;
+			return res;
+		}
+		string pntsPath = args.paths.size() == 1 ? args.paths[0] + "/pnt.txt" : args.paths[0];
+		string polsPath = args.paths.size() == 1 ? args.paths[0] + "/pol.txt" : args.paths[1];
+		shared_ptr<CachedGeo> pEntry = mCache.get(TDInStream::find(pntsPath), TDInStream::find(polsPath), args.opts.attribs, hit);
+		if (!pEntry) {
+			os << "Can't load geometry info" << endl;
+			return false;
+		}
+		if (args.stats) {
+			call_once(pEntry->adjOnce, [&] {
+				pEntry->adjBuilt = pEntry->adj.build(pEntry->geo);
+				mCache.grow(pEntry, adj_bytes(pEntry->adj));
+			});
+			display_stats(pEntry->geo, os, pEntry->adjBuilt ? &pEntry->adj : nullptr);
+			return true;
+		}
+		if (!make_dirs(args.outDir.substr(0, args.outDir.size() - 1))) {
+			os << "Can't create " << args.outDir << endl;
+			return false;
+		}
+		const TDGeometry* pGeo = &pEntry->geo;
+		int curve = reorder_curve(args.opts);
+		if (curve >= 0) {
+			call_once(pEntry->reorderOnce[curve], [&] {
+				TDGeometry& sorted = pEntry->reordered[curve];
+				sorted = pEntry->geo;
+				sorted.reorder((TDGeometry::CurveKind)curve);
+				mCache.grow(pEntry, geo_bytes(sorted));
+			});
+			pGeo = &pEntry->reordered[curve];
+		}
+		if (!write_outputs(*pGeo, args.opts, args.outDir, false)) { return false; }
+		os << "Saved to " << args.outDir << "dump.geo" << endl;
+		return true;
+	}
+
+	void status(ostream& os) {
+		lock_guard<mutex> lock(mMutex);
+		double sec = chrono::duration<double>(chrono::steady_clock::now() - mStart).count();
+		os << "Requests : " << mRequestNum << ", " << mFailedNum << " failed, ";
+		os << (mRequestNum ? mBusyMs / mRequestNum : 0.0) << " ms mean latency, " << mRequestNum / max(sec, 1e-3) << " requests/s over " << sec << " s" << endl;
+	}
+
+	void handle(int fd) {
+		auto t0 = chrono::steady_clock::now();
+		string line;
+		ostringstream os;
+		bool res = false;
+		bool hit = false;
+		Args args;
+		string what = "request";
+		if (read_line(fd, line)) {
+			vector<string> tokens;
+			istringstream ss(line);
+			string token;
+			while (getline(ss, token, '\t')) {
+				tokens.push_back(token);
+			}
+			parse_args(tokens, args);
+			if (args.shutdown) {
+				what = "shutdown";
+				res = true;
+				stop();
+			} else if (args.status) {
+				what = "status";
+				status(os);
+				mCache.status(os);
+				res = true;
+			} else {
+				what = args.paths.empty() ? "convert" : args.paths[0];
+				res = convert(args, os, hit);
+			}
+		} else {
+			os << "Malformed request" << endl;
+		}
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+		os << (res ? "ok " : "failed ") << ms << endl;
+		write_all(fd, os.str());
+		close(fd);
+
+		lock_guard<mutex> lock(mMutex);
+		++mRequestNum;
+		mFailedNum += res ? 0 : 1;
+		mBusyMs += ms;
+		cout << "#" << mRequestNum << " " << what << (args.stats ? " (stats)" : "") << (hit ? " (cached)" : "") << ": " << ms << " ms" << (res ? "" : ", failed") << endl;
+	}
+
+	// Requests run side by side, each with its share of the cores for its
+	// parallel passes.
+	void work(uint32_t share) {
+		TDParallel::WorkerBudget budget(share);
+		while (true) {
+			unique_lock<mutex> lock(mMutex);
+			mCond.wait(lock, [this] { return mStop || !mConns.empty(); });
+			if (mConns.empty()) { return; }
+			int fd = mConns.front();
+			mConns.pop_front();
+			lock.unlock();
+			handle(fd);
+		}
+	}
+
+	// Wakes the accept loop with a connection of its own.
+	void stop() {
+		{
+			lock_guard<mutex> lock(mMutex);
+			mStop = true;
+		}
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un addr = address(mPath);
+		connect(fd, (sockaddr*)&addr, sizeof(addr));
+		close(fd);
+	}
+
+public:
+	static sockaddr_un address(const string& path) {
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		return addr;
+	}
+
+	Server(const string& path, size_t cacheBytes)
+		: mPath(path), mListenFd(-1), mCache(cacheBytes), mStop(false), mRequestNum(0), mFailedNum(0), mBusyMs(0.0) {}
+
+	int run() {
+		if (mPath.size() >= sizeof(sockaddr_un().sun_path)) {
+			cout << "Socket path too long: " << mPath << endl;
+			return -1;
+		}
+		signal(SIGPIPE, SIG_IGN); // clients that went away
+		sockaddr_un addr = address(mPath);
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool running = connect(probe, (sockaddr*)&addr, sizeof(addr)) == 0;
+		close(probe);
+		if (running) {
+			cout << "A server is already listening on " << mPath << endl;
+			return -1;
+		}
+		unlink(mPath.c_str()); // left by a server that didn't exit cleanly
+		mListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (mListenFd < 0 || bind(mListenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(mListenFd, 64) != 0) {
+			cout << "Can't listen on " << mPath << endl;
+			if (mListenFd >= 0) { close(mListenFd); }
+			return -1;
+		}
+		mStart = chrono::steady_clock::now();
+		uint32_t workerNum = TDParallel::num_workers();
+		uint32_t share = max(1u, TDParallel::num_workers() / workerNum);
+		vector<thread> workers;
+		for (uint32_t i = 0; i < workerNum; ++i) {
+			workers.emplace_back(&Server::work, this, share);
+		}
+		cout << "Listening on " << mPath << " with " << workerNum << " workers" << endl;
+
+		while (true) {
+			int fd = accept(mListenFd, nullptr, nullptr);
+			unique_lock<mutex> lock(mMutex);
+			if (mStop) {
+				if (fd >= 0) { close(fd); }
+				break;
+			}
+			if (fd < 0) { continue; }
+			timeval timeout = {};
+			timeout.tv_sec = REQUEST_TIMEOUT_SEC;
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			mConns.push_back(fd);
+			lock.unlock();
+			mCond.notify_one();
+		}
+		mCond.notify_all();
+		for (thread& worker : workers) {
+			worker.join();
+		}
+		close(mListenFd);
+		unlink(mPath.c_str());
+		status(cout);
+		mCache.status(cout);
+		return 0;
+	}
+};
+
+string abs_path(const string& path) {
+	if (path.empty() || path[0] == '/') { return path; }
+	char buf[4096];
+	if (getcwd(buf, sizeof(buf)) == nullptr) { return path; }
+	return string(buf) + "/" + path;
+}
+
+// Sends the request with paths made absolute, the server doesn't share the
+// current folder. The output goes to the current folder unless -out is set.
+int run_client(const Args& args) {
+	auto t0 = chrono::steady_clock::now();
+	if (args.fast || !args.libraryPath.empty()) {
+		cout << "-fast and -library aren't supported with -client" << endl;
+		return -1;
+	}
+	vector<string> tokens;
+	if (args.shutdown) {
+		tokens.push_back("-shutdown");
+	} else if (args.status) {
+		tokens.push_back("-status");
+	} else {
+		if (!args.opts.lodRatios.empty()) {
+			ostringstream ss;
+			for (size_t i = 0; i < args.opts.lodRatios.size(); ++i) {
+				ss << (i ? "," : "") << args.opts.lodRatios[i];
+			}
+			tokens.push_back("-lod");
+			tokens.push_back(ss.str());
+		}
+		if (!args.opts.reorder.empty()) {
+			tokens.push_back("-reorder");
+			tokens.push_back(args.opts.reorder);
+		}
+		if (args.opts.thumbSize > 0) {
+			tokens.push_back("-thumb");
+			tokens.push_back(to_string(args.opts.thumbSize));
+		}
+		if (!args.opts.attribs.empty()) {
+			string names;
+			for (const string& name : args.opts.attribs) {
+				names += (names.empty() ? "" : ",") + name;
+			}
+			tokens.push_back("-attribs");
+			tokens.push_back(names);
+		}
+		if (!args.chunkPath.empty()) {
+			tokens.push_back("-chunks");
+			tokens.push_back(abs_path(out_path(args.outDir, args.chunkPath)));
+		}
+		if (args.stats) {
+			tokens.push_back("-stats");
+		}
+		tokens.push_back("-out");
+		tokens.push_back(abs_path(args.outDir.empty() ? "." : args.outDir));
+		for (const string& path : args.paths) {
+			tokens.push_back(abs_path(path));
+		}
+	}
+	string request;
+	for (const string& token : tokens) {
+		request += (request.empty() ? "" : "\t") + token;
+	}
+	request += "\n";
+
+	sockaddr_un addr = Server::address(args.clientPath);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+		cout << "Can't connect to " << args.clientPath << endl;
+		if (fd >= 0) { close(fd); }
+		return -1;
+	}
+	send(fd, request.data(), request.size(), 0);
+	string reply;
+	char buf[4096];
+	ssize_t num;
+	while ((num = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		reply.append(buf, (size_t)num);
+	}
+	close(fd);
+
+	// the last line is the status with the server time
+	size_t last = reply.rfind('\n', reply.size() >= 2 ? reply.size() - 2 : 0);
+	last = last == string::npos ? 0 : last + 1;
+	string result = reply.substr(last);
+	cout << reply.substr(0, last);
+	bool ok = result.compare(0, 3, "ok ") == 0;
+	if (!ok && result.compare(0, 7, "failed ") != 0) {
+		cout << "No reply from the server" << endl;
+		return -1;
+	}
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+	cout << (ok ? "Done" : "Failed") << " in " << ms << " ms (server " << atof(result.c_str() + (ok ? 3 : 7)) << " ms)" << endl;
+	return ok ? 0 : -1;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+	TDGeometry tdgeo;
+	Args args;
+	parse_args(vector<string>(argv + 1, argv + argc), args);
+	const vector<string>& paths = args.paths;
+	const ConvertOptions& opts = args.opts;
+	const string& chunkPath = args.chunkPath;
+	const string& libraryPath = args.libraryPath;
+
+	if (!args.servePath.empty() || !args.clientPath.empty()) {
+#ifdef _WIN32
+		cout << "Server and client modes need Unix domain sockets, not available in this build" << endl;
+		return -1;
+#else
+		if (!args.servePath.empty()) {
+			Server server(args.servePath, args.cacheMB << 20);
+			return server.run();
+		}
+		return run_client(args);
+#endif
+	}
+
+	if (!libraryPath.empty() && paths.size() == 1) {
+		return convert_library(paths[0], libraryPath, opts);
+	}
+
+	// -out also holds the chunk file and the -fast dump.geo
+	if (!args.outDir.empty() && (paths.size() == 1 || paths.size() == 2) && !make_dirs(args.outDir.substr(0, args.outDir.size() - 1))) {
+		cout << "Can't create " << args.outDir << endl;
+		return -1;
+	}
+
+	if (!chunkPath.empty() && (paths.size() == 1 || paths.size() == 2)) {
+		return save_chunks(paths, out_path(args.outDir, chunkPath)) ? 0 : -1;
+	}
+
+	if (args.fast && (paths.size() == 1 || paths.size() == 2)) {
+		bool fastLoaded;
+		if (save_fast(paths, args.outDir, fastLoaded)) { return 0; }
+		if (fastLoaded) { return -1; }
+		cout << "The points table lacks some of the P, N and Cd columns or has rows where they aren't numbers, using the full loader" << endl;
+	}
+
+	bool loaded = false;
+	tdgeo.set_load_attribs(opts.attribs);
+	if (paths.size() == 1) {
+		loaded = tdgeo.load(paths[0]);
+	} else if (paths.size() == 2) {
+		loaded = tdgeo.load(paths[0], paths[1]);
+	} else {
+		show_help();
+	}
+
+	if (loaded) {
+		save_outputs(tdgeo, opts, args.outDir);
+	} else if (!paths.empty() && paths.size() <= 2) {
+		cout << "Can't load geometry info" << endl;
+	}
+
+	TDAdjacency adj;
+	display_stats(tdgeo, cout, args.stats && adj.build(tdgeo) ? &adj : nullptr);
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * TouchDesigner geometry: half-edge adjacency
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#include "TDAdjacency.hpp"
+#include "TDParallel.hpp"
+#include "TDRadixSort.hpp"
+
+TDAdjacency::TDAdjacency() {
+	reset();
+}
+
+void TDAdjacency::reset() {
+	mPolSize = 0;
+	mFlippedNum = 0;
+	std::vector<uint32_t>().swap(mPolOrg);
+	std::vector<uint32_t>().swap(mHedgePol);
+	std::vector<uint32_t>().swap(mOrg);
+	std::vector<int32_t>().swap(mTwin);
+	std::vector<uint32_t>().swap(mBoundary);
+	std::vector<uint32_t>().swap(mNonManifold);
+}
+
+// Edge keys are (min point, max point) packed into pntBits-wide halves.
+// After the radix sort half-edges of one edge are adjacent; each slice of the
+// sorted array is snapped to whole runs of equal keys and linked independently.
+template <typename KEY>
+static void link_twins(const std::vector<uint32_t>& org, const std::vector<uint32_t>& next, int pntBits,
+                       std::vector<int32_t>& twin, std::vector<uint32_t>& boundary, std::vector<uint32_t>& nonManifold, uint32_t& flippedNum) {
+	uint32_t nhe = (uint32_t)org.size();
+	std::vector<KEY> keys(nhe);
+	std::vector<uint32_t> vals(nhe);
+	TDParallel::for_each(nhe, [&](uint32_t he) {
+		KEY a = org[he];
+		KEY b = org[next[he]];
+		keys[he] = a < b ? (a << pntBits) | b : (b << pntBits) | a;
+		vals[he] = he;
+	});
+	TDRadixSort::sort_pairs(keys, vals, pntBits * 2);
+
+	struct SliceRes {
+		std::vector<uint32_t> boundary;
+		std::vector<uint32_t> nonManifold;
+		uint32_t flippedNum;
+	};
+	uint32_t nslices = TDParallel::num_slices(nhe, 1 << 16);
+	std::vector<SliceRes> res(nslices);
+	TDParallel::for_slices(nhe, nslices, [&](uint32_t sorg, uint32_t send, uint32_t islice) {
+		SliceRes& sres = res[islice];
+		sres.flippedNum = 0;
+		while (sorg > 0 && sorg < nhe && keys[sorg] == keys[sorg - 1]) { ++sorg; }
+		while (send < nhe && keys[send] == keys[send - 1]) { ++send; }
+		uint32_t i = sorg;
+		while (i < send) {
+			uint32_t j = i + 1;
+			while (j < nhe && keys[j] == keys[i]) { ++j; }
+			uint32_t n = j - i;
+			if (n == 1) {
+				twin[vals[i]] = TDAdjacency::NO_TWIN;
+				sres.boundary.push_back(vals[i]);
+			} else if (n == 2) {
+				uint32_t h0 = vals[i];
+				uint32_t h1 = vals[i + 1];
+				twin[h0] = (int32_t)h1;
+				twin[h1] = (int32_t)h0;
+				if (org[h0] == org[h1]) {
+					++sres.flippedNum;
+				}
+			} else {
+				for (uint32_t k = i; k < j; ++k) {
+					twin[vals[k]] = TDAdjacency::NON_MANIFOLD;
+					sres.nonManifold.push_back(vals[k]);
+				}
+			}
+			i = j;
+		}
+	});
+
+	size_t nbnd = 0;
+	size_t nnm = 0;
+	for (auto& sres : res) {
+		nbnd += sres.boundary.size();
+		nnm += sres.nonManifold.size();
+	}
+	boundary.reserve(nbnd);
+	nonManifold.reserve(nnm);
+	flippedNum = 0;
+	for (auto& sres : res) {
+		boundary.insert(boundary.end(), sres.boundary.begin(), sres.boundary.end());
+		nonManifold.insert(nonManifold.end(), sres.nonManifold.begin(), sres.nonManifold.end());
+		flippedNum += sres.flippedNum;
+	}
+}
+
+bool TDAdjacency::build(const TDGeometry& geo) {
+	reset();
+	const std::vector<TDGeometry::Poly>& pols = geo.pols();
+	uint32_t npol = (uint32_t)pols.size();
+	uint32_t npnt = geo.get_pnt_num();
+	if (npol == 0 || npnt == 0) { return false; }
+
+	mPolOrg.resize(npol + 1);
+	mPolOrg[0] = 0;
+	mPolSize = pols[0].nvtx;
+	for (uint32_t i = 0; i < npol; ++i) {
+		mPolOrg[i + 1] = mPolOrg[i] + pols[i].nvtx;
+		if ((uint32_t)pols[i].nvtx != mPolSize) {
+			mPolSize = 0;
+		}
+	}
+	uint32_t nhe = mPolOrg[npol];
+	if (nhe == 0) {
+		reset();
+		return false;
+	}
+
+	if (mPolSize == 0) {
+		mHedgePol.resize(nhe);
+	}
+	mOrg.resize(nhe);
+	std::vector<uint32_t> next(nhe);
+	uint32_t nslices = TDParallel::num_slices(npol);
+	std::vector<uint8_t> sliceValid(nslices, 1);
+	TDParallel::for_slices(npol, nslices, [&](uint32_t org, uint32_t end, uint32_t islice) {
+		for (uint32_t i = org; i < end; ++i) {
+			const TDGeometry::Poly& pol = pols[i];
+			const int* pIdx = geo.poly_pnts(i);
+			uint32_t he0 = mPolOrg[i];
+			for (int j = 0; j < pol.nvtx; ++j) {
+				uint32_t he = he0 + j;
+				if ((uint32_t)pIdx[j] >= npnt) {
+					sliceValid[islice] = 0;
+				}
+				mOrg[he] = (uint32_t)pIdx[j];
+				next[he] = j + 1 < pol.nvtx ? he + 1 : he0;
+				if (mPolSize == 0) {
+					mHedgePol[he] = i;
+				}
+			}
+		}
+	});
+	for (uint8_t ok : sliceValid) {
+		if (!ok) {
+			reset();
+			return false;
+		}
+	}
+
+	int pntBits = 1;
+	while (pntBits < 32 && (npnt >> pntBits) != 0) { ++pntBits; }
+	mTwin.resize(nhe);
+	if (pntBits <= 16) {
+		link_twins<uint32_t>(mOrg, next, pntBits, mTwin, mBoundary, mNonManifold, mFlippedNum);
+	} else {
+		link_twins<uint64_t>(mOrg, next, pntBits, mTwin, mBoundary, mNonManifold, mFlippedNum);
+	}
+	return true;
+}
@@ -0,0 +1,68 @@
+/*
+ * TouchDesigner geometry: half-edge adjacency
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "TDGeometry.hpp"
+
+// Half-edges are implicit polygon corners: half-edge h of polygon f is
+// mPolOrg[f] + j and runs from corner j to corner j + 1, so next/prev are
+// computed rather than stored. Only the origin point and the twin link are
+// kept per half-edge; the owning polygon is stored only for meshes with
+// mixed polygon sizes.
+class TDAdjacency {
+public:
+	enum {
+		NO_TWIN = -1,     // boundary half-edge
+		NON_MANIFOLD = -2 // edge shared by more than two polygons
+	};
+
+protected:
+	uint32_t mPolSize; // vertex count of every polygon, 0 if mixed
+	std::vector<uint32_t> mPolOrg;
+	std::vector<uint32_t> mHedgePol;
+	std::vector<uint32_t> mOrg;
+	std::vector<int32_t> mTwin;
+	std::vector<uint32_t> mBoundary;
+	std::vector<uint32_t> mNonManifold;
+	uint32_t mFlippedNum;
+
+public:
+	TDAdjacency();
+
+	bool build(const TDGeometry& geo);
+	void reset();
+
+	uint32_t get_hedge_num() const { return (uint32_t)mOrg.size(); }
+	uint32_t get_poly_num() const { return mPolOrg.empty() ? 0 : (uint32_t)mPolOrg.size() - 1; }
+
+	uint32_t poly(uint32_t he) const { return mPolSize ? he / mPolSize : mHedgePol[he]; }
+	uint32_t poly_hedge(uint32_t ipol) const { return mPolOrg[ipol]; }
+	uint32_t poly_size(uint32_t ipol) const { return mPolOrg[ipol + 1] - mPolOrg[ipol]; }
+
+	uint32_t next(uint32_t he) const {
+		uint32_t ipol = poly(he);
+		return he + 1 < mPolOrg[ipol + 1] ? he + 1 : mPolOrg[ipol];
+	}
+	uint32_t prev(uint32_t he) const {
+		uint32_t ipol = poly(he);
+		return he > mPolOrg[ipol] ? he - 1 : mPolOrg[ipol + 1] - 1;
+	}
+	int32_t twin(uint32_t he) const { return mTwin[he]; }
+	uint32_t org(uint32_t he) const { return mOrg[he]; }
+	uint32_t dst(uint32_t he) const { return mOrg[next(he)]; }
+	bool is_boundary(uint32_t he) const { return mTwin[he] == NO_TWIN; }
+
+	// One entry per boundary half-edge.
+	const std::vector<uint32_t>& boundary() const { return mBoundary; }
+	// All half-edges of non-manifold edges, grouped by edge.
+	const std::vector<uint32_t>& non_manifold() const { return mNonManifold; }
+	// Twin pairs whose polygons have inconsistent winding.
+	uint32_t get_flipped_num() const { return mFlippedNum; }
+
+	bool is_manifold() const { return mNonManifold.empty(); }
+	bool is_closed() const { return mBoundary.empty(); }
+};
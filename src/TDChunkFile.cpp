@@ -0,0 +1,512 @@
+/*
+ * TouchDesigner geometry: spatially chunked on-disk format for out-of-core viewing
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#include "TDChunkFile.hpp"
+#include "TDSimd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <unordered_map>
+
+typedef TDGeometry::Point Point;
+
+static const uint32_t TDC_MAGIC = 0x4B434454; // "TDCK"
+static const uint32_t TDC_VERSION = 1;
+static const uint32_t TDC_HAS_NRM = 1;
+static const int MAX_GRID = 64;
+
+struct FileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t chunkNum;
+	uint32_t flags;
+	TDGeometry::BBox bbox;
+};
+
+// Fixed-size pages of a file of Point records with least recently used
+// replacement; modified pages are written back when evicted or flushed.
+class PointPages {
+	enum { PAGE_PNTS = 1024 };
+	struct Page {
+		uint64_t idx;
+		uint64_t lastUse;
+		bool dirty;
+		std::vector<Point> pnts;
+	};
+	std::fstream mFile;
+	std::vector<Page> mPages;
+	std::unordered_map<uint64_t, uint32_t> mSlots; // page index -> mPages slot
+	uint64_t mPntNum;
+	uint64_t mClock;
+
+	void write_back(Page& page) {
+		if (!page.dirty) { return; }
+		mFile.seekp(page.idx * PAGE_PNTS * sizeof(Point));
+		mFile.write((const char*)page.pnts.data(), page.pnts.size() * sizeof(Point));
+		page.dirty = false;
+	}
+
+public:
+	PointPages() : mPntNum(0), mClock(0) {}
+
+	bool open(const std::string& path, uint64_t pntNum, size_t maxBytes) {
+		mFile.open(path, std::ios::in | std::ios::out | std::ios::binary);
+		mPntNum = pntNum;
+		size_t slots = std::max(maxBytes / (PAGE_PNTS * sizeof(Point)), (size_t)4);
+		mPages.reserve(slots);
+		return mFile.good();
+	}
+
+	Point& get(uint64_t ipnt, bool modify) {
+		uint64_t ipage = ipnt / PAGE_PNTS;
+		auto it = mSlots.find(ipage);
+		uint32_t slot;
+		if (it != mSlots.end()) {
+			slot = it->second;
+		} else {
+			if (mPages.size() < mPages.capacity()) {
+				slot = (uint32_t)mPages.size();
+				mPages.push_back(Page());
+			} else {
+				slot = 0;
+				for (uint32_t i = 1; i < mPages.size(); ++i) {
+					if (mPages[i].lastUse < mPages[slot].lastUse) {
+						slot = i;
+					}
+				}
+				write_back(mPages[slot]);
+				mSlots.erase(mPages[slot].idx);
+			}
+			Page& page = mPages[slot];
+			uint64_t org = ipage * PAGE_PNTS;
+			page.idx = ipage;
+			page.dirty = false;
+			page.pnts.resize((size_t)std::min((uint64_t)PAGE_PNTS, mPntNum - org));
+			mFile.seekg(org * sizeof(Point));
+			mFile.read((char*)page.pnts.data(), page.pnts.size() * sizeof(Point));
+			mSlots[ipage] = slot;
+		}
+		Page& page = mPages[slot];
+		page.lastUse = ++mClock;
+		page.dirty = page.dirty || modify;
+		return page.pnts[ipnt - ipage * PAGE_PNTS];
+	}
+
+	void close() {
+		mFile.close();
+		mPages.clear();
+		mSlots.clear();
+	}
+};
+
+static void expand_bbox(TDGeometry::BBox& bbox, const Point& pnt, bool first) {
+	const float* p = &pnt.x;
+	for (int i = 0; i < 3; ++i) {
+		bbox.min[i] = first ? p[i] : std::min(bbox.min[i], p[i]);
+		bbox.max[i] = first ? p[i] : std::max(bbox.max[i], p[i]);
+	}
+}
+
+// Triangles (points for point clouds) of one cell written to the spill
+// file in one go.
+struct TriBlock {
+	uint32_t cell;
+	uint32_t triNum;
+	uint64_t offset;
+};
+
+static void write_header(std::ofstream& os, const std::vector<TDChunkFile::Chunk>& chunks, const TDGeometry::BBox& bbox, uint32_t flags) {
+	FileHeader hdr = {};
+	hdr.magic = TDC_MAGIC;
+	hdr.version = TDC_VERSION;
+	hdr.chunkNum = (uint32_t)chunks.size();
+	hdr.flags = flags;
+	hdr.bbox = bbox;
+	os.write((const char*)&hdr, sizeof(hdr));
+	os.write((const char*)chunks.data(), chunks.size() * sizeof(TDChunkFile::Chunk));
+}
+
+// Point clouds: the points are read back from the temporary file in order
+// and binned by position, copies of them rather than indices go to the
+// spill file so each chunk is read back in one go.
+static bool build_cloud(const std::string& pntTmpPath, uint32_t npnt, const TDGeometry::BBox& bbox, const int grid[3], const float cellScale[3], bool hasNrm, const std::string& path, const TDChunkFile::BuildCfg& cfg) {
+	using namespace std;
+	uint32_t ncell = (uint32_t)(grid[0] * grid[1] * grid[2]);
+	size_t bufPnts = cfg.memBytes / ((size_t)ncell * sizeof(Point));
+	bufPnts = std::min(std::max(bufPnts, (size_t)64), (size_t)4096);
+	string spillPath = path + ".cld.tmp";
+	ifstream pntIs(pntTmpPath, ios::binary);
+	ofstream spillOs(spillPath, ios::binary);
+	vector<TriBlock> blocks;
+	vector<vector<Point>> cellBufs(ncell);
+	uint64_t spillOffs = 0;
+	auto flush_cell = [&](uint32_t cell) {
+		vector<Point>& buf = cellBufs[cell];
+		if (buf.empty()) { return; }
+		TriBlock blk;
+		blk.cell = cell;
+		blk.triNum = (uint32_t)buf.size();
+		blk.offset = spillOffs;
+		spillOs.write((const char*)buf.data(), buf.size() * sizeof(Point));
+		spillOffs += buf.size() * sizeof(Point);
+		blocks.push_back(blk);
+		buf.clear();
+	};
+	Point pnt;
+	for (uint32_t i = 0; i < npnt && pntIs.read((char*)&pnt, sizeof(pnt)); ++i) {
+		uint32_t c[3];
+		for (int j = 0; j < 3; ++j) {
+			int ic = (int)(((&pnt.x)[j] - bbox.min[j]) * cellScale[j]);
+			c[j] = (uint32_t)std::min(std::max(ic, 0), grid[j] - 1);
+		}
+		uint32_t cell = (c[2] * grid[1] + c[1]) * grid[0] + c[0];
+		cellBufs[cell].push_back(pnt);
+		if (cellBufs[cell].size() >= bufPnts) {
+			flush_cell(cell);
+		}
+	}
+	bool ok = pntIs.good();
+	for (uint32_t cell = 0; cell < ncell; ++cell) {
+		flush_cell(cell);
+	}
+	vector<vector<Point>>().swap(cellBufs);
+	spillOs.close();
+	ok = ok && spillOs.good();
+
+	stable_sort(blocks.begin(), blocks.end(), [](const TriBlock& a, const TriBlock& b) { return a.cell < b.cell; });
+	vector<TDChunkFile::Chunk> chunks;
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		if (i == 0 || blocks[i].cell != blocks[i - 1].cell) {
+			chunks.push_back(TDChunkFile::Chunk());
+		}
+	}
+	ofstream os;
+	if (ok) {
+		os.open(path, ios::binary);
+		write_header(os, chunks, bbox, hasNrm ? TDC_HAS_NRM : 0);
+		ok = os.good();
+	}
+	ifstream spillIs(spillPath, ios::binary);
+	vector<Point> pnts;
+	size_t iblk = 0;
+	for (size_t ichunk = 0; ok && ichunk < chunks.size(); ++ichunk) {
+		pnts.clear();
+		uint32_t cell = blocks[iblk].cell;
+		for (; iblk < blocks.size() && blocks[iblk].cell == cell; ++iblk) {
+			size_t org = pnts.size();
+			pnts.resize(org + blocks[iblk].triNum);
+			spillIs.seekg(blocks[iblk].offset);
+			spillIs.read((char*)&pnts[org], blocks[iblk].triNum * sizeof(Point));
+		}
+		TDChunkFile::Chunk& chunk = chunks[ichunk];
+		for (size_t j = 0; j < pnts.size(); ++j) {
+			expand_bbox(chunk.bbox, pnts[j], j == 0);
+		}
+		chunk.pntNum = (uint32_t)pnts.size();
+		chunk.triNum = 0;
+		chunk.offset = (uint64_t)os.tellp();
+		os.write((const char*)pnts.data(), pnts.size() * sizeof(Point));
+		ok = os.good() && spillIs.good();
+	}
+	if (ok) {
+		os.seekp(sizeof(FileHeader));
+		os.write((const char*)chunks.data(), chunks.size() * sizeof(TDChunkFile::Chunk));
+		ok = os.good();
+	}
+	os.close();
+	spillIs.close();
+	remove(spillPath.c_str());
+	return ok;
+}
+
+// Angle-weighted polygon normal added to the corner points, like
+// TDGeometry::calc_normals(NRM_WEIGHT_ANGLE).
+static void add_poly_normal(PointPages& pages, const std::vector<Point>& crn, const std::vector<int>& idx) {
+	using namespace TDSimd;
+	int n = (int)crn.size();
+	V4 p0 = load3(&crn[0].x);
+	V4 e0 = sub(load3(&crn[1].x), p0);
+	V4 nrm = zero();
+	for (int j = 2; j < n; ++j) {
+		V4 e1 = sub(load3(&crn[j].x), p0);
+		nrm = add(nrm, cross(e0, e1));
+		e0 = e1;
+	}
+	float len = length3(nrm);
+	if (len <= 0.0f) { return; }
+	nrm = scale(nrm, 1.0f / len);
+	for (int j = 0; j < n; ++j) {
+		V4 p = load3(&crn[j].x);
+		V4 a = sub(load3(&crn[(j + 1) % n].x), p);
+		V4 b = sub(load3(&crn[(j + n - 1) % n].x), p);
+		float angle = std::atan2(length3(cross(a, b)), dot3(a, b));
+		float v[4];
+		store4(v, scale(nrm, angle));
+		Point& pnt = pages.get((uint32_t)idx[j], true);
+		pnt.nx += v[0];
+		pnt.ny += v[1];
+		pnt.nz += v[2];
+	}
+}
+
+bool TDChunkFile::build(const std::string& folder, const std::string& path, const BuildCfg& cfg) {
+	return build(folder + "/pnt.txt", folder + "/pol.txt", path, cfg);
+}
+
+bool TDChunkFile::build(const std::string& pntsPath, const std::string& polsPath, const std::string& path, const BuildCfg& cfg) {
+	using namespace std;
+	string pntTmpPath = path + ".pnt.tmp";
+	string triTmpPath = path + ".tri.tmp";
+
+	// points -> binary temporary file, other attributes are skipped
+	TDGeometry::PntReader pntReader;
+	if (!pntReader.open(pntsPath, { "P", "N", "Cd", "uv" })) {
+		cout << "Can't load points from " << pntsPath << endl;
+		return false;
+	}
+	bool hasNrm = pntReader.has_normals();
+	TDGeometry::BBox bbox = {};
+	uint32_t npnt = 0;
+	{
+		ofstream os(pntTmpPath, ios::binary);
+		Point pnt;
+		while (pntReader.next(pnt)) {
+			expand_bbox(bbox, pnt, npnt == 0);
+			os.write((const char*)&pnt, sizeof(pnt));
+			++npnt;
+		}
+		if (!os.good()) {
+			remove(pntTmpPath.c_str());
+			return false;
+		}
+	}
+
+	// As in TDGeometry, no polygons table means a point cloud.
+	bool isCloud = !ifstream(TDInStream::find(polsPath)).good();
+
+	// Cells are roughly cubic, their number follows from the usual two
+	// triangles per point of closed meshes (one point per "triangle" for
+	// point clouds).
+	double cellNum = std::max((isCloud ? 1.0 : 2.0) * npnt / std::max(cfg.chunkTris, 1u), 1.0);
+	double ext[3];
+	double extMax = 0.0;
+	for (int i = 0; i < 3; ++i) {
+		ext[i] = (double)bbox.max[i] - bbox.min[i];
+		extMax = std::max(extMax, ext[i]);
+	}
+	for (int i = 0; i < 3; ++i) {
+		ext[i] = std::max(ext[i], extMax * 1e-3);
+	}
+	double cellSize = std::cbrt(ext[0] * ext[1] * ext[2] / cellNum);
+	int grid[3];
+	float cellScale[3];
+	for (int i = 0; i < 3; ++i) {
+		grid[i] = cellSize > 0.0 ? (int)std::lround(ext[i] / cellSize) : 1;
+		grid[i] = std::min(std::max(grid[i], 1), MAX_GRID);
+		float size = bbox.max[i] - bbox.min[i];
+		cellScale[i] = size > 0.0f ? grid[i] / size : 0.0f;
+	}
+	uint32_t ncell = (uint32_t)(grid[0] * grid[1] * grid[2]);
+
+	if (isCloud) {
+		bool ok = build_cloud(pntTmpPath, npnt, bbox, grid, cellScale, hasNrm, path, cfg);
+		remove(pntTmpPath.c_str());
+		if (!ok) {
+			remove(path.c_str());
+		}
+		return ok;
+	}
+
+	// Half of the memory goes to the page cache, half to the cell buffers.
+	size_t bufTris = cfg.memBytes / 2 / ((size_t)ncell * 3 * sizeof(uint32_t));
+	bufTris = std::min(std::max(bufTris, (size_t)64), (size_t)4096);
+	PointPages pages;
+	TDGeometry::PolReader polReader;
+	bool ok = pages.open(pntTmpPath, npnt, cfg.memBytes / 2) && polReader.open(polsPath);
+	if (!ok) {
+		cout << "Can't load polygons from " << polsPath << endl;
+	}
+	vector<TriBlock> blocks;
+	vector<vector<uint32_t>> cellBufs(ncell);
+	ofstream triOs(triTmpPath, ios::binary);
+	uint64_t triOffs = 0;
+	auto flush_cell = [&](uint32_t cell) {
+		vector<uint32_t>& buf = cellBufs[cell];
+		if (buf.empty()) { return; }
+		TriBlock blk;
+		blk.cell = cell;
+		blk.triNum = (uint32_t)(buf.size() / 3);
+		blk.offset = triOffs;
+		triOs.write((const char*)buf.data(), buf.size() * sizeof(uint32_t));
+		triOffs += buf.size() * sizeof(uint32_t);
+		blocks.push_back(blk);
+		buf.clear();
+	};
+
+	vector<int> idx;
+	vector<int> localIdx;
+	vector<Point> crn;
+	vector<uint32_t> tris;
+	while (ok && polReader.next(idx)) {
+		int n = (int)idx.size();
+		bool valid = n >= 3;
+		for (int j = 0; valid && j < n; ++j) {
+			valid = (uint32_t)idx[j] < npnt;
+		}
+		if (!valid) { continue; }
+		crn.resize(n);
+		localIdx.resize(n);
+		for (int j = 0; j < n; ++j) {
+			crn[j] = pages.get((uint32_t)idx[j], false);
+			localIdx[j] = j;
+		}
+		tris.resize((n - 2) * 3);
+		TDGeometry::triangulate_poly(crn.data(), localIdx.data(), n, tris.data());
+		for (int t = 0; t < n - 2; ++t) {
+			uint32_t c[3];
+			for (int i = 0; i < 3; ++i) {
+				float centroid = (&crn[tris[t * 3]].x)[i] + (&crn[tris[t * 3 + 1]].x)[i] + (&crn[tris[t * 3 + 2]].x)[i];
+				int ic = (int)((centroid / 3.0f - bbox.min[i]) * cellScale[i]);
+				c[i] = (uint32_t)std::min(std::max(ic, 0), grid[i] - 1);
+			}
+			uint32_t cell = (c[2] * grid[1] + c[1]) * grid[0] + c[0];
+			vector<uint32_t>& buf = cellBufs[cell];
+			for (int i = 0; i < 3; ++i) {
+				buf.push_back((uint32_t)idx[tris[t * 3 + i]]);
+			}
+			if (buf.size() >= bufTris * 3) {
+				flush_cell(cell);
+			}
+		}
+		if (!hasNrm) {
+			add_poly_normal(pages, crn, idx);
+		}
+	}
+	for (uint32_t cell = 0; ok && cell < ncell; ++cell) {
+		flush_cell(cell);
+	}
+	vector<vector<uint32_t>>().swap(cellBufs);
+	triOs.close();
+	ok = ok && triOs.good();
+
+	// One chunk per non-empty cell: gather its blocks, make point indices
+	// local and copy the points over.
+	stable_sort(blocks.begin(), blocks.end(), [](const TriBlock& a, const TriBlock& b) { return a.cell < b.cell; });
+	vector<Chunk> chunks;
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		if (i == 0 || blocks[i].cell != blocks[i - 1].cell) {
+			chunks.push_back(Chunk());
+		}
+	}
+	ofstream os;
+	if (ok) {
+		os.open(path, ios::binary);
+		write_header(os, chunks, bbox, TDC_HAS_NRM);
+		ok = os.good();
+	}
+	ifstream triIs(triTmpPath, ios::binary);
+	vector<uint32_t> pntMap;
+	vector<Point> pnts;
+	size_t iblk = 0;
+	for (size_t ichunk = 0; ok && ichunk < chunks.size(); ++ichunk) {
+		tris.clear();
+		uint32_t cell = blocks[iblk].cell;
+		for (; iblk < blocks.size() && blocks[iblk].cell == cell; ++iblk) {
+			size_t org = tris.size();
+			tris.resize(org + blocks[iblk].triNum * 3);
+			triIs.seekg(blocks[iblk].offset);
+			triIs.read((char*)&tris[org], blocks[iblk].triNum * 3 * sizeof(uint32_t));
+		}
+		pntMap = tris;
+		sort(pntMap.begin(), pntMap.end());
+		pntMap.erase(unique(pntMap.begin(), pntMap.end()), pntMap.end());
+		for (uint32_t& ipnt : tris) {
+			ipnt = (uint32_t)(lower_bound(pntMap.begin(), pntMap.end(), ipnt) - pntMap.begin());
+		}
+		pnts.resize(pntMap.size());
+		Chunk& chunk = chunks[ichunk];
+		for (size_t j = 0; j < pntMap.size(); ++j) {
+			Point pnt = pages.get(pntMap[j], false);
+			if (!hasNrm) {
+				float len = std::sqrt(pnt.nx * pnt.nx + pnt.ny * pnt.ny + pnt.nz * pnt.nz);
+				float s = len > 0.0f ? 1.0f / len : 0.0f;
+				pnt.nx *= s;
+				pnt.ny *= s;
+				pnt.nz *= s;
+			}
+			pnts[j] = pnt;
+			expand_bbox(chunk.bbox, pnt, j == 0);
+		}
+		chunk.pntNum = (uint32_t)pnts.size();
+		chunk.triNum = (uint32_t)(tris.size() / 3);
+		chunk.offset = (uint64_t)os.tellp();
+		os.write((const char*)pnts.data(), pnts.size() * sizeof(Point));
+		os.write((const char*)tris.data(), tris.size() * sizeof(uint32_t));
+		ok = os.good() && triIs.good();
+	}
+	if (ok) {
+		os.seekp(sizeof(FileHeader));
+		os.write((const char*)chunks.data(), chunks.size() * sizeof(Chunk));
+		ok = os.good();
+	}
+	os.close();
+	triIs.close();
+	pages.close();
+	remove(pntTmpPath.c_str());
+	remove(triTmpPath.c_str());
+	if (!ok) {
+		remove(path.c_str());
+	}
+	return ok;
+}
+
+bool TDChunkFile::open(const std::string& path) {
+	close();
+	mIs.open(path, std::ios::binary);
+	FileHeader hdr;
+	if (!mIs.read((char*)&hdr, sizeof(hdr)) || hdr.magic != TDC_MAGIC || hdr.version != TDC_VERSION) {
+		close();
+		return false;
+	}
+	mChunks.resize(hdr.chunkNum);
+	if (!mIs.read((char*)mChunks.data(), mChunks.size() * sizeof(Chunk))) {
+		close();
+		return false;
+	}
+	mBbox = hdr.bbox;
+	mHasNrm = (hdr.flags & TDC_HAS_NRM) != 0;
+	return true;
+}
+
+void TDChunkFile::close() {
+	mIs.close();
+	mIs.clear();
+	mChunks.clear();
+	mBbox = TDGeometry::BBox();
+	mHasNrm = false;
+}
+
+bool TDChunkFile::load_chunk(uint32_t idx, TDGeometry& geo) {
+	if (idx >= get_chunk_num()) { return false; }
+	const Chunk& chunk = mChunks[idx];
+	std::vector<Point> pnts(chunk.pntNum);
+	std::vector<uint32_t> tris(chunk.triNum * 3);
+	mIs.seekg(chunk.offset);
+	mIs.read((char*)pnts.data(), pnts.size() * sizeof(Point));
+	mIs.read((char*)tris.data(), tris.size() * sizeof(uint32_t));
+	if (!mIs.good()) {
+		mIs.clear();
+		return false;
+	}
+	std::vector<TDGeometry::Poly> pols(chunk.triNum);
+	for (uint32_t i = 0; i < chunk.triNum; ++i) {
+		pols[i].nvtx = 3;
+		for (int j = 0; j < 3; ++j) {
+			pols[i].ipnt[j] = (int)tris[i * 3 + j];
+		}
+	}
+	geo.assign(pnts, pols, mHasNrm);
+	return true;
+}
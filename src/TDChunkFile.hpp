@@ -0,0 +1,64 @@
+/*
+ * TouchDesigner geometry: spatially chunked on-disk format for out-of-core viewing
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "TDGeometry.hpp"
+
+// The mesh is split into the cells of a uniform grid over its bbox, every
+// triangle goes to the cell of its centroid. Each non-empty cell is stored as
+// a self-contained chunk (points shared with other cells are duplicated) so
+// chunks can be loaded one at a time, in any order. A point cloud (no
+// polygons table) is binned by point position into chunks without triangles.
+class TDChunkFile {
+public:
+	struct Chunk {
+		TDGeometry::BBox bbox;
+		uint32_t pntNum;
+		uint32_t triNum;
+		uint64_t offset;
+	};
+
+	struct BuildCfg {
+		// Memory for the point page cache and the per-cell triangle buffers.
+		size_t memBytes;
+		// Approximate triangles (points for point clouds) per chunk, sets
+		// the grid resolution.
+		uint32_t chunkTris;
+
+		BuildCfg() : memBytes(256 << 20), chunkTris(1 << 16) {}
+	};
+
+protected:
+	std::ifstream mIs;
+	std::vector<Chunk> mChunks;
+	TDGeometry::BBox mBbox;
+	bool mHasNrm;
+
+public:
+	TDChunkFile() : mBbox(), mHasNrm(false) {}
+
+	// Converts the TD tables without loading them: points are streamed to a
+	// temporary binary file which is then read through an LRU page cache
+	// while the polygons are streamed and binned, so memory stays within
+	// cfg.memBytes whatever the table sizes. Missing normals are accumulated
+	// on the way (angle weighted).
+	static bool build(const std::string& folder, const std::string& path, const BuildCfg& cfg = BuildCfg());
+	static bool build(const std::string& pntsPath, const std::string& polsPath, const std::string& path, const BuildCfg& cfg = BuildCfg());
+
+	bool open(const std::string& path);
+	void close();
+
+	uint32_t get_chunk_num() const { return (uint32_t)mChunks.size(); }
+	const std::vector<Chunk>& chunks() const { return mChunks; }
+	TDGeometry::BBox bbox() const { return mBbox; }
+
+	// Reads one chunk as a triangle mesh, or as points of a point cloud.
+	// Every thread needs its own TDChunkFile, reads move the file position.
+	bool load_chunk(uint32_t idx, TDGeometry& geo);
+};
@@ -3,81 +3,310 @@
  * Author: Gleb Novodran <novodran@gmail.com>
  */
 #include "TDGeometry.hpp"
+#include "TDParallel.hpp"
+#include "TDRadixSort.hpp"
+#include "TDSimd.hpp"
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <cmath>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
 
 static const char* PTS_FNAME = "pnt.txt";
 static const char* POLY_FNAME = "pol.txt";
 
-TDGeometry::TDGeometry() {
+TDGeometry::TDGeometry() : mHasNrm(false), mAutoNrm(true) {
 	mPnts.clear();
 	mPols.clear();
 }
 
-bool TDGeometry::load_pnts(const std::string& pntsPath) {
-	using namespace std;
+static const struct PointColumn {
+	const char* pName;
+	float TDGeometry::Point::* pField;
+} s_pntColumns[] = {
+	{ "P(0)", &TDGeometry::Point::x },
+	{ "P(1)", &TDGeometry::Point::y },
+	{ "P(2)", &TDGeometry::Point::z },
+	{ "N(0)", &TDGeometry::Point::nx },
+	{ "N(1)", &TDGeometry::Point::ny },
+	{ "N(2)", &TDGeometry::Point::nz },
+	{ "Cd(0)", &TDGeometry::Point::r },
+	{ "Cd(1)", &TDGeometry::Point::g },
+	{ "Cd(2)", &TDGeometry::Point::b },
+	{ "Cd(3)", &TDGeometry::Point::a },
+	{ "uv(0)", &TDGeometry::Point::u },
+	{ "uv(1)", &TDGeometry::Point::v },
+	{ nullptr, nullptr }
+};
 
-	static struct PointMap {
-		const char* pName;
-		float Point::* pField;
-	} map[] = {
-		{ "P(0)", &Point::x },
-		{ "P(1)", &Point::y },
-		{ "P(2)", &Point::z },
-		{ "N(0)", &Point::nx },
-		{ "N(1)", &Point::ny },
-		{ "N(2)", &Point::nz },
-		{ "Cd(0)", &Point::r },
-		{ "Cd(1)", &Point::g },
-		{ "Cd(2)", &Point::b },
-		{ "Cd(3)", &Point::a },
-		{ "uv(0)", &Point::u },
-		{ "uv(1)", &Point::v },
-		{ nullptr, nullptr }
-	};
+// Column map values from here on are indices into the extra values.
+static const int EXTRA_COLUMN = 0x10000;
+static const int COLUMN_SKIP = -1;
+static const int COLUMN_VERTICES = -2;
+static const int COLUMN_CLOSE = -3;
 
-	bool res = true;
-	int nrow = 0;
-	string row;
-	vector<int> columnMap;
+// "Cd(2)" is component 2 of Cd, "pscale" component 0 of pscale.
+static std::string column_attrib(const std::string& cname, int& comp) {
+	size_t brace = cname.find('(');
+	comp = 0;
+	if (brace == std::string::npos || cname.back() != ')') { return cname; }
+	comp = atoi(cname.c_str() + brace + 1);
+	return cname.substr(0, brace);
+}
 
-	ifstream is(pntsPath);
-	if (!is.good()) { return false; }
-	mPnts.clear();
+// Grows the attribute the column belongs to, returns its index.
+static int add_extra_column(std::vector<TDGeometry::Attrib>& extras, const std::string& name, int comp) {
+	int idx = 0;
+	for (; idx < (int)extras.size() && extras[idx].name != name; ++idx);
+	if (idx == (int)extras.size()) {
+		TDGeometry::Attrib attr;
+		attr.name = name;
+		attr.size = 0;
+		attr.isInt = false;
+		extras.push_back(attr);
+	}
+	extras[idx].size = std::max(extras[idx].size, comp + 1);
+	return idx;
+}
 
-	while (getline(is, row)) {
-		istringstream ss(row);
-		if (nrow == 0) {
-			// parse header
-			string cname;
-			while (ss >> cname) {
-				int mapIdx = -1;
-				for (int i = 0; map[i].pName; ++i) {
-					if (cname == map[i].pName) {
-						mapIdx = i;
-						break;
-					}
-				} 
-				columnMap.push_back(mapIdx);
+// Once the header is read: extra columns (attribute, component) get their
+// place in the per-row values, returns the number of values per row.
+static int map_extra_columns(const std::vector<TDGeometry::Attrib>& extras, const std::vector<std::pair<int, int> >& extraColumns, std::vector<int>& columnMap) {
+	std::vector<int> extraOrg(extras.size());
+	int extraSize = 0;
+	for (size_t i = 0; i < extras.size(); ++i) {
+		extraOrg[i] = extraSize;
+		extraSize += extras[i].size;
+	}
+	for (size_t i = 0; i < columnMap.size(); ++i) {
+		if (extraColumns[i].first >= 0) {
+			columnMap[i] = EXTRA_COLUMN + extraOrg[extraColumns[i].first] + extraColumns[i].second;
+		}
+	}
+	return extraSize;
+}
+
+static bool whole_field(const char* pStr, const char* pEnd, const char* pFieldEnd) {
+	if (pEnd == pStr || pEnd > pFieldEnd) { return false; }
+	while (pEnd < pFieldEnd && isspace((unsigned char)*pEnd)) { ++pEnd; }
+	return pEnd == pFieldEnd;
+}
+
+// Reads a tab-separated field that holds nothing but a number; TD string
+// attributes and empty fields give false.
+static bool parse_field(const char* pStr, const char* pFieldEnd, float& val) {
+	char* pEnd;
+	val = std::strtof(pStr, &pEnd);
+	return whole_field(pStr, pEnd, pFieldEnd);
+}
+
+static bool parse_field(const char* pStr, const char* pFieldEnd, double& val) {
+	char* pEnd;
+	val = std::strtod(pStr, &pEnd);
+	return whole_field(pStr, pEnd, pFieldEnd);
+}
+
+static bool extra_numeric(const std::vector<TDGeometry::Attrib>& extras, const std::vector<uint8_t>& read, size_t idx) {
+	size_t org = 0;
+	for (size_t i = 0; i < idx; ++i) {
+		org += extras[i].size;
+	}
+	for (int j = 0; j < extras[idx].size; ++j) {
+		if (read[org + j]) { return true; }
+	}
+	return false;
+}
+
+// Single value attributes start out as int, colors, uvs and the standard
+// float attributes are float from the start.
+static void init_extras(std::vector<TDGeometry::Attrib>& attrs) {
+	for (TDGeometry::Attrib& attr : attrs) {
+		attr.isInt = attr.size == 1 && attr.name != "pscale" && attr.name != "width" && attr.name != "Alpha";
+	}
+}
+
+// Appends the values of one row to every attribute. An int attribute turns
+// float at its first value that isn't a whole int32.
+static void push_extras(std::vector<TDGeometry::Attrib>& attrs, const double* pVal) {
+	for (TDGeometry::Attrib& attr : attrs) {
+		if (attr.isInt) {
+			double val = *pVal;
+			if (val == std::floor(val) && val >= -2147483648.0 && val < 2147483648.0) {
+				attr.ints.push_back((int32_t)val);
+			} else {
+				attr.isInt = false;
+				attr.data.assign(attr.ints.begin(), attr.ints.end());
+				std::vector<int32_t>().swap(attr.ints);
+			}
+		}
+		if (!attr.isInt) {
+			for (int j = 0; j < attr.size; ++j) {
+				attr.data.push_back((float)pVal[j]);
+			}
+		}
+		pVal += attr.size;
+	}
+}
+
+// After the last row: attributes without a single number are text columns
+// and dropped.
+template <typename READER>
+static void finish_extras(std::vector<TDGeometry::Attrib>& attrs, const READER& reader, bool hasRows) {
+	std::vector<TDGeometry::Attrib> kept;
+	for (size_t i = 0; i < attrs.size(); ++i) {
+		if (hasRows && !reader.is_numeric(i)) { continue; }
+		attrs[i].isInt = attrs[i].isInt && hasRows;
+		kept.push_back(std::move(attrs[i]));
+	}
+	attrs.swap(kept);
+}
+
+template <typename T>
+static void permute_values(std::vector<T>& vals, size_t size, const std::vector<uint32_t>& order) {
+	std::vector<T> permuted(vals.size());
+	TDParallel::for_each((uint32_t)order.size(), [&](uint32_t i) {
+		std::copy_n(&vals[order[i] * size], size, &permuted[i * size]);
+	});
+	vals.swap(permuted);
+}
+
+static void permute_extras(std::vector<TDGeometry::Attrib>& attrs, const std::vector<uint32_t>& order) {
+	for (TDGeometry::Attrib& attr : attrs) {
+		if (attr.isInt) {
+			permute_values(attr.ints, attr.size, order);
+		} else {
+			permute_values(attr.data, attr.size, order);
+		}
+	}
+}
+
+static bool is_point_field(const std::string& name) {
+	for (int i = 0; s_pntColumns[i].pName; ++i) {
+		int comp;
+		if (name == column_attrib(s_pntColumns[i].pName, comp)) { return true; }
+	}
+	return false;
+}
+
+bool TDGeometry::PntReader::open(const std::string& path, const std::vector<std::string>& attrs) {
+	using namespace std;
+	mColumnMap.clear();
+	mColumnNum = 0;
+	mExtras.clear();
+	mExtraSize = 0;
+	mExtraRead.clear();
+	mHasNrm = false;
+	mIs.close();
+	mIs.clear();
+	mIs.open(TDInStream::find(path));
+	if (!mIs.good()) { return false; }
+
+	// parse header
+	string row;
+	if (!getline(mIs, row)) { return true; } // empty table
+	istringstream ss(row);
+	string cname;
+	int nrmColumns = 0;
+	vector<pair<int, int> > extraColumns; // attribute and component, or -1
+	while (ss >> cname) {
+		int comp;
+		string name = column_attrib(cname, comp);
+		bool wanted = name == "P" || attrs.empty() || find(attrs.begin(), attrs.end(), name) != attrs.end();
+		int mapIdx = COLUMN_SKIP;
+		int extraIdx = -1;
+		// TD's row number and point weight are not attributes
+		if (!wanted || cname == "index" || cname == "Pw") {
+		} else if (is_point_field(name)) {
+			for (int i = 0; s_pntColumns[i].pName; ++i) {
+				if (cname == s_pntColumns[i].pName) {
+					mapIdx = i;
+					break;
+				}
 			}
 		} else {
-			int columnIdx = 0;
+			extraIdx = add_extra_column(mExtras, name, comp);
+		}
+		mColumnMap.push_back(mapIdx);
+		extraColumns.push_back(make_pair(extraIdx, comp));
+		if (mapIdx >= 0) {
+			float Point::* pField = s_pntColumns[mapIdx].pField;
+			if (pField == &Point::nx || pField == &Point::ny || pField == &Point::nz) {
+				++nrmColumns;
+			}
+		}
+	}
+	mHasNrm = nrmColumns == 3;
+
+	mExtraSize = map_extra_columns(mExtras, extraColumns, mColumnMap);
+	mExtraRead.assign(mExtraSize, 0);
+	for (size_t i = 0; i < mColumnMap.size(); ++i) {
+		if (mColumnMap[i] >= 0) {
+			mColumnNum = i + 1;
+		}
+	}
+	return true;
+}
+
+bool TDGeometry::PntReader::next(Point& pnt, double* pExtra) {
+	if (!std::getline(mIs, mRow)) { return false; }
+	pnt = Point();
+	if (pExtra) {
+		std::fill(pExtra, pExtra + mExtraSize, 0.0);
+	}
+	// fields are split on tabs, string attributes may hold spaces
+	const char* pStr = mRow.c_str();
+	for (size_t i = 0; i < mColumnNum && *pStr; ++i) {
+		const char* pFieldEnd = pStr;
+		while (*pFieldEnd && *pFieldEnd != '\t') { ++pFieldEnd; }
+		int imap = mColumnMap[i];
+		if (imap >= 0 && imap < EXTRA_COLUMN) {
 			float val;
-			Point pnt = {};
-			while (ss >> val) {
-				int imap = columnMap[columnIdx];
-				if (imap >= 0) {
-					pnt.*map[imap].pField = val;
+			if (parse_field(pStr, pFieldEnd, val)) {
+				pnt.*s_pntColumns[imap].pField = val;
+			}
+		} else if (imap >= EXTRA_COLUMN) {
+			double val;
+			if (parse_field(pStr, pFieldEnd, val)) {
+				mExtraRead[imap - EXTRA_COLUMN] = 1;
+				if (pExtra) {
+					pExtra[imap - EXTRA_COLUMN] = val;
 				}
-				++columnIdx;
 			}
-			mPnts.push_back(pnt);
 		}
-		++nrow;
+		pStr = *pFieldEnd ? pFieldEnd + 1 : pFieldEnd;
+	}
+	return true;
+}
+
+bool TDGeometry::PntReader::is_numeric(size_t idx) const {
+	return extra_numeric(mExtras, mExtraRead, idx);
+}
+
+bool TDGeometry::load_pnts(const std::string& pntsPath) {
+	PntReader reader;
+	if (!reader.open(pntsPath, mLoadAttrs)) { return false; }
+	mPnts.clear();
+	mPntAttrs = reader.extra_attribs();
+	init_extras(mPntAttrs);
+	mHasNrm = reader.has_normals();
+	std::vector<double> extra(reader.get_extra_size());
+	Point pnt;
+	while (reader.next(pnt, extra.data())) {
+		mPnts.push_back(pnt);
+		push_extras(mPntAttrs, extra.data());
 	}
+	finish_extras(mPntAttrs, reader, !mPnts.empty());
+	calc_bbox();
+	return true;
+}
 
+void TDGeometry::calc_bbox() {
+	if (mPnts.empty()) {
+		mBbox = BBox();
+		return;
+	}
 	mBbox.max[0] = mBbox.min[0] = mPnts[0].x;
 	mBbox.max[1] = mBbox.min[1] = mPnts[0].y;
 	mBbox.max[2] = mBbox.min[2] = mPnts[0].z;
@@ -90,57 +319,138 @@ bool TDGeometry::load_pnts(const std::string& pntsPath) {
 		mBbox.max[1] = std::fmaxf(mBbox.max[1], pt.y);
 		mBbox.max[2] = std::fmaxf(mBbox.max[2], pt.z);
 	}
-	return res;
 }
 
-bool TDGeometry::load_pols(const std::string& polsPath) {
+// Fields are tab separated, the vertices field is a space separated list.
+bool TDGeometry::PolReader::open(const std::string& path) {
 	using namespace std;
-	const string verticesColName = "vertices";
-	bool res = true;
-	int nrow = 0;
-	string row;
-	vector<int> columnMap;
-	int vertsIdx = -1;
+	mColumnMap.clear();
+	mColumnNum = 0;
+	mExtras.clear();
+	mExtraSize = 0;
+	mExtraRead.clear();
+	mHasClose = false;
+	mIs.close();
+	mIs.clear();
+	mIs.open(TDInStream::find(path));
+	if (!mIs.good()) { return false; }
 
-	ifstream is(polsPath);
-	if (!is.good()) { return false; }
-	mPols.clear();
+	string row;
+	if (!getline(mIs, row)) { return true; } // empty table
+	istringstream ss(row);
+	string cname;
+	bool hasVerts = false;
+	vector<pair<int, int> > extraColumns;
+	while (ss >> cname) {
+		int mapIdx = COLUMN_SKIP;
+		int extraIdx = -1;
+		int comp = 0;
+		if (cname == "vertices") {
+			mapIdx = COLUMN_VERTICES;
+			hasVerts = true;
+		} else if (cname == "close") {
+			mapIdx = COLUMN_CLOSE;
+			mHasClose = true;
+		} else if (cname != "index") {
+			string name = column_attrib(cname, comp);
+			extraIdx = add_extra_column(mExtras, name, comp);
+		}
+		mColumnMap.push_back(mapIdx);
+		extraColumns.push_back(make_pair(extraIdx, comp));
+	}
+	mExtraSize = map_extra_columns(mExtras, extraColumns, mColumnMap);
+	mExtraRead.assign(mExtraSize, 0);
+	for (size_t i = 0; i < mColumnMap.size(); ++i) {
+		if (mColumnMap[i] != COLUMN_SKIP) {
+			mColumnNum = i + 1;
+		}
+	}
+	return hasVerts;
+}
 
-	while (getline(is, row)) {
-		istringstream ss(row);
-		if (nrow == 0) {
-			string cname;
-			int idx = 0;
-			while (ss >> cname) {
-				if (cname == verticesColName) {
-					vertsIdx = idx;
-					break;
-				}
-				++idx;
-			}
-			if (vertsIdx == -1) {
-				return false;
+bool TDGeometry::PolReader::next(std::vector<int>& pnts, double* pExtra, bool* pClosed) {
+	if (!std::getline(mIs, mRow)) { return false; }
+	pnts.clear();
+	if (pExtra) {
+		std::fill(pExtra, pExtra + mExtraSize, 0.0);
+	}
+	if (pClosed) {
+		*pClosed = true;
+	}
+	const char* pStr = mRow.c_str();
+	for (size_t i = 0; i < mColumnNum && *pStr; ++i) {
+		const char* pFieldEnd = pStr;
+		while (*pFieldEnd && *pFieldEnd != '\t') { ++pFieldEnd; }
+		int imap = mColumnMap[i];
+		if (imap == COLUMN_VERTICES) {
+			const char* pNum = pStr;
+			while (pNum < pFieldEnd) {
+				char* pEnd;
+				long val = std::strtol(pNum, &pEnd, 10);
+				if (pEnd == pNum || pEnd > pFieldEnd) { break; }
+				pnts.push_back((int)val);
+				pNum = pEnd;
 			}
-		} else {
-			string column;
-			uint32_t val;
-			int i = 0;
-			Poly poly = {};
-			for (int i = 0; i <= vertsIdx; getline(ss, column, '\t'), ++i);
-
-			istringstream cs(column);
-			while (cs >> val) {
-				poly.ipnt[poly.nvtx] = val;
-				poly.nvtx++;
-				if (poly.nvtx > MAX_POLY_VERTS) {
-					cout << "Warning: Polygon #" << nrow + 1 << " is an n-gon. It was clipped to a quad" << endl;
-					break;
+		} else if (imap != COLUMN_SKIP) {
+			double val;
+			if (parse_field(pStr, pFieldEnd, val)) {
+				if (imap == COLUMN_CLOSE) {
+					if (pClosed) {
+						*pClosed = val != 0.0;
+					}
+				} else {
+					mExtraRead[imap - EXTRA_COLUMN] = 1;
+					if (pExtra) {
+						pExtra[imap - EXTRA_COLUMN] = val;
+					}
 				}
 			}
-			mPols.push_back(poly);
 		}
-		++nrow;
+		pStr = *pFieldEnd ? pFieldEnd + 1 : pFieldEnd;
+	}
+	return true;
+}
+
+bool TDGeometry::PolReader::is_numeric(size_t idx) const {
+	return extra_numeric(mExtras, mExtraRead, idx);
+}
+
+// Without a polygons table the points are a point cloud.
+bool TDGeometry::load_pols(const std::string& polsPath) {
+	using namespace std;
+	mPols.clear();
+	mPolAttrs.clear();
+	mPolClosed.clear();
+	mNgonPols.clear();
+	mNgonOrg.clear();
+	mNgonPnts.clear();
+	if (!ifstream(TDInStream::find(polsPath)).good()) { return true; }
+	PolReader reader;
+	if (!reader.open(polsPath)) { return false; }
+	mPolAttrs = reader.extra_attribs();
+	init_extras(mPolAttrs);
+
+	vector<int> pnts;
+	vector<double> extra(reader.get_extra_size());
+	bool closed;
+	while (reader.next(pnts, extra.data(), &closed)) {
+		push_extras(mPolAttrs, extra.data());
+		if (reader.has_close()) {
+			mPolClosed.push_back(closed ? 1 : 0);
+		}
+		Poly poly = {};
+		poly.nvtx = (int)pnts.size();
+		for (int i = 0; i < poly.nvtx && i < MAX_POLY_VERTS; ++i) {
+			poly.ipnt[i] = pnts[i];
+		}
+		if (poly.nvtx > MAX_POLY_VERTS) {
+			mNgonPols.push_back((uint32_t)mPols.size());
+			mNgonOrg.push_back((uint32_t)mNgonPnts.size());
+			mNgonPnts.insert(mNgonPnts.end(), pnts.begin(), pnts.end());
+		}
+		mPols.push_back(poly);
 	}
+	finish_extras(mPolAttrs, reader, !mPols.empty());
 
 	return true;
 }
@@ -160,6 +470,11 @@ bool TDGeometry::load(const std::string& pntsPath, const std::string& polsPath)
 		res = load_pols(polsPath);
 		if (!res) {
 			cout << "Can't load polygons from " << polsPath << endl;
+		} else {
+			triangulate();
+			if (mAutoNrm && !mHasNrm && get_poly_num() > 0) {
+				calc_normals();
+			}
 		}
 	} else {
 		cout << "Can't load points from "<< pntsPath << endl;
@@ -173,6 +488,551 @@ void TDGeometry::unload() {
 
 	mPnts.clear();
 	std::vector<Point>().swap(mPnts);
+	std::vector<Attrib>().swap(mPntAttrs);
+	std::vector<Attrib>().swap(mPolAttrs);
+	std::vector<uint8_t>().swap(mPolClosed);
+	mHasNrm = false;
+
+	std::vector<uint32_t>().swap(mNgonPols);
+	std::vector<uint32_t>().swap(mNgonOrg);
+	std::vector<int>().swap(mNgonPnts);
+	std::vector<uint32_t>().swap(mTris);
+	std::vector<uint32_t>().swap(mTriPols);
+}
+
+void TDGeometry::assign(std::vector<Point>& pnts, std::vector<Poly>& pols, bool hasNrm) {
+	for (Poly& pol : pols) {
+		pol.nvtx = std::min(pol.nvtx, (int)MAX_POLY_VERTS);
+	}
+	std::vector<int> ngonPnts;
+	assign(pnts, pols, ngonPnts, hasNrm);
+}
+
+void TDGeometry::assign(std::vector<Point>& pnts, std::vector<Poly>& pols, std::vector<int>& ngonPnts, bool hasNrm) {
+	mPnts.swap(pnts);
+	mPols.swap(pols);
+	mNgonPnts.swap(ngonPnts);
+	mPntAttrs.clear();
+	mPolAttrs.clear();
+	mPolClosed.clear();
+	mNgonPols.clear();
+	mNgonOrg.clear();
+	uint32_t org = 0;
+	for (uint32_t i = 0; i < (uint32_t)mPols.size(); ++i) {
+		if (mPols[i].nvtx > MAX_POLY_VERTS) {
+			mNgonPols.push_back(i);
+			mNgonOrg.push_back(org);
+			org += (uint32_t)mPols[i].nvtx;
+		}
+	}
+	mHasNrm = hasNrm;
+	calc_bbox();
+	triangulate();
+}
+
+const TDGeometry::Attrib* TDGeometry::find_pnt_attrib(const std::string& name) const {
+	for (const Attrib& attr : mPntAttrs) {
+		if (attr.name == name) { return &attr; }
+	}
+	return nullptr;
+}
+
+const TDGeometry::Attrib* TDGeometry::find_pol_attrib(const std::string& name) const {
+	for (const Attrib& attr : mPolAttrs) {
+		if (attr.name == name) { return &attr; }
+	}
+	return nullptr;
+}
+
+const int* TDGeometry::poly_pnts(uint32_t idx) const {
+	if (idx >= get_poly_num()) { return nullptr; }
+	const Poly& pol = mPols[idx];
+	if (pol.nvtx <= MAX_POLY_VERTS) {
+		return pol.ipnt;
+	}
+	size_t ingon = std::lower_bound(mNgonPols.begin(), mNgonPols.end(), idx) - mNgonPols.begin();
+	return &mNgonPnts[mNgonOrg[ingon]];
+}
+
+static inline TDSimd::V4 pnt_pos(const TDGeometry::Point& pnt) {
+	return TDSimd::load3(&pnt.x);
+}
+
+static float corner_angle(const std::vector<TDGeometry::Point>& pnts, const int* pIdx, int nvtx, uint32_t ipnt) {
+	using namespace TDSimd;
+	for (int i = 0; i < nvtx; ++i) {
+		if ((uint32_t)pIdx[i] == ipnt) {
+			V4 p = pnt_pos(pnts[ipnt]);
+			V4 a = sub(pnt_pos(pnts[pIdx[(i + 1) % nvtx]]), p);
+			V4 b = sub(pnt_pos(pnts[pIdx[(i + nvtx - 1) % nvtx]]), p);
+			return std::atan2(length3(cross(a, b)), dot3(a, b));
+		}
+	}
+	return 0.0f;
+}
+
+// Vertex normals are gathered rather than scattered: polygon corners are
+// radix-sorted by point index into a point->polygon CSR table, so every
+// point sums its own polygons and threads never write to shared points.
+void TDGeometry::calc_normals(NormalWeight weight) {
+	using namespace TDSimd;
+	uint32_t npnt = get_pnt_num();
+	uint32_t npol = get_poly_num();
+	if (npnt == 0) { return; }
+
+	// polygon normals, length is twice the polygon area
+	std::vector<float> polNrm(npol * 4);
+	std::vector<uint32_t> polOrg(npol + 1);
+	polOrg[0] = 0;
+	for (uint32_t i = 0; i < npol; ++i) {
+		polOrg[i + 1] = polOrg[i] + mPols[i].nvtx;
+	}
+	TDParallel::for_each(npol, [&](uint32_t i) {
+		const Poly& pol = mPols[i];
+		const int* pIdx = poly_pnts(i);
+		V4 nrm = zero();
+		bool valid = pol.nvtx >= 3;
+		for (int j = 0; j < pol.nvtx; ++j) {
+			valid = valid && (uint32_t)pIdx[j] < npnt;
+		}
+		if (valid) {
+			V4 p0 = pnt_pos(mPnts[pIdx[0]]);
+			V4 e0 = sub(pnt_pos(mPnts[pIdx[1]]), p0);
+			for (int j = 2; j < pol.nvtx; ++j) {
+				V4 e1 = sub(pnt_pos(mPnts[pIdx[j]]), p0);
+				nrm = add(nrm, cross(e0, e1));
+				e0 = e1;
+			}
+		}
+		store4(&polNrm[i * 4], nrm);
+	});
+
+	uint32_t ncrn = polOrg[npol];
+	std::vector<uint32_t> crnPnt(ncrn);
+	std::vector<uint32_t> crnPol(ncrn);
+	TDParallel::for_each(npol, [&](uint32_t i) {
+		const Poly& pol = mPols[i];
+		const int* pIdx = poly_pnts(i);
+		for (int j = 0; j < pol.nvtx; ++j) {
+			uint32_t ipnt = (uint32_t)pIdx[j];
+			crnPnt[polOrg[i] + j] = ipnt < npnt ? ipnt : npnt;
+			crnPol[polOrg[i] + j] = i;
+		}
+	});
+	int keyBits = 0;
+	while (keyBits < 32 && (npnt >> keyBits) != 0) { ++keyBits; }
+	TDRadixSort::sort_pairs(crnPnt, crnPol, keyBits);
+
+	std::vector<uint32_t> pntOrg(npnt + 2, ncrn);
+	TDParallel::for_each(ncrn, [&](uint32_t i) {
+		if (i == 0 || crnPnt[i] != crnPnt[i - 1]) {
+			uint32_t c0 = i > 0 ? crnPnt[i - 1] + 1 : 0;
+			for (uint32_t c = c0; c <= crnPnt[i]; ++c) {
+				pntOrg[c] = i;
+			}
+		}
+	});
+
+	TDParallel::for_each(npnt, [&](uint32_t ipnt) {
+		V4 sum = zero();
+		V4 flat = zero();
+		float flatLen = 0.0f;
+		for (uint32_t k = pntOrg[ipnt]; k < pntOrg[ipnt + 1]; ++k) {
+			uint32_t ipol = crnPol[k];
+			V4 nrm = load4(&polNrm[ipol * 4]);
+			float len = length3(nrm);
+			if (len <= 0.0f) { continue; }
+			if (len > flatLen) {
+				flat = nrm;
+				flatLen = len;
+			}
+			if (weight == NRM_WEIGHT_ANGLE) {
+				nrm = scale(nrm, corner_angle(mPnts, poly_pnts(ipol), mPols[ipol].nvtx, ipnt) / len);
+			}
+			sum = add(sum, nrm);
+		}
+		float len = length3(sum);
+		if (len <= 1e-6f * flatLen) {
+			// contributions cancel out (e.g. a fin), use the largest polygon's normal
+			sum = flat;
+			len = flatLen;
+		}
+		Point& pnt = mPnts[ipnt];
+		if (len > 0.0f) {
+			float nrm[4];
+			store4(nrm, scale(sum, 1.0f / len));
+			pnt.nx = nrm[0];
+			pnt.ny = nrm[1];
+			pnt.nz = nrm[2];
+		} else {
+			pnt.nx = pnt.ny = pnt.nz = 0.0f;
+		}
+	}, 1024);
+	mHasNrm = true;
+}
+
+static const int CURVE_BITS = 16;
+
+static uint64_t morton_spread(uint32_t v) {
+	uint64_t x = v & 0x1FFFFF;
+	x = (x | (x << 32)) & 0x1F00000000FFFFull;
+	x = (x | (x << 16)) & 0x1F0000FF0000FFull;
+	x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+	x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+static uint64_t morton_key(uint32_t c[3]) {
+	return morton_spread(c[0]) | (morton_spread(c[1]) << 1) | (morton_spread(c[2]) << 2);
+}
+
+// J. Skilling, "Programming the Hilbert curve": axes to transposed index,
+// then the transposed bits are interleaved into one key.
+static uint64_t hilbert_key(uint32_t c[3]) {
+	uint32_t x[3] = { c[0], c[1], c[2] };
+	uint32_t m = 1u << (CURVE_BITS - 1);
+	for (uint32_t q = m; q > 1; q >>= 1) {
+		uint32_t p = q - 1;
+		for (int i = 0; i < 3; ++i) {
+			if (x[i] & q) {
+				x[0] ^= p;
+			} else {
+				uint32_t t = (x[0] ^ x[i]) & p;
+				x[0] ^= t;
+				x[i] ^= t;
+			}
+		}
+	}
+	x[1] ^= x[0];
+	x[2] ^= x[1];
+	uint32_t t = 0;
+	for (uint32_t q = m; q > 1; q >>= 1) {
+		if (x[2] & q) { t ^= q - 1; }
+	}
+	for (int i = 0; i < 3; ++i) {
+		x[i] ^= t;
+	}
+	uint64_t key = 0;
+	for (int b = CURVE_BITS - 1; b >= 0; --b) {
+		for (int i = 0; i < 3; ++i) {
+			key = (key << 1) | ((x[i] >> b) & 1);
+		}
+	}
+	return key;
+}
+
+static uint64_t curve_key(TDGeometry::CurveKind kind, const float pos[3], const TDGeometry::BBox& bbox) {
+	const uint32_t cmax = (1u << CURVE_BITS) - 1;
+	uint32_t c[3];
+	for (int i = 0; i < 3; ++i) {
+		float ext = bbox.max[i] - bbox.min[i];
+		float t = ext > 0.0f ? (pos[i] - bbox.min[i]) / ext : 0.0f;
+		t = std::min(std::max(t, 0.0f), 1.0f);
+		c[i] = (uint32_t)(t * cmax);
+	}
+	return kind == TDGeometry::CURVE_HILBERT ? hilbert_key(c) : morton_key(c);
+}
+
+void TDGeometry::reorder(CurveKind kind, std::vector<uint32_t>* pPntOrder, std::vector<uint32_t>* pPolOrder) {
+	uint32_t npnt = get_pnt_num();
+	uint32_t npol = get_poly_num();
+
+	std::vector<uint64_t> keys(npnt);
+	std::vector<uint32_t> pntOrder(npnt);
+	TDParallel::for_each(npnt, [&](uint32_t i) {
+		keys[i] = curve_key(kind, &mPnts[i].x, mBbox);
+		pntOrder[i] = i;
+	});
+	TDRadixSort::sort_pairs(keys, pntOrder, CURVE_BITS * 3);
+
+	std::vector<uint32_t> pntRemap(npnt);
+	std::vector<Point> pnts(npnt);
+	TDParallel::for_each(npnt, [&](uint32_t i) {
+		pnts[i] = mPnts[pntOrder[i]];
+		pntRemap[pntOrder[i]] = i;
+	});
+	mPnts.swap(pnts);
+	std::vector<Point>().swap(pnts);
+	permute_extras(mPntAttrs, pntOrder);
+
+	// polygons follow the curve position of their centroid
+	keys.resize(npol);
+	std::vector<uint32_t> polOrder(npol);
+	TDParallel::for_each(npol, [&](uint32_t i) {
+		const Poly& pol = mPols[i];
+		const int* pIdx = poly_pnts(i);
+		float c[3] = { 0.0f, 0.0f, 0.0f };
+		int n = 0;
+		for (int j = 0; j < pol.nvtx; ++j) {
+			if ((uint32_t)pIdx[j] < npnt) {
+				const Point& pnt = mPnts[pntRemap[pIdx[j]]];
+				c[0] += pnt.x;
+				c[1] += pnt.y;
+				c[2] += pnt.z;
+				++n;
+			}
+		}
+		if (n > 0) {
+			c[0] /= n;
+			c[1] /= n;
+			c[2] /= n;
+		}
+		keys[i] = curve_key(kind, c, mBbox);
+		polOrder[i] = i;
+	});
+	TDRadixSort::sort_pairs(keys, polOrder, CURVE_BITS * 3);
+	std::vector<uint64_t>().swap(keys);
+
+	std::vector<Poly> pols(npol);
+	std::vector<uint32_t> ngonPols;
+	std::vector<uint32_t> ngonOrg;
+	std::vector<int> ngonPnts;
+	ngonPnts.reserve(mNgonPnts.size());
+	for (uint32_t i = 0; i < npol; ++i) {
+		const Poly& src = mPols[polOrder[i]];
+		const int* pIdx = poly_pnts(polOrder[i]);
+		Poly& dst = pols[i];
+		dst.nvtx = src.nvtx;
+		for (int j = 0; j < src.nvtx && j < MAX_POLY_VERTS; ++j) {
+			dst.ipnt[j] = (uint32_t)src.ipnt[j] < npnt ? (int)pntRemap[src.ipnt[j]] : src.ipnt[j];
+		}
+		if (src.nvtx > MAX_POLY_VERTS) {
+			ngonPols.push_back(i);
+			ngonOrg.push_back((uint32_t)ngonPnts.size());
+			for (int j = 0; j < src.nvtx; ++j) {
+				ngonPnts.push_back((uint32_t)pIdx[j] < npnt ? (int)pntRemap[pIdx[j]] : pIdx[j]);
+			}
+		}
+	}
+	mPols.swap(pols);
+	permute_extras(mPolAttrs, polOrder);
+	if (!mPolClosed.empty()) {
+		std::vector<uint8_t> closed(npol);
+		for (uint32_t i = 0; i < npol; ++i) {
+			closed[i] = mPolClosed[polOrder[i]];
+		}
+		mPolClosed.swap(closed);
+	}
+	mNgonPols.swap(ngonPols);
+	mNgonOrg.swap(ngonOrg);
+	mNgonPnts.swap(ngonPnts);
+	triangulate();
+
+	if (pPntOrder) {
+		pPntOrder->swap(pntOrder);
+	}
+	if (pPolOrder) {
+		pPolOrder->swap(polOrder);
+	}
+}
+
+static const int SORT_TRI_BITS = 5; // grid cells per axis: 1 << SORT_TRI_BITS
+
+// American flag sort: cell counts, then every triangle is swapped straight
+// into the range of its cell, recomputing cells instead of storing them.
+void TDGeometry::sort_tris() {
+	uint32_t ntri = get_tri_num();
+	if (ntri < 2) { return; }
+	const uint32_t ncell = 1u << (SORT_TRI_BITS * 3);
+	const uint32_t cdim = 1u << SORT_TRI_BITS;
+	auto tri_cell = [&](uint32_t i) -> uint32_t {
+		const uint32_t* pTri = &mTris[i * 3];
+		uint32_t c[3];
+		for (int j = 0; j < 3; ++j) {
+			float pos = ((&mPnts[pTri[0]].x)[j] + (&mPnts[pTri[1]].x)[j] + (&mPnts[pTri[2]].x)[j]) * (1.0f / 3.0f);
+			float ext = mBbox.max[j] - mBbox.min[j];
+			float t = ext > 0.0f ? (pos - mBbox.min[j]) / ext : 0.0f;
+			c[j] = std::min((uint32_t)(std::max(t, 0.0f) * cdim), cdim - 1);
+		}
+		return (uint32_t)morton_key(c);
+	};
+
+	uint32_t nslices = TDParallel::num_slices(ntri, 1 << 16);
+	std::vector<uint32_t> hist(nslices * ncell, 0);
+	TDParallel::for_slices(ntri, nslices, [&](uint32_t org, uint32_t end, uint32_t islice) {
+		uint32_t* pHist = &hist[islice * ncell];
+		for (uint32_t i = org; i < end; ++i) {
+			++pHist[tri_cell(i)];
+		}
+	});
+	std::vector<uint32_t> cellEnd(ncell);
+	std::vector<uint32_t> cellNext(ncell);
+	uint32_t sum = 0;
+	for (uint32_t c = 0; c < ncell; ++c) {
+		cellNext[c] = sum;
+		for (uint32_t s = 0; s < nslices; ++s) {
+			sum += hist[s * ncell + c];
+		}
+		cellEnd[c] = sum;
+	}
+	std::vector<uint32_t>().swap(hist);
+
+	bool withPols = mTriPols.size() == ntri;
+	for (uint32_t c = 0; c < ncell; ++c) {
+		while (cellNext[c] < cellEnd[c]) {
+			uint32_t i = cellNext[c];
+			uint32_t dst = tri_cell(i);
+			if (dst == c) {
+				++cellNext[c];
+				continue;
+			}
+			uint32_t j = cellNext[dst]++;
+			for (int k = 0; k < 3; ++k) {
+				std::swap(mTris[i * 3 + k], mTris[j * 3 + k]);
+			}
+			if (withPols) {
+				std::swap(mTriPols[i], mTriPols[j]);
+			}
+		}
+	}
+}
+
+// Ear clipping in the plane of the polygon's Newell normal.
+// Falls back to clipping the current corner when no ear is found
+// (self-intersecting or degenerate input), so n-2 triangles are always emitted.
+static void ear_clip(const TDGeometry::Point* pnts, const int* pIdx, int nvtx, uint32_t* pTris) {
+	float nrm[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < nvtx; ++i) {
+		const TDGeometry::Point& p0 = pnts[pIdx[i]];
+		const TDGeometry::Point& p1 = pnts[pIdx[(i + 1) % nvtx]];
+		nrm[0] += (p0.y - p1.y) * (p0.z + p1.z);
+		nrm[1] += (p0.z - p1.z) * (p0.x + p1.x);
+		nrm[2] += (p0.x - p1.x) * (p0.y + p1.y);
+	}
+	int axis = 2;
+	if (std::fabs(nrm[0]) > std::fabs(nrm[1]) && std::fabs(nrm[0]) > std::fabs(nrm[2])) {
+		axis = 0;
+	} else if (std::fabs(nrm[1]) > std::fabs(nrm[2])) {
+		axis = 1;
+	}
+	int ax = (axis + 1) % 3;
+	int ay = (axis + 2) % 3;
+	float flip = nrm[axis] < 0.0f ? -1.0f : 1.0f;
+
+	std::vector<float> pos(nvtx * 2);
+	std::vector<int> ring(nvtx);
+	for (int i = 0; i < nvtx; ++i) {
+		const float* p = &pnts[pIdx[i]].x;
+		pos[i * 2] = p[ax];
+		pos[i * 2 + 1] = p[ay] * flip;
+		ring[i] = i;
+	}
+
+	int n = nvtx;
+	int cur = 0;
+	int miss = 0;
+	while (n > 3) {
+		int i0 = ring[(cur + n - 1) % n];
+		int i1 = ring[cur % n];
+		int i2 = ring[(cur + 1) % n];
+		const float* a = &pos[i0 * 2];
+		const float* b = &pos[i1 * 2];
+		const float* c = &pos[i2 * 2];
+		float area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+		bool ear = area > 0.0f;
+		for (int k = 0; ear && k < n; ++k) {
+			int j = ring[k];
+			if (j == i0 || j == i1 || j == i2) { continue; }
+			const float* p = &pos[j * 2];
+			float w0 = (b[0] - a[0]) * (p[1] - a[1]) - (b[1] - a[1]) * (p[0] - a[0]);
+			float w1 = (c[0] - b[0]) * (p[1] - b[1]) - (c[1] - b[1]) * (p[0] - b[0]);
+			float w2 = (a[0] - c[0]) * (p[1] - c[1]) - (a[1] - c[1]) * (p[0] - c[0]);
+			ear = !(w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f);
+		}
+		if (ear || miss >= n) {
+			*pTris++ = (uint32_t)pIdx[i0];
+			*pTris++ = (uint32_t)pIdx[i1];
+			*pTris++ = (uint32_t)pIdx[i2];
+			ring.erase(ring.begin() + (cur % n));
+			--n;
+			cur = cur % n;
+			miss = 0;
+		} else {
+			cur = (cur + 1) % n;
+			++miss;
+		}
+	}
+	*pTris++ = (uint32_t)pIdx[ring[0]];
+	*pTris++ = (uint32_t)pIdx[ring[1]];
+	*pTris++ = (uint32_t)pIdx[ring[2]];
+}
+
+void TDGeometry::triangulate_poly(const Point* pPnts, const int* pIdx, int nvtx, uint32_t* pTris) {
+	static const int div[2][6] = {
+		{0, 1, 2,  0, 2, 3},
+		{0, 1, 3,  1, 2, 3}
+	};
+	if (nvtx == 3) {
+		for (int j = 0; j < 3; ++j) {
+			pTris[j] = (uint32_t)pIdx[j];
+		}
+	} else if (nvtx == 4) {
+		using namespace TDSimd;
+		V4 v[4];
+		for (int j = 0; j < 4; ++j) {
+			v[j] = pnt_pos(pPnts[pIdx[j]]);
+		}
+		V4 e0 = sub(v[0], v[1]);
+		V4 e1 = sub(v[1], v[2]);
+		V4 e2 = sub(v[2], v[3]);
+		V4 e3 = sub(v[3], v[0]);
+		int idiv = dot3(cross(e1, e2), cross(e3, e0)) > 0.0f ? 1 : 0;
+		for (int j = 0; j < 6; ++j) {
+			pTris[j] = (uint32_t)pIdx[div[idiv][j]];
+		}
+	} else {
+		ear_clip(pPnts, pIdx, nvtx, pTris);
+	}
+}
+
+void TDGeometry::triangulate() {
+	uint32_t npol = get_poly_num();
+	uint32_t npnt = get_pnt_num();
+	std::vector<uint32_t> triOrg(npol + 1);
+	triOrg[0] = 0;
+	for (uint32_t i = 0; i < npol; ++i) {
+		const Poly& pol = mPols[i];
+		const int* pIdx = poly_pnts(i);
+		bool valid = pol.nvtx >= 3;
+		for (int j = 0; valid && j < pol.nvtx; ++j) {
+			valid = (uint32_t)pIdx[j] < npnt;
+		}
+		triOrg[i + 1] = triOrg[i] + (valid ? pol.nvtx - 2 : 0);
+	}
+
+	uint32_t ntri = triOrg[npol];
+	mTris.resize(ntri * 3);
+	mTriPols.resize(ntri);
+	TDParallel::for_each(npol, [&](uint32_t i) {
+		uint32_t n = triOrg[i + 1] - triOrg[i];
+		if (n == 0) { return; }
+		const Poly& pol = mPols[i];
+		const int* pIdx = poly_pnts(i);
+		uint32_t* pTris = &mTris[triOrg[i] * 3];
+		triangulate_poly(mPnts.data(), pIdx, pol.nvtx, pTris);
+		for (uint32_t j = 0; j < n; ++j) {
+			mTriPols[triOrg[i] + j] = i;
+		}
+	}, 1024);
+}
+
+// Houdini defaults colours to white, everything else to zero.
+static void write_attrib_decl(std::ostream& os, const TDGeometry::Attrib& attr) {
+	os << attr.name << " " << attr.size << (attr.isInt ? " int" : " float");
+	for (int i = 0; i < attr.size; ++i) {
+		os << (attr.name == "Cd" ? " 1" : " 0");
+	}
+	os << std::endl;
+}
+
+// int attributes are written from their exact values.
+static void write_attrib_val(std::ostream& os, const TDGeometry::Attrib& attr, size_t idx) {
+	if (attr.isInt) {
+		os << attr.ints[idx];
+	} else {
+		os << attr.data[idx];
+	}
 }
 
 bool TDGeometry::dump_geo(std::ostream& os) const {
@@ -183,26 +1043,59 @@ bool TDGeometry::dump_geo(std::ostream& os) const {
 	os << "PGEOMETRY V5" << endl;
 	os << "NPoints " << get_pnt_num() << " NPrims " << get_poly_num() << endl;
 	os << "NPointGroups 0 NPrimGroups 0" << endl;
-	os << "NPointAttrib 3 NVertexAttrib 0 NPrimAttrib 0 NAttrib 0" << endl;
+	os << "NPointAttrib " << 3 + mPntAttrs.size() << " NVertexAttrib 0 NPrimAttrib " << mPolAttrs.size() << " NAttrib 0" << endl;
 	os << "PointAttrib" << endl;
 	os << "N 3 vector 0 0 0" << endl;
 	os << "uv 3 float 0 0 0" << endl;
 	os << "Cd 3 float 1 1 1" << endl;
+	for (const Attrib& attr : mPntAttrs) {
+		write_attrib_decl(os, attr);
+	}
 
-	for (auto& pt : mPnts) {
+	for (uint32_t i = 0; i < get_pnt_num(); ++i) {
+		const Point& pt = mPnts[i];
 		os << pt.x << " " << pt.y << " " << pt.z << " 1";
 		os << " (";
 		os << pt.nx << " " << pt.ny << " " << pt.nz << "  ";
 		os << pt.u << " " << pt.v << " 1  ";
 		os << pt.r << " " << pt.g << " " << pt.b;
+		for (const Attrib& attr : mPntAttrs) {
+			os << " ";
+			for (int j = 0; j < attr.size; ++j) {
+				write_attrib_val(os << " ", attr, (size_t)i * attr.size + j);
+			}
+		}
 		os << ")" << endl;
 	}
 
-	os << "Run "<< get_poly_num() <<" Poly" << endl;
-	for (auto& poly : mPols) {
-		os << " " << poly.nvtx << " <";
+	if (!mPolAttrs.empty()) {
+		os << "PrimitiveAttrib" << endl;
+		for (const Attrib& attr : mPolAttrs) {
+			write_attrib_decl(os, attr);
+		}
+	}
+
+	// point clouds are written without primitives
+	if (get_poly_num() > 0) {
+		os << "Run " << get_poly_num() << " Poly" << endl;
+	}
+	for (uint32_t i = 0; i < get_poly_num(); ++i) {
+		const Poly& poly = mPols[i];
+		const int* pIdx = poly_pnts(i);
+		os << " " << poly.nvtx << (is_closed(i) ? " <" : " :");
 		for (int idx = poly.nvtx -1; idx >= 0; --idx) {
-			os << " " << poly.ipnt[idx];
+			os << " " << pIdx[idx];
+		}
+		if (!mPolAttrs.empty()) {
+			os << " [";
+			const char* pSep = "";
+			for (const Attrib& attr : mPolAttrs) {
+				for (int j = 0; j < attr.size; ++j) {
+					write_attrib_val(os << pSep, attr, (size_t)i * attr.size + j);
+					pSep = " ";
+				}
+			}
+			os << "]";
 		}
 		os << endl;
 	}
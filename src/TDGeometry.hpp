@@ -2,9 +2,13 @@
  * TouchDesigner geometry: data loading and conversion
  * Author: Gleb Novodran <novodran@gmail.com>
  */
+#pragma once
 
+#include <cstdint>
 #include <ostream>
+#include <string>
 #include <vector>
+#include "TDStream.hpp"
 
 class TDGeometry {
 public:
@@ -17,6 +21,9 @@ public:
 		float u, v;
 	};
 
+	// Polygons with more than MAX_POLY_VERTS vertices keep their full
+	// vertex count in nvtx but only the first MAX_POLY_VERTS indices in
+	// ipnt; use poly_pnts() to walk all of them.
 	struct Poly {
 		int nvtx;
 		int ipnt[MAX_POLY_VERTS];
@@ -26,19 +33,113 @@ public:
 		float min[3];
 		float max[3];
 	};
+
+	enum NormalWeight {
+		NRM_WEIGHT_AREA,
+		NRM_WEIGHT_ANGLE
+	};
+
+	enum CurveKind {
+		CURVE_MORTON,
+		CURVE_HILBERT
+	};
+
+	// Point attribute that has no place in Point (pscale, id, custom
+	// attributes...) or polygon attribute, size values per element.
+	// TD columns name(0), name(1)... make one attribute, a column without
+	// a component suffix has size 1. Loaded single value attributes (but
+	// pscale, width, Alpha) holding only whole numbers, like id, are marked
+	// isInt, their values are kept exactly in ints (data is empty) and
+	// written to .geo as int; columns without a single number (TD string
+	// attributes) are not loaded.
+	struct Attrib {
+		std::string name;
+		int size;
+		bool isInt;
+		std::vector<float> data;
+		std::vector<int32_t> ints;
+	};
+
+	// Row by row readers of the TD tables, load() is built on them; tools
+	// that can't hold a whole table in memory use them directly. A missing
+	// table is looked for compressed (.gz, .zst), see TDInStream.
+	class PntReader {
+		TDInStream mIs;
+		std::string mRow;
+		std::vector<int> mColumnMap;
+		size_t mColumnNum; // columns up to the last one read
+		std::vector<Attrib> mExtras;
+		int mExtraSize;
+		std::vector<uint8_t> mExtraRead; // per extra value, a number was read
+		bool mHasNrm;
+	public:
+		PntReader() : mColumnNum(0), mExtraSize(0), mHasNrm(false) {}
+		// Only the attributes named in attrs are read (P always is), the
+		// other columns are skipped without number conversion; empty
+		// attrs reads everything.
+		bool open(const std::string& path, const std::vector<std::string>& attrs = std::vector<std::string>());
+		bool has_normals() const { return mHasNrm; }
+		// Layout of the values next() writes to pExtra, data is left empty.
+		const std::vector<Attrib>& extra_attribs() const { return mExtras; }
+		int get_extra_size() const { return mExtraSize; }
+		// Whether a number was read so far for any component of extra
+		// attribute idx, text columns never have one.
+		bool is_numeric(size_t idx) const;
+		// pExtra receives get_extra_size() values, or nullptr to ignore them;
+		// fields that are not numbers read as 0. Doubles keep integer
+		// attributes exact.
+		bool next(Point& pnt, double* pExtra = nullptr);
+	};
+
+	class PolReader {
+		TDInStream mIs;
+		std::string mRow;
+		std::vector<int> mColumnMap;
+		size_t mColumnNum;
+		std::vector<Attrib> mExtras;
+		int mExtraSize;
+		std::vector<uint8_t> mExtraRead;
+		bool mHasClose;
+	public:
+		PolReader() : mColumnNum(0), mExtraSize(0), mHasClose(false) {}
+		// Fails on a table without a vertices column.
+		bool open(const std::string& path);
+		// Every column but index, vertices and close.
+		const std::vector<Attrib>& extra_attribs() const { return mExtras; }
+		int get_extra_size() const { return mExtraSize; }
+		bool has_close() const { return mHasClose; }
+		bool is_numeric(size_t idx) const;
+		// Point indices of the next polygon, its attribute values
+		// (get_extra_size() of them) and close flag.
+		bool next(std::vector<int>& pnts, double* pExtra = nullptr, bool* pClosed = nullptr);
+	};
+
 protected:
 	std::vector<Point> mPnts;
+	std::vector<Attrib> mPntAttrs;
+	std::vector<std::string> mLoadAttrs;
 	std::vector<Poly> mPols;
+	std::vector<Attrib> mPolAttrs;
+	std::vector<uint8_t> mPolClosed; // empty when the table has no close column
+	std::vector<uint32_t> mNgonPols; // sorted indices of polygons above MAX_POLY_VERTS
+	std::vector<uint32_t> mNgonOrg;  // their offsets into mNgonPnts
+	std::vector<int> mNgonPnts;
+	std::vector<uint32_t> mTris;     // triangulation cache, 3 point indices per triangle
+	std::vector<uint32_t> mTriPols;  // source polygon of every triangle
 	BBox mBbox;
+	bool mHasNrm;
+	bool mAutoNrm;
 
 	bool load_pnts(const std::string& pntsPath);
 	bool load_pols(const std::string& polsPath);
+	void calc_bbox();
 public:
 	TDGeometry();
 
 	std::uint32_t get_pnt_num() const { return (uint32_t)mPnts.size(); }
 	std::uint32_t get_poly_num() const { return (uint32_t)mPols.size(); }
 	BBox bbox() const { return mBbox; }
+	bool has_normals() const { return mHasNrm; }
 
 	Point get_pnt(uint32_t idx) const {
 		Point pnt = {};
@@ -56,15 +157,66 @@ public:
 		return poly;
 	}
 
+	// Point indices of polygon idx, get_poly(idx).nvtx of them.
+	const int* poly_pnts(uint32_t idx) const;
+
 	const std::vector<Point>& pnts() const { return mPnts; }
+	// Point attributes loaded besides the Point fields.
+	const std::vector<Attrib>& pnt_attribs() const { return mPntAttrs; }
+	const Attrib* find_pnt_attrib(const std::string& name) const;
+	// Polygon attributes from the pol.txt columns (per-primitive Cd,
+	// material ids...).
+	const std::vector<Attrib>& pol_attribs() const { return mPolAttrs; }
+	const Attrib* find_pol_attrib(const std::string& name) const;
+	// Polygons without a close flag in the table count as closed.
+	bool is_closed(uint32_t idx) const { return idx >= mPolClosed.size() || mPolClosed[idx] != 0; }
 	const std::vector<Poly>& pols() const { return mPols; }
 
+	// Triangulation of all polygons, rebuilt on every load/assign.
+	// Quads are split along the diagonal keeping both halves facing the
+	// same way, larger polygons are ear-clipped.
+	std::uint32_t get_tri_num() const { return (uint32_t)(mTris.size() / 3); }
+	const std::vector<uint32_t>& tris() const { return mTris; }
+	const std::vector<uint32_t>& tri_pols() const { return mTriPols; }
+	void triangulate();
+	// Triangulates one polygon the same way, writing nvtx - 2 triangles of
+	// indices taken from pIdx; pPnts is indexed by them.
+	static void triangulate_poly(const Point* pPnts, const int* pIdx, int nvtx, uint32_t* pTris);
+
+	// Restricts the following loads to the named point attributes (P, N,
+	// Cd, uv or any other TD attribute name; P is always loaded), empty
+	// for all of them.
+	void set_load_attribs(const std::vector<std::string>& attrs) { mLoadAttrs = attrs; }
+	// A missing polygons table loads a point cloud, points without polygons.
 	bool load(const std::string& folder);
 	bool load(const std::string& pntsPath, const std::string& polsPath);
 	void unload();
+	// Takes over the contents of pnts and pols (they are swapped out),
+	// polygons are limited to MAX_POLY_VERTS vertices. Extra point and
+	// polygon attributes and close flags are dropped.
+	void assign(std::vector<Point>& pnts, std::vector<Poly>& pols, bool hasNrm = true);
+	// Same, keeping polygons above MAX_POLY_VERTS whole: ngonPnts holds
+	// all the indices of each of them, back to back in polygon order.
+	void assign(std::vector<Point>& pnts, std::vector<Poly>& pols, std::vector<int>& ngonPnts, bool hasNrm = true);
+
+	// Normals are generated on load when the points table has no N columns,
+	// unless disabled here; calc_normals() can also be called at any time.
+	void set_auto_normals(bool enable) { mAutoNrm = enable; }
+	void calc_normals(NormalWeight weight = NRM_WEIGHT_ANGLE);
+
+	// Sorts points and polygons along a space-filling curve over the bbox
+	// and remaps polygon indices to match. The optional permutations map
+	// new indices to the original TD row indices: pntOrder[newIdx] = oldIdx.
+	void reorder(CurveKind kind, std::vector<uint32_t>* pPntOrder = nullptr, std::vector<uint32_t>* pPolOrder = nullptr);
+	// Sorts the triangles (and tri_pols) in place along a Morton curve over
+	// a 32^3 grid of their centroids, so runs of consecutive triangles are
+	// spatially compact; polygons and points keep their order. Needs no
+	// memory beyond the grid cell counts.
+	void sort_tris();
+
 	bool dump_geo(std::ostream& os) const;
 
-	friend std::ostream& operator << (std::ostream& os, TDGeometry& geo) {
+	friend std::ostream& operator << (std::ostream& os, const TDGeometry& geo) {
 		geo.dump_geo(os);
 		return os;
 	}
@@ -0,0 +1,96 @@
+/*
+ * TouchDesigner geometry: simple data-parallel helpers
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace TDParallel {
+	// Workers the calling thread may use, 0 for the whole machine. Slices
+	// of for_slices get their share of the caller's workers, so nested
+	// passes don't spawn a full set of threads each.
+	inline uint32_t& thread_budget() {
+		static thread_local uint32_t budget = 0;
+		return budget;
+	}
+
+	inline uint32_t num_workers() {
+		uint32_t budget = thread_budget();
+		if (budget > 0) { return budget; }
+		uint32_t n = std::thread::hardware_concurrency();
+		return n > 0 ? n : 1;
+	}
+
+	// Sets the calling thread's budget while in scope, for threads that
+	// don't come from for_slices.
+	class WorkerBudget {
+		uint32_t mPrev;
+	public:
+		explicit WorkerBudget(uint32_t budget) : mPrev(thread_budget()) {
+			thread_budget() = budget > 0 ? budget : 1;
+		}
+		~WorkerBudget() { thread_budget() = mPrev; }
+	};
+
+	// Number of slices to split count items into, each at least grain items long.
+	inline uint32_t num_slices(uint32_t count, uint32_t grain = 4096) {
+		if (grain == 0) { grain = 1; }
+		uint32_t n = (count + grain - 1) / grain;
+		uint32_t nwk = num_workers();
+		if (n > nwk) { n = nwk; }
+		return n > 0 ? n : 1;
+	}
+
+	// Calls func(org, end, islice) for nslices contiguous slices of [0, count).
+	// Slice boundaries only depend on count and nslices, so two calls with
+	// the same arguments see identical partitions.
+	template <typename FUNC>
+	void for_slices(uint32_t count, uint32_t nslices, const FUNC& func) {
+		if (count == 0) { return; }
+		if (nslices < 1) { nslices = 1; }
+		if (nslices > count) { nslices = count; }
+		uint64_t step = count / nslices;
+		uint64_t rem = count % nslices;
+		uint32_t share = num_workers() / nslices;
+		auto run = [&func, share](uint32_t org, uint32_t end, uint32_t islice) {
+			WorkerBudget budget(share);
+			func(org, end, islice);
+		};
+		std::vector<std::thread> workers;
+		workers.reserve(nslices - 1);
+		uint32_t org0 = 0, end0 = 0;
+		uint64_t org = 0;
+		for (uint32_t i = 0; i < nslices; ++i) {
+			uint64_t end = org + step + (i < rem ? 1 : 0);
+			if (i == 0) {
+				org0 = (uint32_t)org;
+				end0 = (uint32_t)end;
+			} else {
+				workers.emplace_back(run, (uint32_t)org, (uint32_t)end, i);
+			}
+			org = end;
+		}
+		run(org0, end0, 0u);
+		for (auto& wk : workers) {
+			wk.join();
+		}
+	}
+
+	template <typename FUNC>
+	void for_range(uint32_t count, const FUNC& func, uint32_t grain = 4096) {
+		for_slices(count, num_slices(count, grain), func);
+	}
+
+	// Calls func(i) for every i in [0, count).
+	template <typename FUNC>
+	void for_each(uint32_t count, const FUNC& func, uint32_t grain = 4096) {
+		for_range(count, [&func](uint32_t org, uint32_t end, uint32_t) {
+			for (uint32_t i = org; i < end; ++i) {
+				func(i);
+			}
+		}, grain);
+	}
+}
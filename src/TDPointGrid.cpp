@@ -0,0 +1,281 @@
+/*
+ * TouchDesigner geometry: uniform grid point index for neighbour lookups
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#include "TDPointGrid.hpp"
+#include "TDParallel.hpp"
+#include "TDRadixSort.hpp"
+#include <algorithm>
+#include <cmath>
+
+static const int MAX_GRID_DIM = 1024;
+static const uint32_t MAX_GRID_CELLS = 1 << 26;
+
+static bool nbr_less(const TDPointGrid::Neighbor& a, const TDPointGrid::Neighbor& b) {
+	return a.dist2 < b.dist2;
+}
+
+TDPointGrid::TDPointGrid() {
+	reset();
+}
+
+void TDPointGrid::reset() {
+	for (int i = 0; i < 3; ++i) {
+		mOrg[i] = 0.0f;
+		mDim[i] = 0;
+	}
+	mCellSize = 0.0f;
+	mInvCellSize = 0.0f;
+	std::vector<uint32_t>().swap(mCellOrg);
+	std::vector<uint32_t>().swap(mIdx);
+	std::vector<float>().swap(mPos);
+}
+
+bool TDPointGrid::build(const TDGeometry& geo, float cellSize) {
+	const std::vector<TDGeometry::Point>& pnts = geo.pnts();
+	uint32_t num = (uint32_t)pnts.size();
+	std::vector<float> pos(num * 3);
+	TDParallel::for_each(num, [&](uint32_t i) {
+		pos[i * 3 + 0] = pnts[i].x;
+		pos[i * 3 + 1] = pnts[i].y;
+		pos[i * 3 + 2] = pnts[i].z;
+	});
+	return build(pos.data(), num, cellSize);
+}
+
+bool TDPointGrid::build(const float* pPos, uint32_t num, float cellSize) {
+	reset();
+	if (pPos == nullptr || num == 0) { return false; }
+
+	// per-slice extents, reduced below
+	uint32_t nslices = TDParallel::num_slices(num, 1 << 16);
+	std::vector<float> sliceMin(nslices * 3);
+	std::vector<float> sliceMax(nslices * 3);
+	TDParallel::for_slices(num, nslices, [&](uint32_t org, uint32_t end, uint32_t islice) {
+		float* pMin = &sliceMin[islice * 3];
+		float* pMax = &sliceMax[islice * 3];
+		for (int j = 0; j < 3; ++j) {
+			pMin[j] = pMax[j] = pPos[org * 3 + j];
+		}
+		for (uint32_t i = org + 1; i < end; ++i) {
+			for (int j = 0; j < 3; ++j) {
+				pMin[j] = std::fminf(pMin[j], pPos[i * 3 + j]);
+				pMax[j] = std::fmaxf(pMax[j], pPos[i * 3 + j]);
+			}
+		}
+	});
+	float vmin[3] = { sliceMin[0], sliceMin[1], sliceMin[2] };
+	float vmax[3] = { sliceMax[0], sliceMax[1], sliceMax[2] };
+	for (uint32_t s = 1; s < nslices; ++s) {
+		for (int j = 0; j < 3; ++j) {
+			vmin[j] = std::fminf(vmin[j], sliceMin[s * 3 + j]);
+			vmax[j] = std::fmaxf(vmax[j], sliceMax[s * 3 + j]);
+		}
+	}
+
+	float ext[3];
+	float maxExt = 0.0f;
+	for (int i = 0; i < 3; ++i) {
+		ext[i] = vmax[i] - vmin[i];
+		maxExt = std::fmaxf(maxExt, ext[i]);
+	}
+	if (maxExt <= 0.0f) { maxExt = 1.0f; }
+
+	if (cellSize <= 0.0f) {
+		// Pick a cell size giving about DEFAULT_PNTS_PER_CELL points per cell,
+		// ignoring flat dimensions so planar scans don't end up in one cell.
+		double vol = 1.0;
+		int ndim = 0;
+		for (int i = 0; i < 3; ++i) {
+			if (ext[i] > maxExt * 1e-4f) {
+				vol *= ext[i];
+				++ndim;
+			}
+		}
+		double ncells = std::max(1.0, (double)num / DEFAULT_PNTS_PER_CELL);
+		cellSize = (float)std::pow(vol / ncells, 1.0 / std::max(ndim, 1));
+	}
+	cellSize = std::fmaxf(cellSize, maxExt / MAX_GRID_DIM);
+
+	do {
+		mCellSize = cellSize;
+		mInvCellSize = 1.0f / cellSize;
+		for (int i = 0; i < 3; ++i) {
+			mOrg[i] = vmin[i];
+			mDim[i] = std::min(MAX_GRID_DIM, std::max(1, (int)(ext[i] * mInvCellSize) + 1));
+		}
+		cellSize *= 1.25f;
+	} while (get_cell_num() > MAX_GRID_CELLS);
+
+	std::vector<uint32_t> keys(num);
+	std::vector<uint32_t> vals(num);
+	TDParallel::for_each(num, [&](uint32_t i) {
+		int cc[3];
+		cell_coord(&pPos[i * 3], cc);
+		keys[i] = cell_id(cc[0], cc[1], cc[2]);
+		vals[i] = i;
+	});
+
+	uint32_t ncells = get_cell_num();
+	int keyBits = 0;
+	while (keyBits < 32 && (ncells >> keyBits) != 0) { ++keyBits; }
+	TDRadixSort::sort_pairs(keys, vals, keyBits);
+
+	mCellOrg.resize(ncells + 1);
+	mIdx.swap(vals);
+	mPos.resize(num * 3);
+	TDParallel::for_each(num, [&](uint32_t i) {
+		uint32_t src = mIdx[i];
+		mPos[i * 3 + 0] = pPos[src * 3 + 0];
+		mPos[i * 3 + 1] = pPos[src * 3 + 1];
+		mPos[i * 3 + 2] = pPos[src * 3 + 2];
+		// the first point of each run of keys opens its cell and all empty cells before it
+		if (i == 0 || keys[i] != keys[i - 1]) {
+			uint32_t c0 = i > 0 ? keys[i - 1] + 1 : 0;
+			for (uint32_t c = c0; c <= keys[i]; ++c) {
+				mCellOrg[c] = i;
+			}
+		}
+	});
+	for (uint32_t c = keys[num - 1] + 1; c <= ncells; ++c) {
+		mCellOrg[c] = num;
+	}
+	return true;
+}
+
+void TDPointGrid::cell_coord(const float pos[3], int cc[3]) const {
+	for (int i = 0; i < 3; ++i) {
+		int c = (int)std::floor((pos[i] - mOrg[i]) * mInvCellSize);
+		cc[i] = std::min(std::max(c, 0), mDim[i] - 1);
+	}
+}
+
+// Keeps the k best candidates in a max-heap ordered by distance.
+void TDPointGrid::scan_cell(uint32_t cid, const float pos[3], uint32_t k, Neighbor* pHeap, uint32_t& num) const {
+	uint32_t org = mCellOrg[cid];
+	uint32_t end = mCellOrg[cid + 1];
+	for (uint32_t i = org; i < end; ++i) {
+		const float* p = &mPos[i * 3];
+		float dx = p[0] - pos[0];
+		float dy = p[1] - pos[1];
+		float dz = p[2] - pos[2];
+		float d2 = dx * dx + dy * dy + dz * dz;
+		if (num < k) {
+			pHeap[num].idx = mIdx[i];
+			pHeap[num].dist2 = d2;
+			++num;
+			std::push_heap(pHeap, pHeap + num, nbr_less);
+		} else if (d2 < pHeap[0].dist2) {
+			std::pop_heap(pHeap, pHeap + num, nbr_less);
+			pHeap[num - 1].idx = mIdx[i];
+			pHeap[num - 1].dist2 = d2;
+			std::push_heap(pHeap, pHeap + num, nbr_less);
+		}
+	}
+}
+
+uint32_t TDPointGrid::knn(const float pos[3], uint32_t k, Neighbor* pRes) const {
+	if (k == 0 || pRes == nullptr || mIdx.empty()) { return 0; }
+	int cc[3];
+	cell_coord(pos, cc);
+	int maxRing = std::max(std::max(mDim[0], mDim[1]), mDim[2]);
+	uint32_t num = 0;
+	for (int ring = 0; ring < maxRing; ++ring) {
+		int z0 = std::max(cc[2] - ring, 0), z1 = std::min(cc[2] + ring, mDim[2] - 1);
+		int y0 = std::max(cc[1] - ring, 0), y1 = std::min(cc[1] + ring, mDim[1] - 1);
+		int x0 = std::max(cc[0] - ring, 0), x1 = std::min(cc[0] + ring, mDim[0] - 1);
+		for (int iz = z0; iz <= z1; ++iz) {
+			bool zEdge = iz == cc[2] - ring || iz == cc[2] + ring;
+			for (int iy = y0; iy <= y1; ++iy) {
+				bool yEdge = zEdge || iy == cc[1] - ring || iy == cc[1] + ring;
+				if (yEdge) {
+					for (int ix = x0; ix <= x1; ++ix) {
+						scan_cell(cell_id(ix, iy, iz), pos, k, pRes, num);
+					}
+				} else {
+					// only the two shell cells of this row
+					if (cc[0] - ring >= 0) {
+						scan_cell(cell_id(cc[0] - ring, iy, iz), pos, k, pRes, num);
+					}
+					if (ring > 0 && cc[0] + ring < mDim[0]) {
+						scan_cell(cell_id(cc[0] + ring, iy, iz), pos, k, pRes, num);
+					}
+				}
+			}
+		}
+		// anything in the next rings is at least ring * cellSize away
+		if (num == k) {
+			float bound = ring * mCellSize;
+			if (pRes[0].dist2 <= bound * bound) { break; }
+		}
+	}
+	std::sort_heap(pRes, pRes + num, nbr_less);
+	return num;
+}
+
+uint32_t TDPointGrid::radius(const float pos[3], float r, std::vector<Neighbor>& res) const {
+	res.clear();
+	if (mIdx.empty() || r < 0.0f) { return 0; }
+	float r2 = r * r;
+	int c0[3];
+	int c1[3];
+	float lo[3] = { pos[0] - r, pos[1] - r, pos[2] - r };
+	float hi[3] = { pos[0] + r, pos[1] + r, pos[2] + r };
+	for (int i = 0; i < 3; ++i) {
+		if (hi[i] < mOrg[i] || lo[i] > mOrg[i] + mDim[i] * mCellSize) { return 0; }
+	}
+	cell_coord(lo, c0);
+	cell_coord(hi, c1);
+	for (int iz = c0[2]; iz <= c1[2]; ++iz) {
+		for (int iy = c0[1]; iy <= c1[1]; ++iy) {
+			// cells along x are adjacent in memory, scan the whole row at once
+			uint32_t org = mCellOrg[cell_id(c0[0], iy, iz)];
+			uint32_t end = mCellOrg[cell_id(c1[0], iy, iz) + 1];
+			for (uint32_t i = org; i < end; ++i) {
+				const float* p = &mPos[i * 3];
+				float dx = p[0] - pos[0];
+				float dy = p[1] - pos[1];
+				float dz = p[2] - pos[2];
+				float d2 = dx * dx + dy * dy + dz * dz;
+				if (d2 <= r2) {
+					Neighbor nbr = { mIdx[i], d2 };
+					res.push_back(nbr);
+				}
+			}
+		}
+	}
+	return (uint32_t)res.size();
+}
+
+void TDPointGrid::knn_batch(const float* pPos, uint32_t num, uint32_t k, Neighbor* pRes, uint32_t* pNum) const {
+	if (pPos == nullptr || pRes == nullptr || pNum == nullptr) { return; }
+	TDParallel::for_each(num, [&](uint32_t i) {
+		pNum[i] = knn(&pPos[i * 3], k, &pRes[(size_t)i * k]);
+	}, 256);
+}
+
+void TDPointGrid::radius_batch(const float* pPos, uint32_t num, float r, std::vector<uint32_t>& org, std::vector<Neighbor>& res) const {
+	org.assign(num + 1, 0);
+	res.clear();
+	if (pPos == nullptr || num == 0) { return; }
+
+	uint32_t nslices = TDParallel::num_slices(num, 256);
+	std::vector<std::vector<Neighbor> > sliceRes(nslices);
+	TDParallel::for_slices(num, nslices, [&](uint32_t qorg, uint32_t qend, uint32_t islice) {
+		std::vector<Neighbor>& dst = sliceRes[islice];
+		std::vector<Neighbor> tmp;
+		for (uint32_t i = qorg; i < qend; ++i) {
+			radius(&pPos[i * 3], r, tmp);
+			org[i + 1] = (uint32_t)tmp.size();
+			dst.insert(dst.end(), tmp.begin(), tmp.end());
+		}
+	});
+
+	for (uint32_t i = 0; i < num; ++i) {
+		org[i + 1] += org[i];
+	}
+	res.reserve(org[num]);
+	for (auto& sres : sliceRes) {
+		res.insert(res.end(), sres.begin(), sres.end());
+	}
+}
@@ -0,0 +1,57 @@
+/*
+ * TouchDesigner geometry: uniform grid point index for neighbour lookups
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "TDGeometry.hpp"
+
+// Points are bucketed into a uniform grid covering the geometry bbox.
+// Cells are stored CSR-style: mCellOrg[c]..mCellOrg[c+1] index into
+// flat arrays of point indices and positions sorted by cell, so a query
+// walks contiguous memory instead of chasing per-cell lists.
+class TDPointGrid {
+public:
+	enum { DEFAULT_PNTS_PER_CELL = 4 };
+
+	struct Neighbor {
+		uint32_t idx;
+		float dist2;
+	};
+
+protected:
+	float mOrg[3];
+	float mCellSize;
+	float mInvCellSize;
+	int mDim[3];
+	std::vector<uint32_t> mCellOrg;
+	std::vector<uint32_t> mIdx;
+	std::vector<float> mPos;
+
+	uint32_t cell_id(int ix, int iy, int iz) const { return (uint32_t)((iz * mDim[1] + iy) * mDim[0] + ix); }
+	void cell_coord(const float pos[3], int cc[3]) const;
+	void scan_cell(uint32_t cid, const float pos[3], uint32_t k, Neighbor* pHeap, uint32_t& num) const;
+public:
+	TDPointGrid();
+
+	bool build(const TDGeometry& geo, float cellSize = 0.0f);
+	bool build(const float* pPos, uint32_t num, float cellSize = 0.0f);
+	void reset();
+
+	uint32_t get_pnt_num() const { return (uint32_t)mIdx.size(); }
+	uint32_t get_cell_num() const { return (uint32_t)mDim[0] * mDim[1] * mDim[2]; }
+	float cell_size() const { return mCellSize; }
+
+	// Up to k nearest points, sorted by distance; returns the number found.
+	uint32_t knn(const float pos[3], uint32_t k, Neighbor* pRes) const;
+	// All points within radius r; the result is not sorted.
+	uint32_t radius(const float pos[3], float r, std::vector<Neighbor>& res) const;
+
+	// Batched queries run across worker threads.
+	// knn_batch writes k slots per query into pRes and the found count into pNum.
+	void knn_batch(const float* pPos, uint32_t num, uint32_t k, Neighbor* pRes, uint32_t* pNum) const;
+	// radius_batch returns CSR results: query i owns res[org[i]..org[i+1]).
+	void radius_batch(const float* pPos, uint32_t num, float r, std::vector<uint32_t>& org, std::vector<Neighbor>& res) const;
+};
@@ -0,0 +1,76 @@
+/*
+ * TouchDesigner geometry: parallel LSD radix sort of key/value pairs
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "TDParallel.hpp"
+
+namespace TDRadixSort {
+	// Stable sort of (keys[i], vals[i]) pairs by the low keyBits bits of the key.
+	// Each 8-bit pass builds per-slice histograms in parallel and scatters
+	// every slice into its own precomputed output ranges, so no atomics are needed.
+	template <typename KEY>
+	void sort_pairs(std::vector<KEY>& keys, std::vector<uint32_t>& vals, int keyBits = (int)sizeof(KEY) * 8) {
+		const uint32_t RADIX = 256;
+		uint32_t n = (uint32_t)keys.size();
+		if (n < 2 || vals.size() != keys.size()) { return; }
+
+		std::vector<KEY> tmpKeys(n);
+		std::vector<uint32_t> tmpVals(n);
+		uint32_t nslices = TDParallel::num_slices(n, 1 << 16);
+		std::vector<uint32_t> hist(nslices * RADIX);
+
+		KEY* pSrcK = keys.data();
+		uint32_t* pSrcV = vals.data();
+		KEY* pDstK = tmpKeys.data();
+		uint32_t* pDstV = tmpVals.data();
+		for (int shift = 0; shift < keyBits; shift += 8) {
+			TDParallel::for_slices(n, nslices, [&](uint32_t org, uint32_t end, uint32_t islice) {
+				uint32_t* pHist = &hist[islice * RADIX];
+				for (uint32_t d = 0; d < RADIX; ++d) { pHist[d] = 0; }
+				for (uint32_t i = org; i < end; ++i) {
+					++pHist[(pSrcK[i] >> shift) & 0xFF];
+				}
+			});
+
+			bool skip = false;
+			uint32_t sum = 0;
+			for (uint32_t d = 0; d < RADIX; ++d) {
+				uint32_t cnt = 0;
+				for (uint32_t s = 0; s < nslices; ++s) {
+					cnt += hist[s * RADIX + d];
+				}
+				if (cnt == n) {
+					skip = true; // all keys share this digit
+					break;
+				}
+				for (uint32_t s = 0; s < nslices; ++s) {
+					uint32_t c = hist[s * RADIX + d];
+					hist[s * RADIX + d] = sum;
+					sum += c;
+				}
+			}
+			if (skip) { continue; }
+
+			TDParallel::for_slices(n, nslices, [&](uint32_t org, uint32_t end, uint32_t islice) {
+				uint32_t* pOffs = &hist[islice * RADIX];
+				for (uint32_t i = org; i < end; ++i) {
+					uint32_t dst = pOffs[(pSrcK[i] >> shift) & 0xFF]++;
+					pDstK[dst] = pSrcK[i];
+					pDstV[dst] = pSrcV[i];
+				}
+			});
+			std::swap(pSrcK, pDstK);
+			std::swap(pSrcV, pDstV);
+		}
+
+		if (pSrcK != keys.data()) {
+			keys.swap(tmpKeys);
+			vals.swap(tmpVals);
+		}
+	}
+}
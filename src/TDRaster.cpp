@@ -0,0 +1,478 @@
+/*
+ * TouchDesigner geometry: multi-threaded software rasterizer for thumbnails
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#include "TDRaster.hpp"
+#include "TDParallel.hpp"
+#include "TDSimd.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cctype>
+#include <fstream>
+#include <memory>
+#ifdef TD_USE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace TDSimd;
+
+static const int TILE_SIZE = 64; // multiple of 4, edge functions run 4 pixels wide
+static const uint32_t NO_TRI = 0xFFFFFFFFu;
+
+TDRaster::Light::Light() : roughness(0.45f), gamma(2.2f) {
+	hemiSky[0] = 2.14318f * 0.5f; hemiSky[1] = 1.971372f * 0.5f; hemiSky[2] = 1.862601f * 0.5f;
+	hemiGround[0] = 0.15f * 0.5f; hemiGround[1] = 0.1f * 0.5f; hemiGround[2] = 0.075f * 0.5f;
+	hemiUp[0] = 0.0f; hemiUp[1] = 1.0f; hemiUp[2] = 0.0f;
+	specDir[0] = 0.0f; specDir[1] = 0.0f; specDir[2] = 0.0f;
+	specClr[0] = 0.5f; specClr[1] = 0.45f; specClr[2] = 0.25f;
+}
+
+// Screen-space vertex, in samples with rows going down.
+struct RVtx {
+	float sx;
+	float sy;
+	float iw; // 1 / view depth, 0 behind the near plane
+};
+
+struct Camera {
+	float eye[3];
+	float tgt[3];
+	float fwd[3];
+	float side[3];
+	float up[3];
+	float kx;
+	float ky;
+	float znear;
+};
+
+struct Shading {
+	V4 sky;
+	V4 ground;
+	V4 up;
+	V4 lightDir; // towards the light
+	V4 specClr;
+	V4 eye;
+	float specPow;
+	float invGamma;
+};
+
+// Per-worker tile buffers: nearest depth, triangle and its screen-space
+// barycentrics for every sample, shaded once after all triangles are in.
+struct TileBuf {
+	float depth[TILE_SIZE * TILE_SIZE];
+	uint32_t tri[TILE_SIZE * TILE_SIZE];
+	float b1[TILE_SIZE * TILE_SIZE];
+	float b2[TILE_SIZE * TILE_SIZE];
+};
+
+static inline float dot3f(const float* a, const float* b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline void normalize3f(float* v) {
+	float len = std::sqrt(dot3f(v, v));
+	if (len > 0.0f) {
+		v[0] /= len; v[1] /= len; v[2] /= len;
+	}
+}
+
+static inline V4 clamp01(V4 v) {
+	return min(max(v, zero()), splat(1.0f));
+}
+
+static inline V4 normalize3(V4 v) {
+	float len = length3(v);
+	return len > 0.0f ? scale(v, 1.0f / len) : v;
+}
+
+static void init_camera(const TDGeometry::BBox& bbox, float fovY, float aspect, Camera& cam) {
+	float c[3], size[3];
+	for (int i = 0; i < 3; ++i) {
+		c[i] = (bbox.min[i] + bbox.max[i]) * 0.5f;
+		size[i] = bbox.max[i] - bbox.min[i];
+	}
+	float ext = std::max(std::max(size[0], size[1]), size[2]);
+	if (!(ext > 0.0f)) { ext = 1.0f; }
+	float dist = ext * 1.75f;
+	cam.eye[0] = c[0];
+	cam.eye[1] = c[1] + size[1] * 0.2f;
+	cam.eye[2] = c[2] + dist;
+	for (int i = 0; i < 3; ++i) {
+		cam.tgt[i] = c[i];
+		cam.fwd[i] = c[i] - cam.eye[i];
+	}
+	normalize3f(cam.fwd);
+	// side = fwd x (0, 1, 0), up = side x fwd
+	cam.side[0] = -cam.fwd[2];
+	cam.side[1] = 0.0f;
+	cam.side[2] = cam.fwd[0];
+	normalize3f(cam.side);
+	cam.up[0] = cam.side[1] * cam.fwd[2] - cam.side[2] * cam.fwd[1];
+	cam.up[1] = cam.side[2] * cam.fwd[0] - cam.side[0] * cam.fwd[2];
+	cam.up[2] = cam.side[0] * cam.fwd[1] - cam.side[1] * cam.fwd[0];
+	float t = std::tan(fovY * 0.5f * 3.14159265f / 180.0f);
+	cam.ky = 1.0f / t;
+	cam.kx = cam.ky / aspect;
+	cam.znear = dist * 1e-3f;
+}
+
+static void init_shading(const TDRaster::Light& light, const Camera& cam, Shading& sh) {
+	sh.sky = load3(light.hemiSky);
+	sh.ground = load3(light.hemiGround);
+	sh.up = normalize3(load3(light.hemiUp));
+	V4 specDir = load3(light.specDir);
+	if (dot3(specDir, specDir) == 0.0f) {
+		// from 1 unit above the camera towards the target
+		specDir = sub(load3(cam.tgt), add(load3(cam.eye), set(0.0f, 1.0f, 0.0f)));
+	}
+	sh.lightDir = scale(normalize3(specDir), -1.0f);
+	sh.specClr = load3(light.specClr);
+	sh.eye = load3(cam.eye);
+	float rr = light.roughness * light.roughness;
+	sh.specPow = std::max(0.001f, 2.0f / rr - 2.0f);
+	sh.invGamma = light.gamma > 0.0f ? 1.0f / light.gamma : 1.0f;
+}
+
+// Edge functions are evaluated for 4 horizontally adjacent sample centres at
+// once; a sample is covered when all three are non-negative, which is one
+// sign-mask test on their bitwise OR. Coordinates are tile-local.
+static void raster_tri(const RVtx& v0, const RVtx& v1, const RVtx& v2, uint32_t itri, int ox, int oy, int tw, int th, TileBuf& buf) {
+	float x0 = v0.sx - ox, y0 = v0.sy - oy;
+	float x1 = v1.sx - ox, y1 = v1.sy - oy;
+	float x2 = v2.sx - ox, y2 = v2.sy - oy;
+	// edge i is opposite vertex i
+	float a0 = y1 - y2, b0 = x2 - x1, c0 = x1 * y2 - x2 * y1;
+	float a1 = y2 - y0, b1 = x0 - x2, c1 = x2 * y0 - x0 * y2;
+	float a2 = y0 - y1, b2 = x1 - x0, c2 = x0 * y1 - x1 * y0;
+	float area = c0 + c1 + c2;
+	if (area == 0.0f) { return; }
+	if (area < 0.0f) {
+		a0 = -a0; b0 = -b0; c0 = -c0;
+		a1 = -a1; b1 = -b1; c1 = -c1;
+		a2 = -a2; b2 = -b2; c2 = -c2;
+		area = -area;
+	}
+	int px0 = std::max(0, (int)std::floor(std::min(std::min(x0, x1), x2)));
+	int py0 = std::max(0, (int)std::floor(std::min(std::min(y0, y1), y2)));
+	int px1 = std::min(tw - 1, (int)std::ceil(std::max(std::max(x0, x1), x2)));
+	int py1 = std::min(th - 1, (int)std::ceil(std::max(std::max(y0, y1), y2)));
+	if (px0 > px1 || py0 > py1) { return; }
+	px0 &= ~3;
+
+	float inv = 1.0f / area;
+	// 1/w is linear in screen space: z = sum(e_i * iw_i) / area
+	V4 zw0 = splat(v0.iw * inv);
+	V4 zw1 = splat(v1.iw * inv);
+	V4 zw2 = splat(v2.iw * inv);
+	V4 offs = set(0.5f, 1.5f, 2.5f, 3.5f);
+	V4 cx = add(splat((float)px0), offs);
+	V4 step0 = splat(a0 * 4.0f);
+	V4 step1 = splat(a1 * 4.0f);
+	V4 step2 = splat(a2 * 4.0f);
+	for (int py = py0; py <= py1; ++py) {
+		float cy = (float)py + 0.5f;
+		V4 e0 = add(mul(splat(a0), cx), splat(b0 * cy + c0));
+		V4 e1 = add(mul(splat(a1), cx), splat(b1 * cy + c1));
+		V4 e2 = add(mul(splat(a2), cx), splat(b2 * cy + c2));
+		for (int px = px0; px <= px1; px += 4) {
+			int outside = sign_mask(bit_or(e0, bit_or(e1, e2)));
+			if (outside != 0xF) {
+				V4 z = add(add(mul(e0, zw0), mul(e1, zw1)), mul(e2, zw2));
+				int idx = py * TILE_SIZE + px;
+				int behind = sign_mask(sub(z, load4(&buf.depth[idx])));
+				int hit = ~(outside | behind) & 0xF;
+				if (hit) {
+					float zs[4], e1s[4], e2s[4];
+					store4(zs, z);
+					store4(e1s, e1);
+					store4(e2s, e2);
+					for (int k = 0; k < 4; ++k) {
+						if (hit & (1 << k)) {
+							buf.depth[idx + k] = zs[k];
+							buf.tri[idx + k] = itri;
+							buf.b1[idx + k] = e1s[k] * inv;
+							buf.b2[idx + k] = e2s[k] * inv;
+						}
+					}
+				}
+			}
+			e0 = add(e0, step0);
+			e1 = add(e1, step1);
+			e2 = add(e2, step2);
+		}
+	}
+}
+
+static void shade_tile(const TDGeometry& geo, const std::vector<RVtx>& vtx, const Shading& sh, const float* bgClr,
+                       const TileBuf& buf, int ox, int oy, int tw, int th, int w, float* pFrame) {
+	const std::vector<TDGeometry::Point>& pnts = geo.pnts();
+	const std::vector<uint32_t>& tris = geo.tris();
+	for (int py = 0; py < th; ++py) {
+		float* pDst = pFrame + ((size_t)(oy + py) * w + ox) * 3;
+		for (int px = 0; px < tw; ++px, pDst += 3) {
+			int idx = py * TILE_SIZE + px;
+			uint32_t itri = buf.tri[idx];
+			if (itri == NO_TRI) {
+				pDst[0] = bgClr[0]; pDst[1] = bgClr[1]; pDst[2] = bgClr[2];
+				continue;
+			}
+			const uint32_t* pIdx = &tris[itri * 3];
+			// perspective-correct weights
+			float w1 = buf.b1[idx] * vtx[pIdx[1]].iw;
+			float w2 = buf.b2[idx] * vtx[pIdx[2]].iw;
+			float w0 = (1.0f - buf.b1[idx] - buf.b2[idx]) * vtx[pIdx[0]].iw;
+			float s = 1.0f / (w0 + w1 + w2);
+			w0 *= s; w1 *= s; w2 *= s;
+			const TDGeometry::Point& p0 = pnts[pIdx[0]];
+			const TDGeometry::Point& p1 = pnts[pIdx[1]];
+			const TDGeometry::Point& p2 = pnts[pIdx[2]];
+			V4 P = add(add(scale(load3(&p0.x), w0), scale(load3(&p1.x), w1)), scale(load3(&p2.x), w2));
+			V4 N = normalize3(add(add(scale(load3(&p0.nx), w0), scale(load3(&p1.nx), w1)), scale(load3(&p2.nx), w2)));
+			// colours are linear, clamped like the viewer's 8-bit vertex colours
+			V4 C = add(add(scale(clamp01(load3(&p0.r)), w0), scale(clamp01(load3(&p1.r)), w1)), scale(clamp01(load3(&p2.r)), w2));
+
+			float t = (dot3(N, sh.up) + 1.0f) * 0.5f;
+			V4 hemi = add(sh.ground, scale(sub(sh.sky, sh.ground), t));
+			V4 clr = mul(C, hemi);
+			// Phong: reflect(-L, N) = 2 (N.L) N - L
+			V4 V = normalize3(sub(sh.eye, P));
+			V4 R = sub(scale(N, 2.0f * dot3(N, sh.lightDir)), sh.lightDir);
+			float vr = std::max(0.0f, dot3(V, R));
+			clr = add(clr, scale(sh.specClr, std::pow(vr, sh.specPow) * 0.5f));
+			float out[4];
+			store4(out, clr);
+			for (int i = 0; i < 3; ++i) {
+				pDst[i] = std::pow(std::max(out[i], 0.0f), sh.invGamma);
+			}
+		}
+	}
+}
+
+bool TDRaster::render(const TDGeometry& geo, Image& img, const Cfg& cfg) {
+	img.width = 0;
+	img.height = 0;
+	img.rgb.clear();
+	uint32_t npnt = geo.get_pnt_num();
+	uint32_t ntri = geo.get_tri_num();
+	if (cfg.width <= 0 || cfg.height <= 0 || npnt == 0 || ntri == 0) { return false; }
+
+	int ss = std::max(cfg.supersample, 1);
+	int w = cfg.width * ss;
+	int h = cfg.height * ss;
+	Camera cam;
+	init_camera(geo.bbox(), cfg.fovY, (float)w / (float)h, cam);
+	Shading sh;
+	init_shading(cfg.light, cam, sh);
+
+	const std::vector<TDGeometry::Point>& pnts = geo.pnts();
+	const std::vector<uint32_t>& tris = geo.tris();
+	std::vector<RVtx> vtx(npnt);
+	TDParallel::for_each(npnt, [&](uint32_t i) {
+		const TDGeometry::Point& pnt = pnts[i];
+		float d[3] = { pnt.x - cam.eye[0], pnt.y - cam.eye[1], pnt.z - cam.eye[2] };
+		float vz = dot3f(d, cam.fwd);
+		RVtx& v = vtx[i];
+		if (vz < cam.znear) {
+			v.sx = 0.0f;
+			v.sy = 0.0f;
+			v.iw = 0.0f;
+		} else {
+			v.iw = 1.0f / vz;
+			v.sx = (dot3f(d, cam.side) * cam.kx * v.iw * 0.5f + 0.5f) * w;
+			v.sy = (0.5f - dot3f(d, cam.up) * cam.ky * v.iw * 0.5f) * h;
+		}
+	});
+
+	// Bin triangles by bbox into tiles; every slice keeps its own bins so
+	// tiles see triangles in the original order.
+	int tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+	uint32_t ntiles = (uint32_t)(tilesX * tilesY);
+	uint32_t nslices = TDParallel::num_slices(ntri);
+	std::vector<std::vector<uint32_t>> bins((size_t)nslices * ntiles);
+	TDParallel::for_slices(ntri, nslices, [&](uint32_t org, uint32_t end, uint32_t islice) {
+		std::vector<uint32_t>* pBins = &bins[(size_t)islice * ntiles];
+		for (uint32_t i = org; i < end; ++i) {
+			const RVtx& v0 = vtx[tris[i * 3 + 0]];
+			const RVtx& v1 = vtx[tris[i * 3 + 1]];
+			const RVtx& v2 = vtx[tris[i * 3 + 2]];
+			if (v0.iw == 0.0f || v1.iw == 0.0f || v2.iw == 0.0f) { continue; }
+			float x0 = std::min(std::min(v0.sx, v1.sx), v2.sx);
+			float x1 = std::max(std::max(v0.sx, v1.sx), v2.sx);
+			float y0 = std::min(std::min(v0.sy, v1.sy), v2.sy);
+			float y1 = std::max(std::max(v0.sy, v1.sy), v2.sy);
+			if (x1 < 0.0f || y1 < 0.0f || x0 >= (float)w || y0 >= (float)h) { continue; }
+			int tx0 = std::max(0, (int)x0 / TILE_SIZE);
+			int ty0 = std::max(0, (int)y0 / TILE_SIZE);
+			int tx1 = std::min(tilesX - 1, (int)x1 / TILE_SIZE);
+			int ty1 = std::min(tilesY - 1, (int)y1 / TILE_SIZE);
+			for (int ty = ty0; ty <= ty1; ++ty) {
+				for (int tx = tx0; tx <= tx1; ++tx) {
+					pBins[ty * tilesX + tx].push_back(i);
+				}
+			}
+		}
+	});
+
+	// Workers pull tiles until none are left; tiles cover disjoint parts of
+	// the frame so no locking is needed.
+	std::vector<float> frame((size_t)w * h * 3);
+	std::atomic<uint32_t> nextTile(0);
+	uint32_t nwk = std::min(TDParallel::num_workers(), ntiles);
+	TDParallel::for_slices(nwk, nwk, [&](uint32_t, uint32_t, uint32_t) {
+		std::unique_ptr<TileBuf> pBuf(new TileBuf);
+		uint32_t itile;
+		while ((itile = nextTile++) < ntiles) {
+			int ox = (int)(itile % tilesX) * TILE_SIZE;
+			int oy = (int)(itile / tilesX) * TILE_SIZE;
+			int tw = std::min(TILE_SIZE, w - ox);
+			int th = std::min(TILE_SIZE, h - oy);
+			std::fill(pBuf->depth, pBuf->depth + TILE_SIZE * TILE_SIZE, 0.0f);
+			std::fill(pBuf->tri, pBuf->tri + TILE_SIZE * TILE_SIZE, NO_TRI);
+			for (uint32_t islice = 0; islice < nslices; ++islice) {
+				for (uint32_t itri : bins[(size_t)islice * ntiles + itile]) {
+					const uint32_t* pIdx = &tris[itri * 3];
+					raster_tri(vtx[pIdx[0]], vtx[pIdx[1]], vtx[pIdx[2]], itri, ox, oy, tw, th, *pBuf);
+				}
+			}
+			shade_tile(geo, vtx, sh, cfg.bgClr, *pBuf, ox, oy, tw, th, w, frame.data());
+		}
+	});
+
+	img.width = cfg.width;
+	img.height = cfg.height;
+	img.rgb.resize((size_t)cfg.width * cfg.height * 3);
+	float norm = 255.0f / (float)(ss * ss);
+	TDParallel::for_each((uint32_t)cfg.height, [&](uint32_t y) {
+		for (int x = 0; x < cfg.width; ++x) {
+			for (int c = 0; c < 3; ++c) {
+				float sum = 0.0f;
+				for (int sy = 0; sy < ss; ++sy) {
+					const float* pSrc = &frame[(((size_t)y * ss + sy) * w + (size_t)x * ss) * 3 + c];
+					for (int sx = 0; sx < ss; ++sx) {
+						sum += std::min(pSrc[sx * 3], 1.0f);
+					}
+				}
+				img.rgb[((size_t)y * cfg.width + x) * 3 + c] = (uint8_t)(sum * norm + 0.5f);
+			}
+		}
+	}, 16);
+	return true;
+}
+
+bool TDRaster::Image::save_ppm(const std::string& path) const {
+	if (width <= 0 || height <= 0) { return false; }
+	std::ofstream os(path, std::ios::binary);
+	if (!os.good()) { return false; }
+	os << "P6\n" << width << " " << height << "\n255\n";
+	os.write((const char*)rgb.data(), rgb.size());
+	return os.good();
+}
+
+static uint32_t png_crc(const uint8_t* pData, size_t size, uint32_t crc) {
+	struct Table {
+		uint32_t v[256];
+		Table() {
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; ++k) {
+					c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				}
+				v[i] = c;
+			}
+		}
+	};
+	static const Table s_table;
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) {
+		crc = s_table.v[(crc ^ pData[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static void put_be32(std::vector<uint8_t>& buf, uint32_t v) {
+	buf.push_back((uint8_t)(v >> 24));
+	buf.push_back((uint8_t)(v >> 16));
+	buf.push_back((uint8_t)(v >> 8));
+	buf.push_back((uint8_t)v);
+}
+
+static void put_png_chunk(std::ostream& os, const char* pType, const std::vector<uint8_t>& data) {
+	std::vector<uint8_t> buf;
+	buf.reserve(data.size() + 12);
+	put_be32(buf, (uint32_t)data.size());
+	buf.insert(buf.end(), pType, pType + 4);
+	buf.insert(buf.end(), data.begin(), data.end());
+	put_be32(buf, png_crc(&buf[4], buf.size() - 4, 0));
+	os.write((const char*)buf.data(), buf.size());
+}
+
+bool TDRaster::Image::save_png(const std::string& path) const {
+	if (width <= 0 || height <= 0) { return false; }
+	std::ofstream os(path, std::ios::binary);
+	if (!os.good()) { return false; }
+	static const uint8_t s_sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	os.write((const char*)s_sig, sizeof(s_sig));
+
+	std::vector<uint8_t> hdr;
+	put_be32(hdr, (uint32_t)width);
+	put_be32(hdr, (uint32_t)height);
+	hdr.push_back(8); // bit depth
+	hdr.push_back(2); // RGB
+	hdr.push_back(0);
+	hdr.push_back(0);
+	hdr.push_back(0);
+	put_png_chunk(os, "IHDR", hdr);
+
+	// rows with filter type 0, wrapped in a zlib stream
+	size_t rowBytes = (size_t)width * 3;
+	std::vector<uint8_t> raw;
+	raw.reserve((rowBytes + 1) * height);
+	for (int y = 0; y < height; ++y) {
+		raw.push_back(0);
+		raw.insert(raw.end(), rgb.begin() + y * rowBytes, rgb.begin() + (y + 1) * rowBytes);
+	}
+	std::vector<uint8_t> z;
+#ifdef TD_USE_ZLIB
+	uLongf zSize = compressBound((uLong)raw.size());
+	z.resize(zSize);
+	if (compress2(z.data(), &zSize, raw.data(), (uLong)raw.size(), Z_BEST_COMPRESSION) != Z_OK) { return false; }
+	z.resize(zSize);
+#else
+	// no zlib in this build: stored blocks, the size of the raw rows
+	z.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	z.push_back(0x78);
+	z.push_back(0x01);
+	size_t pos = 0;
+	do {
+		size_t len = std::min(raw.size() - pos, (size_t)65535);
+		z.push_back(pos + len == raw.size() ? 1 : 0);
+		z.push_back((uint8_t)len);
+		z.push_back((uint8_t)(len >> 8));
+		z.push_back((uint8_t)~len);
+		z.push_back((uint8_t)(~len >> 8));
+		z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + len);
+		pos += len;
+	} while (pos < raw.size());
+	uint32_t s1 = 1, s2 = 0;
+	for (uint8_t b : raw) {
+		s1 = (s1 + b) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+	put_be32(z, (s2 << 16) | s1);
+#endif
+	put_png_chunk(os, "IDAT", z);
+	put_png_chunk(os, "IEND", std::vector<uint8_t>());
+	return os.good();
+}
+
+bool TDRaster::Image::save(const std::string& path) const {
+	size_t n = path.size();
+	if (n >= 4) {
+		std::string ext = path.substr(n - 4);
+		std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return (char)tolower(c); });
+		if (ext == ".png") { return save_png(path); }
+	}
+	return save_ppm(path);
+}
@@ -0,0 +1,65 @@
+/*
+ * TouchDesigner geometry: multi-threaded software rasterizer for thumbnails
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "TDGeometry.hpp"
+
+namespace TDRaster {
+	// Same model as the viewer's hemidir.frag: vertex colour times a
+	// sky/ground hemisphere term plus a Phong highlight, then gamma.
+	// Defaults are the viewer's (GLDraw::set_hemi_light/set_spec_light).
+	struct Light {
+		float hemiSky[3];
+		float hemiGround[3];
+		float hemiUp[3];
+		// Zero direction: from just above the camera towards the target,
+		// as the viewer does.
+		float specDir[3];
+		float specClr[3];
+		float roughness;
+		float gamma;
+
+		Light();
+	};
+
+	struct Cfg {
+		int width;
+		int height;
+		// Samples per pixel side, box-filtered down to width x height.
+		int supersample;
+		float fovY; // degrees
+		float bgClr[3];
+		Light light;
+
+		Cfg() : width(256), height(256), supersample(2), fovY(40.0f) {
+			bgClr[0] = 0.33f; bgClr[1] = 0.44f; bgClr[2] = 0.55f;
+		}
+	};
+
+	struct Image {
+		int width;
+		int height;
+		std::vector<uint8_t> rgb; // top-down rows
+
+		Image() : width(0), height(0) {}
+
+		bool save_ppm(const std::string& path) const;
+		// Deflated with zlib when built with TD_USE_ZLIB, otherwise written
+		// as stored (uncompressed) deflate blocks.
+		bool save_png(const std::string& path) const;
+		// PNG for a .png extension, PPM otherwise.
+		bool save(const std::string& path) const;
+	};
+
+	// Frames the geometry like the viewer frames a single asset (in front,
+	// slightly above, looking at the bbox centre) and renders it double-sided
+	// with a depth buffer. The screen is split into tiles which are
+	// rasterized and shaded in parallel; triangles crossing the near plane
+	// are dropped.
+	bool render(const TDGeometry& geo, Image& img, const Cfg& cfg = Cfg());
+}
@@ -0,0 +1,295 @@
+/*
+ * TouchDesigner geometry: loading and writing with a compile-time attribute schema
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "TDGeometry.hpp"
+
+// TDGeometry reads every table into the full P/N/Cd/uv record and maps each
+// value to its field at run time. A tool that knows which attributes it needs
+// can use TDSchema::Geometry instead: the point record holds just the schema
+// attributes in the chosen scalar type, and record offsets, column names and
+// the .geo writer are all resolved by the compiler, e.g.
+//   TDSchema::Geometry<TDSchema::Schema<TDSchema::P, TDSchema::N, TDSchema::Cd> > geo;
+namespace TDSchema {
+	// Attribute tags. TD names the columns name(0) .. name(SIZE - 1);
+	// GEO_SIZE components go to .geo, padded with geo_default().
+	struct P {
+		enum { SIZE = 3, GEO_SIZE = 3 };
+		static const char* name() { return "P"; }
+		static const char* geo_type() { return "float"; }
+		static float geo_default() { return 0.0f; }
+	};
+
+	struct N {
+		enum { SIZE = 3, GEO_SIZE = 3 };
+		static const char* name() { return "N"; }
+		static const char* geo_type() { return "vector"; }
+		static float geo_default() { return 0.0f; }
+	};
+
+	struct Cd {
+		enum { SIZE = 4, GEO_SIZE = 3 };
+		static const char* name() { return "Cd"; }
+		static const char* geo_type() { return "float"; }
+		static float geo_default() { return 1.0f; }
+	};
+
+	struct uv {
+		enum { SIZE = 2, GEO_SIZE = 3 };
+		static const char* name() { return "uv"; }
+		static const char* geo_type() { return "float"; }
+		static float geo_default() { return 0.0f; }
+	};
+
+	template <typename... ATTRS> struct Attrs;
+
+	template <> struct Attrs<> {
+		enum { SIZE = 0 };
+		static void column_names(std::vector<std::string>&) {}
+		static void geo_header(std::ostream&) {}
+		template <typename T> static void geo_values(std::ostream&, const T*, const char*&) {}
+	};
+
+	// P is written in front of the parentheses of every point line, so it
+	// is left out of the .geo point attributes.
+	template <typename HEAD, typename... REST> struct Attrs<HEAD, REST...> {
+		enum { SIZE = HEAD::SIZE + Attrs<REST...>::SIZE };
+
+		static void column_names(std::vector<std::string>& names) {
+			for (int i = 0; i < HEAD::SIZE; ++i) {
+				names.push_back(std::string(HEAD::name()) + "(" + std::to_string(i) + ")");
+			}
+			Attrs<REST...>::column_names(names);
+		}
+
+		static void geo_header(std::ostream& os) {
+			if (!std::is_same<HEAD, P>::value) {
+				os << HEAD::name() << " " << (int)HEAD::GEO_SIZE << " " << HEAD::geo_type();
+				for (int i = 0; i < HEAD::GEO_SIZE; ++i) {
+					os << " " << HEAD::geo_default();
+				}
+				os << std::endl;
+			}
+			Attrs<REST...>::geo_header(os);
+		}
+
+		template <typename T> static void geo_values(std::ostream& os, const T* pVal, const char*& pSep) {
+			if (!std::is_same<HEAD, P>::value) {
+				os << pSep;
+				for (int i = 0; i < HEAD::GEO_SIZE; ++i) {
+					os << (i ? " " : "") << (i < HEAD::SIZE ? pVal[i] : (T)HEAD::geo_default());
+				}
+				pSep = "  ";
+			}
+			Attrs<REST...>::geo_values(os, pVal + HEAD::SIZE, pSep);
+		}
+	};
+
+	// Position of ATTR's first component in the record, a compile error
+	// when the schema has no ATTR.
+	template <typename ATTR, typename... ATTRS> struct Offset;
+	template <typename ATTR, typename... REST> struct Offset<ATTR, ATTR, REST...> {
+		enum { value = 0 };
+	};
+	template <typename ATTR, typename HEAD, typename... REST> struct Offset<ATTR, HEAD, REST...> {
+		enum { value = HEAD::SIZE + Offset<ATTR, REST...>::value };
+	};
+
+	template <typename ATTR, typename... ATTRS> struct Has {
+		enum { value = 0 };
+	};
+	template <typename ATTR, typename... REST> struct Has<ATTR, ATTR, REST...> {
+		enum { value = 1 };
+	};
+	template <typename ATTR, typename HEAD, typename... REST> struct Has<ATTR, HEAD, REST...> {
+		enum { value = Has<ATTR, REST...>::value };
+	};
+
+	template <typename... ATTRS> struct Schema {
+		typedef Attrs<ATTRS...> List;
+		enum { ATTR_NUM = sizeof...(ATTRS), SIZE = List::SIZE };
+		template <typename ATTR> struct offset {
+			enum { value = Offset<ATTR, ATTRS...>::value };
+		};
+		template <typename ATTR> struct has {
+			enum { value = Has<ATTR, ATTRS...>::value };
+		};
+	};
+
+	inline float parse_val(const char* pStr, char** ppEnd, float) { return std::strtof(pStr, ppEnd); }
+	inline double parse_val(const char* pStr, char** ppEnd, double) { return std::strtod(pStr, ppEnd); }
+
+	// Whether the tab-separated field [pStr, pFieldEnd) is a number and
+	// nothing else.
+	template <typename T>
+	bool parse_field(const char* pStr, const char* pFieldEnd, T& val) {
+		char* pEnd;
+		val = parse_val(pStr, &pEnd, T());
+		if (pEnd == pStr || pEnd > pFieldEnd) { return false; }
+		while (pEnd < pFieldEnd && isspace((unsigned char)*pEnd)) { ++pEnd; }
+		return pEnd == pFieldEnd;
+	}
+
+	template <typename SCHEMA, typename T = float>
+	class Geometry {
+	public:
+		enum { SIZE = SCHEMA::SIZE };
+
+		// Schema attributes back to back, in schema order.
+		struct Point {
+			T val[SIZE];
+
+			template <typename ATTR> T* get() { return val + SCHEMA::template offset<ATTR>::value; }
+			template <typename ATTR> const T* get() const { return val + SCHEMA::template offset<ATTR>::value; }
+		};
+
+	protected:
+		std::vector<Point> mPnts;
+		std::vector<uint32_t> mPolOrg; // polygon i is mPolPnts[mPolOrg[i]] .. mPolPnts[mPolOrg[i + 1] - 1]
+		std::vector<int> mPolPnts;
+
+		// Every column of the schema must be in the header, in any order;
+		// other columns (TD string attributes too) are skipped. Fields are
+		// split on tabs up to the last column used and parsed straight into
+		// the record; a row whose schema field isn't a number fails the load.
+		bool load_pnts(const std::string& pntsPath) {
+			using namespace std;
+			TDInStream is;
+			is.open(TDInStream::find(pntsPath));
+			if (!is.good()) { return false; }
+			string row;
+			if (!getline(is, row)) { return true; } // empty table
+
+			vector<string> header;
+			istringstream ss(row);
+			string cname;
+			while (ss >> cname) {
+				header.push_back(cname);
+			}
+			vector<string> names;
+			SCHEMA::List::column_names(names);
+			vector<int> fields(header.size(), -1); // record index per column
+			int columnNum = 0;
+			for (int i = 0; i < SIZE; ++i) {
+				vector<string>::const_iterator it = find(header.begin(), header.end(), names[i]);
+				if (it == header.end()) { return false; }
+				int column = (int)(it - header.begin());
+				fields[column] = i;
+				columnNum = max(columnNum, column + 1);
+			}
+
+			Point pnt;
+			while (getline(is, row)) {
+				const char* pStr = row.c_str();
+				for (int i = 0; i < columnNum; ++i) {
+					const char* pFieldEnd = pStr;
+					while (*pFieldEnd && *pFieldEnd != '\t') { ++pFieldEnd; }
+					if (fields[i] >= 0 && !parse_field(pStr, pFieldEnd, pnt.val[fields[i]])) { return false; }
+					pStr = *pFieldEnd ? pFieldEnd + 1 : pFieldEnd;
+				}
+				mPnts.push_back(pnt);
+			}
+			return true;
+		}
+
+		// As in TDGeometry, no polygons table loads a point cloud.
+		bool load_pols(const std::string& polsPath) {
+			if (!std::ifstream(TDInStream::find(polsPath)).good()) { return true; }
+			TDGeometry::PolReader reader;
+			if (!reader.open(polsPath)) { return false; }
+			std::vector<int> pnts;
+			while (reader.next(pnts)) {
+				mPolPnts.insert(mPolPnts.end(), pnts.begin(), pnts.end());
+				mPolOrg.push_back((uint32_t)mPolPnts.size());
+			}
+			return true;
+		}
+
+	public:
+		Geometry() : mPolOrg(1, 0) {}
+
+		uint32_t get_pnt_num() const { return (uint32_t)mPnts.size(); }
+		uint32_t get_poly_num() const { return (uint32_t)mPolOrg.size() - 1; }
+		const std::vector<Point>& pnts() const { return mPnts; }
+		int poly_nvtx(uint32_t idx) const { return (int)(mPolOrg[idx + 1] - mPolOrg[idx]); }
+		const int* poly_pnts(uint32_t idx) const { return mPolPnts.data() + mPolOrg[idx]; }
+
+		// Fails on a points table without all of the schema columns.
+		bool load(const std::string& folder) {
+			return load(folder + "/pnt.txt", folder + "/pol.txt");
+		}
+
+		bool load(const std::string& pntsPath, const std::string& polsPath) {
+			unload();
+			if (load_pnts(pntsPath) && load_pols(polsPath)) { return true; }
+			unload();
+			return false;
+		}
+
+		void unload() {
+			mPnts.clear();
+			mPolOrg.assign(1, 0);
+			mPolPnts.clear();
+		}
+
+		// Same layout as TDGeometry::dump_geo, with the schema attributes.
+		bool dump_geo(std::ostream& os) const {
+			using namespace std;
+			static_assert(SCHEMA::template has<P>::value, "dump_geo needs P in the schema");
+			const int posOrg = SCHEMA::template offset<P>::value;
+			const int attrNum = SCHEMA::ATTR_NUM - 1;
+
+			if (!os.good()) { return false; }
+
+			os << "PGEOMETRY V5" << endl;
+			os << "NPoints " << get_pnt_num() << " NPrims " << get_poly_num() << endl;
+			os << "NPointGroups 0 NPrimGroups 0" << endl;
+			os << "NPointAttrib " << attrNum << " NVertexAttrib 0 NPrimAttrib 0 NAttrib 0" << endl;
+			if (attrNum > 0) {
+				os << "PointAttrib" << endl;
+				SCHEMA::List::geo_header(os);
+			}
+
+			for (const Point& pnt : mPnts) {
+				os << pnt.val[posOrg] << " " << pnt.val[posOrg + 1] << " " << pnt.val[posOrg + 2] << " 1";
+				if (attrNum > 0) {
+					const char* pSep = "";
+					os << " (";
+					SCHEMA::List::geo_values(os, pnt.val, pSep);
+					os << ")";
+				}
+				os << endl;
+			}
+
+			if (get_poly_num() > 0) {
+				os << "Run " << get_poly_num() << " Poly" << endl;
+			}
+			for (uint32_t i = 0; i < get_poly_num(); ++i) {
+				int nvtx = poly_nvtx(i);
+				const int* pIdx = poly_pnts(i);
+				os << " " << nvtx << " <";
+				for (int idx = nvtx - 1; idx >= 0; --idx) {
+					os << " " << pIdx[idx];
+				}
+				os << endl;
+			}
+
+			os << "beginExtra" << endl;
+			os << "endExtra" << endl;
+
+			return true;
+		}
+	};
+}
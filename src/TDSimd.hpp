@@ -0,0 +1,90 @@
+/*
+ * TouchDesigner geometry: minimal 4-wide float vector helpers
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#	define TDGEO_SSE 1
+#	include <xmmintrin.h>
+#endif
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace TDSimd {
+#if defined(TDGEO_SSE)
+	typedef __m128 V4;
+
+	inline V4 set(float x, float y, float z, float w = 0.0f) { return _mm_set_ps(w, z, y, x); }
+	inline V4 zero() { return _mm_setzero_ps(); }
+	inline V4 splat(float s) { return _mm_set1_ps(s); }
+	inline V4 load3(const float* p) { return _mm_set_ps(0.0f, p[2], p[1], p[0]); }
+	inline V4 load4(const float* p) { return _mm_loadu_ps(p); }
+	inline void store4(float* p, V4 v) { _mm_storeu_ps(p, v); }
+	inline V4 add(V4 a, V4 b) { return _mm_add_ps(a, b); }
+	inline V4 sub(V4 a, V4 b) { return _mm_sub_ps(a, b); }
+	inline V4 mul(V4 a, V4 b) { return _mm_mul_ps(a, b); }
+	inline V4 min(V4 a, V4 b) { return _mm_min_ps(a, b); }
+	inline V4 max(V4 a, V4 b) { return _mm_max_ps(a, b); }
+	inline float x(V4 v) { return _mm_cvtss_f32(v); }
+	inline V4 bit_or(V4 a, V4 b) { return _mm_or_ps(a, b); }
+	// bit i is the sign bit of lane i
+	inline int sign_mask(V4 v) { return _mm_movemask_ps(v); }
+
+	inline V4 cross(V4 a, V4 b) {
+		// (a * b.yzx - a.yzx * b).yzx
+		V4 ayzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+		V4 byzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+		V4 c = _mm_sub_ps(_mm_mul_ps(a, byzx), _mm_mul_ps(ayzx, b));
+		return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+	}
+
+	inline float dot3(V4 a, V4 b) {
+		V4 m = _mm_mul_ps(a, b);
+		V4 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1));
+		V4 z = _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2));
+		return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(m, y), z));
+	}
+#else
+	struct V4 { float v[4]; };
+
+	inline V4 set(float x, float y, float z, float w = 0.0f) { V4 r = { { x, y, z, w } }; return r; }
+	inline V4 zero() { return set(0.0f, 0.0f, 0.0f, 0.0f); }
+	inline V4 splat(float s) { return set(s, s, s, s); }
+	inline V4 load3(const float* p) { return set(p[0], p[1], p[2], 0.0f); }
+	inline V4 load4(const float* p) { return set(p[0], p[1], p[2], p[3]); }
+	inline void store4(float* p, V4 a) { for (int i = 0; i < 4; ++i) { p[i] = a.v[i]; } }
+	inline V4 add(V4 a, V4 b) { for (int i = 0; i < 4; ++i) { a.v[i] += b.v[i]; } return a; }
+	inline V4 sub(V4 a, V4 b) { for (int i = 0; i < 4; ++i) { a.v[i] -= b.v[i]; } return a; }
+	inline V4 mul(V4 a, V4 b) { for (int i = 0; i < 4; ++i) { a.v[i] *= b.v[i]; } return a; }
+	inline V4 min(V4 a, V4 b) { for (int i = 0; i < 4; ++i) { a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; } return a; }
+	inline V4 max(V4 a, V4 b) { for (int i = 0; i < 4; ++i) { a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; } return a; }
+	inline float x(V4 a) { return a.v[0]; }
+	inline V4 bit_or(V4 a, V4 b) {
+		for (int i = 0; i < 4; ++i) {
+			uint32_t ua, ub;
+			memcpy(&ua, &a.v[i], 4);
+			memcpy(&ub, &b.v[i], 4);
+			ua |= ub;
+			memcpy(&a.v[i], &ua, 4);
+		}
+		return a;
+	}
+	inline int sign_mask(V4 a) {
+		int m = 0;
+		for (int i = 0; i < 4; ++i) { m |= std::signbit(a.v[i]) ? 1 << i : 0; }
+		return m;
+	}
+
+	inline V4 cross(V4 a, V4 b) {
+		return set(a.v[1] * b.v[2] - a.v[2] * b.v[1], a.v[2] * b.v[0] - a.v[0] * b.v[2], a.v[0] * b.v[1] - a.v[1] * b.v[0]);
+	}
+
+	inline float dot3(V4 a, V4 b) { return a.v[0] * b.v[0] + a.v[1] * b.v[1] + a.v[2] * b.v[2]; }
+#endif
+
+	inline V4 scale(V4 a, float s) { return mul(a, splat(s)); }
+	inline float length3(V4 a) { return std::sqrt(dot3(a, a)); }
+}
@@ -0,0 +1,563 @@
+/*
+ * TouchDesigner geometry: quadric error mesh simplification
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#include "TDSimplify.hpp"
+#include "TDParallel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+typedef TDGeometry::Point Point;
+
+struct Quadric {
+	// symmetric 4x4: a00 a01 a02 a11 a12 a22 b0 b1 b2 c
+	double m[10];
+
+	void clear() {
+		for (int i = 0; i < 10; ++i) { m[i] = 0.0; }
+	}
+
+	void add(const Quadric& q) {
+		for (int i = 0; i < 10; ++i) { m[i] += q.m[i]; }
+	}
+
+	void add_plane(double nx, double ny, double nz, double d, double w) {
+		m[0] += w * nx * nx; m[1] += w * nx * ny; m[2] += w * nx * nz;
+		m[3] += w * ny * ny; m[4] += w * ny * nz;
+		m[5] += w * nz * nz;
+		m[6] += w * nx * d; m[7] += w * ny * d; m[8] += w * nz * d;
+		m[9] += w * d * d;
+	}
+
+	double eval(const float p[3]) const {
+		double x = p[0], y = p[1], z = p[2];
+		return m[0] * x * x + 2.0 * m[1] * x * y + 2.0 * m[2] * x * z
+		     + m[3] * y * y + 2.0 * m[4] * y * z + m[5] * z * z
+		     + 2.0 * (m[6] * x + m[7] * y + m[8] * z) + m[9];
+	}
+
+	// Position minimizing the error; false if the system is ill-conditioned.
+	bool optimum(float p[3]) const {
+		double a00 = m[0], a01 = m[1], a02 = m[2], a11 = m[3], a12 = m[4], a22 = m[5];
+		double c0 = a11 * a22 - a12 * a12;
+		double c1 = a02 * a12 - a01 * a22;
+		double c2 = a01 * a12 - a02 * a11;
+		double det = a00 * c0 + a01 * c1 + a02 * c2;
+		double scl = std::fabs(a00) + std::fabs(a11) + std::fabs(a22);
+		if (std::fabs(det) <= 1e-12 * scl * scl * scl || scl <= 0.0) { return false; }
+		double b0 = -m[6], b1 = -m[7], b2 = -m[8];
+		double inv = 1.0 / det;
+		p[0] = (float)((c0 * b0 + c1 * b1 + c2 * b2) * inv);
+		p[1] = (float)((c1 * b0 + (a00 * a22 - a02 * a02) * b1 + (a02 * a01 - a00 * a12) * b2) * inv);
+		p[2] = (float)((c2 * b0 + (a01 * a02 - a00 * a12) * b1 + (a00 * a11 - a01 * a01) * b2) * inv);
+		return true;
+	}
+};
+
+struct Collapse {
+	float err;
+	uint32_t into;
+	uint32_t from;
+	uint32_t verInto;
+	uint32_t verFrom;
+	float pos[3];
+	float t; // attribute blend from 'into' (0) to 'from' (1)
+
+	// lowest error on top of std::priority_queue
+	bool operator < (const Collapse& c) const { return err > c.err; }
+};
+
+// Simplified part of the mesh: every LOD target is a snapshot of one
+// progressive collapse sequence.
+struct SimpLod {
+	std::vector<Point> pnts;
+	std::vector<int32_t> shared; // source point index for seam points, -1 otherwise
+	std::vector<uint32_t> tris;
+};
+
+class SimpMesh {
+	enum {
+		VTX_LOCKED = 1,
+		VTX_DEAD = 2
+	};
+
+	const TDSimplify::Cfg& mCfg;
+	std::vector<Point> mVtx;
+	std::vector<uint32_t> mSrc;
+	std::vector<Quadric> mQ;
+	std::vector<uint32_t> mVer;
+	std::vector<uint8_t> mFlags;
+	std::vector<uint8_t> mShared;
+	std::vector<uint32_t> mTri;
+	std::vector<uint8_t> mTriDead;
+	std::vector<std::vector<uint32_t> > mRefs;
+	std::vector<uint32_t> mNbrA;
+	std::vector<uint32_t> mNbrB;
+	std::priority_queue<Collapse> mHeap;
+	uint32_t mLiveTris;
+
+	bool locked(uint32_t v) const { return (mFlags[v] & VTX_LOCKED) != 0; }
+	bool dead(uint32_t v) const { return (mFlags[v] & VTX_DEAD) != 0; }
+	const float* pos(uint32_t v) const { return &mVtx[v].x; }
+
+	bool tri_has(uint32_t t, uint32_t v) const {
+		return mTri[t * 3] == v || mTri[t * 3 + 1] == v || mTri[t * 3 + 2] == v;
+	}
+
+	uint32_t edge_tris(uint32_t a, uint32_t b) const {
+		uint32_t n = 0;
+		for (uint32_t t : mRefs[a]) {
+			if (!mTriDead[t] && tri_has(t, b)) { ++n; }
+		}
+		return n;
+	}
+
+	void neighbors(uint32_t v, std::vector<uint32_t>& nbr) const {
+		nbr.clear();
+		for (uint32_t t : mRefs[v]) {
+			if (mTriDead[t]) { continue; }
+			for (int i = 0; i < 3; ++i) {
+				uint32_t w = mTri[t * 3 + i];
+				if (w != v) { nbr.push_back(w); }
+			}
+		}
+		std::sort(nbr.begin(), nbr.end());
+		nbr.erase(std::unique(nbr.begin(), nbr.end()), nbr.end());
+	}
+
+	static void tri_nrm(const float* p0, const float* p1, const float* p2, float n[3]) {
+		float e0[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		float e1[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		n[0] = e0[1] * e1[2] - e0[2] * e1[1];
+		n[1] = e0[2] * e1[0] - e0[0] * e1[2];
+		n[2] = e0[0] * e1[1] - e0[1] * e1[0];
+	}
+
+	bool eval_collapse(uint32_t a, uint32_t b, Collapse& c) const;
+	bool check_flips(uint32_t v, uint32_t other, const float p[3]) const;
+	bool try_collapse(const Collapse& c);
+	void push_edges(uint32_t v);
+	void lerp_attrs(Point& dst, const Point& a, const Point& b, float t) const;
+
+public:
+	SimpMesh(const TDSimplify::Cfg& cfg) : mCfg(cfg), mLiveTris(0) {}
+
+	void init(const std::vector<Point>& srcPnts, const uint32_t* pTris, uint32_t ntri, const std::vector<int32_t>& owner);
+	void run(uint32_t targetTris);
+	void snapshot(SimpLod& lod) const;
+	uint32_t get_tri_num() const { return (uint32_t)mTriDead.size(); }
+};
+
+void SimpMesh::init(const std::vector<Point>& srcPnts, const uint32_t* pTris, uint32_t ntri, const std::vector<int32_t>& owner) {
+	mSrc.assign(pTris, pTris + ntri * 3);
+	std::sort(mSrc.begin(), mSrc.end());
+	mSrc.erase(std::unique(mSrc.begin(), mSrc.end()), mSrc.end());
+	uint32_t nvtx = (uint32_t)mSrc.size();
+
+	mVtx.resize(nvtx);
+	mQ.resize(nvtx);
+	mVer.assign(nvtx, 0);
+	mFlags.assign(nvtx, 0);
+	mShared.assign(nvtx, 0);
+	mRefs.resize(nvtx);
+	for (uint32_t i = 0; i < nvtx; ++i) {
+		mVtx[i] = srcPnts[mSrc[i]];
+		mQ[i].clear();
+		if (owner[mSrc[i]] < 0) {
+			mShared[i] = 1;
+			mFlags[i] |= VTX_LOCKED;
+		}
+	}
+
+	mTri.resize(ntri * 3);
+	mTriDead.assign(ntri, 0);
+	for (uint32_t i = 0; i < ntri * 3; ++i) {
+		mTri[i] = (uint32_t)(std::lower_bound(mSrc.begin(), mSrc.end(), pTris[i]) - mSrc.begin());
+	}
+	mLiveTris = ntri;
+
+	for (uint32_t t = 0; t < ntri; ++t) {
+		uint32_t* pTri = &mTri[t * 3];
+		float n[3];
+		tri_nrm(pos(pTri[0]), pos(pTri[1]), pos(pTri[2]), n);
+		double len = std::sqrt((double)n[0] * n[0] + (double)n[1] * n[1] + (double)n[2] * n[2]);
+		if (len > 0.0) {
+			double nx = n[0] / len, ny = n[1] / len, nz = n[2] / len;
+			const float* p0 = pos(pTri[0]);
+			double d = -(nx * p0[0] + ny * p0[1] + nz * p0[2]);
+			Quadric q;
+			q.clear();
+			q.add_plane(nx, ny, nz, d, len * 0.5);
+			for (int i = 0; i < 3; ++i) {
+				mQ[pTri[i]].add(q);
+			}
+		}
+		for (int i = 0; i < 3; ++i) {
+			mRefs[pTri[i]].push_back(t);
+		}
+	}
+
+	for (uint32_t t = 0; t < ntri; ++t) {
+		for (int i = 0; i < 3; ++i) {
+			uint32_t a = mTri[t * 3 + i];
+			uint32_t b = mTri[t * 3 + (i + 1) % 3];
+			uint32_t n = edge_tris(a, b);
+			// non-manifold edges are always locked, open borders on request
+			if (n > 2 || (n < 2 && mCfg.lockBorders)) {
+				mFlags[a] |= VTX_LOCKED;
+				mFlags[b] |= VTX_LOCKED;
+			}
+		}
+	}
+
+	for (uint32_t t = 0; t < ntri; ++t) {
+		for (int i = 0; i < 3; ++i) {
+			uint32_t a = mTri[t * 3 + i];
+			uint32_t b = mTri[t * 3 + (i + 1) % 3];
+			Collapse c;
+			if (a < b && eval_collapse(a, b, c)) {
+				mHeap.push(c);
+			}
+		}
+	}
+}
+
+bool SimpMesh::eval_collapse(uint32_t a, uint32_t b, Collapse& c) const {
+	bool la = locked(a);
+	bool lb = locked(b);
+	if (la && lb) { return false; }
+
+	Quadric q = mQ[a];
+	q.add(mQ[b]);
+	const float* pa = pos(a);
+	const float* pb = pos(b);
+	if (la || lb) {
+		c.into = la ? a : b;
+		c.from = la ? b : a;
+		const float* p = pos(c.into);
+		c.pos[0] = p[0];
+		c.pos[1] = p[1];
+		c.pos[2] = p[2];
+		c.t = 0.0f;
+		c.err = (float)q.eval(c.pos);
+	} else {
+		float cand[4][3] = {
+			{ pa[0], pa[1], pa[2] },
+			{ pb[0], pb[1], pb[2] },
+			{ (pa[0] + pb[0]) * 0.5f, (pa[1] + pb[1]) * 0.5f, (pa[2] + pb[2]) * 0.5f },
+			{ 0.0f, 0.0f, 0.0f }
+		};
+		int ncand = 3;
+		if (q.optimum(cand[3])) {
+			// keep the optimum only when it stays near the edge
+			float d2 = 0.0f;
+			float l2 = 0.0f;
+			for (int i = 0; i < 3; ++i) {
+				float d = cand[3][i] - cand[2][i];
+				float l = pb[i] - pa[i];
+				d2 += d * d;
+				l2 += l * l;
+			}
+			if (d2 <= l2) { ncand = 4; }
+		}
+		int best = 0;
+		double bestErr = q.eval(cand[0]);
+		for (int i = 1; i < ncand; ++i) {
+			double err = q.eval(cand[i]);
+			if (err < bestErr) {
+				bestErr = err;
+				best = i;
+			}
+		}
+		c.into = a;
+		c.from = b;
+		c.pos[0] = cand[best][0];
+		c.pos[1] = cand[best][1];
+		c.pos[2] = cand[best][2];
+		c.err = (float)bestErr;
+
+		float e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+		float ee = e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+		float t = 0.0f;
+		if (ee > 0.0f) {
+			t = ((c.pos[0] - pa[0]) * e[0] + (c.pos[1] - pa[1]) * e[1] + (c.pos[2] - pa[2]) * e[2]) / ee;
+		}
+		c.t = std::min(std::max(t, 0.0f), 1.0f);
+	}
+	c.verInto = mVer[c.into];
+	c.verFrom = mVer[c.from];
+	return true;
+}
+
+// Moving v to p must not flip or collapse its triangles that survive.
+bool SimpMesh::check_flips(uint32_t v, uint32_t other, const float p[3]) const {
+	for (uint32_t t : mRefs[v]) {
+		if (mTriDead[t] || tri_has(t, other)) { continue; }
+		const uint32_t* pTri = &mTri[t * 3];
+		const float* pp[3];
+		const float* np[3];
+		for (int i = 0; i < 3; ++i) {
+			pp[i] = pos(pTri[i]);
+			np[i] = pTri[i] == v ? p : pp[i];
+		}
+		float n0[3];
+		float n1[3];
+		tri_nrm(pp[0], pp[1], pp[2], n0);
+		tri_nrm(np[0], np[1], np[2], n1);
+		float l0 = std::sqrt(n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2]);
+		float l1 = std::sqrt(n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]);
+		if (l1 <= 0.0f) { return false; }
+		if (l0 > 0.0f) {
+			float d = (n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2]) / (l0 * l1);
+			if (d < mCfg.minNrmCos) { return false; }
+		}
+	}
+	return true;
+}
+
+void SimpMesh::lerp_attrs(Point& dst, const Point& a, const Point& b, float t) const {
+	float s = 1.0f - t;
+	dst.nx = a.nx * s + b.nx * t;
+	dst.ny = a.ny * s + b.ny * t;
+	dst.nz = a.nz * s + b.nz * t;
+	float len = std::sqrt(dst.nx * dst.nx + dst.ny * dst.ny + dst.nz * dst.nz);
+	if (len > 0.0f) {
+		dst.nx /= len;
+		dst.ny /= len;
+		dst.nz /= len;
+	}
+	dst.r = a.r * s + b.r * t;
+	dst.g = a.g * s + b.g * t;
+	dst.b = a.b * s + b.b * t;
+	dst.a = a.a * s + b.a * t;
+	dst.u = a.u * s + b.u * t;
+	dst.v = a.v * s + b.v * t;
+}
+
+bool SimpMesh::try_collapse(const Collapse& c) {
+	uint32_t into = c.into;
+	uint32_t from = c.from;
+	if (dead(into) || dead(from)) { return false; }
+	if (mVer[into] != c.verInto || mVer[from] != c.verFrom) { return false; }
+
+	// only interior manifold edges whose end points share exactly the two edge neighbours
+	if (edge_tris(into, from) != 2) { return false; }
+	neighbors(into, mNbrA);
+	neighbors(from, mNbrB);
+	uint32_t ncommon = 0;
+	for (size_t i = 0, j = 0; i < mNbrA.size() && j < mNbrB.size();) {
+		if (mNbrA[i] < mNbrB[j]) {
+			++i;
+		} else if (mNbrB[j] < mNbrA[i]) {
+			++j;
+		} else {
+			++ncommon;
+			++i;
+			++j;
+		}
+	}
+	if (ncommon != 2) { return false; }
+	if (!check_flips(into, from, c.pos) || !check_flips(from, into, c.pos)) { return false; }
+
+	Point& dst = mVtx[into];
+	Point blend = dst;
+	lerp_attrs(blend, mVtx[into], mVtx[from], c.t);
+	dst = blend;
+	dst.x = c.pos[0];
+	dst.y = c.pos[1];
+	dst.z = c.pos[2];
+	mQ[into].add(mQ[from]);
+
+	std::vector<uint32_t>& refs = mRefs[into];
+	for (uint32_t t : mRefs[from]) {
+		if (mTriDead[t]) { continue; }
+		if (tri_has(t, into)) {
+			mTriDead[t] = 1;
+			--mLiveTris;
+		} else {
+			for (int i = 0; i < 3; ++i) {
+				if (mTri[t * 3 + i] == from) { mTri[t * 3 + i] = into; }
+			}
+			refs.push_back(t);
+		}
+	}
+	size_t nref = 0;
+	for (size_t i = 0; i < refs.size(); ++i) {
+		if (!mTriDead[refs[i]]) { refs[nref++] = refs[i]; }
+	}
+	refs.resize(nref);
+	std::vector<uint32_t>().swap(mRefs[from]);
+	mFlags[from] |= VTX_DEAD;
+	++mVer[into];
+	++mVer[from];
+
+	push_edges(into);
+	return true;
+}
+
+void SimpMesh::push_edges(uint32_t v) {
+	neighbors(v, mNbrA);
+	for (uint32_t w : mNbrA) {
+		Collapse c;
+		if (eval_collapse(v, w, c)) {
+			mHeap.push(c);
+		}
+	}
+}
+
+void SimpMesh::run(uint32_t targetTris) {
+	while (mLiveTris > targetTris && !mHeap.empty()) {
+		Collapse c = mHeap.top();
+		mHeap.pop();
+		try_collapse(c);
+	}
+}
+
+void SimpMesh::snapshot(SimpLod& lod) const {
+	uint32_t nvtx = (uint32_t)mVtx.size();
+	std::vector<int32_t> remap(nvtx, -1);
+	lod.pnts.clear();
+	lod.shared.clear();
+	lod.tris.clear();
+	lod.tris.reserve(mLiveTris * 3);
+	for (uint32_t t = 0; t < mTriDead.size(); ++t) {
+		if (mTriDead[t]) { continue; }
+		for (int i = 0; i < 3; ++i) {
+			uint32_t v = mTri[t * 3 + i];
+			if (remap[v] < 0) {
+				remap[v] = (int32_t)lod.pnts.size();
+				lod.pnts.push_back(mVtx[v]);
+				lod.shared.push_back(mShared[v] ? (int32_t)mSrc[v] : -1);
+			}
+			lod.tris.push_back((uint32_t)remap[v]);
+		}
+	}
+}
+
+namespace TDSimplify {
+	bool build_lods(const TDGeometry& geo, const std::vector<float>& ratios, std::vector<TDGeometry>& lods, const Cfg& cfg) {
+		lods.clear();
+		if (ratios.empty()) { return false; }
+
+		// reuse the geometry's triangulation, minus degenerate triangles
+		const std::vector<uint32_t>& srcTris = geo.tris();
+		std::vector<uint32_t> tris;
+		tris.reserve(srcTris.size());
+		for (size_t t = 0; t < srcTris.size(); t += 3) {
+			const uint32_t* v = &srcTris[t];
+			if (v[0] != v[1] && v[1] != v[2] && v[2] != v[0]) {
+				tris.insert(tris.end(), v, v + 3);
+			}
+		}
+		uint32_t ntri = (uint32_t)tris.size() / 3;
+		if (ntri == 0) { return false; }
+		const std::vector<Point>& pnts = geo.pnts();
+
+		// spatial partitions: a k^3 grid over the bbox, triangles go by centroid
+		uint32_t nparts = 1;
+		int k = 1;
+		if (cfg.partitionTris > 0 && ntri > cfg.partitionTris) {
+			uint32_t want = (ntri + cfg.partitionTris - 1) / cfg.partitionTris;
+			while ((uint32_t)(k * k * k) < want) { ++k; }
+			nparts = k * k * k;
+		}
+		TDGeometry::BBox bbox = geo.bbox();
+		std::vector<uint32_t> triPart(ntri, 0);
+		if (nparts > 1) {
+			TDParallel::for_each(ntri, [&](uint32_t t) {
+				int cc[3];
+				for (int i = 0; i < 3; ++i) {
+					float c = 0.0f;
+					for (int j = 0; j < 3; ++j) {
+						c += (&pnts[tris[t * 3 + j]].x)[i];
+					}
+					c /= 3.0f;
+					float ext = bbox.max[i] - bbox.min[i];
+					int ic = ext > 0.0f ? (int)((c - bbox.min[i]) / ext * k) : 0;
+					cc[i] = std::min(std::max(ic, 0), k - 1);
+				}
+				triPart[t] = (cc[2] * k + cc[1]) * k + cc[0];
+			});
+		}
+
+		// points used by several partitions are seams and stay locked
+		std::vector<int32_t> owner(pnts.size(), (int32_t)nparts);
+		for (uint32_t t = 0; t < ntri; ++t) {
+			for (int j = 0; j < 3; ++j) {
+				int32_t& o = owner[tris[t * 3 + j]];
+				if (o == (int32_t)nparts) {
+					o = (int32_t)triPart[t];
+				} else if (o != (int32_t)triPart[t]) {
+					o = -1;
+				}
+			}
+		}
+
+		std::vector<uint32_t> partOrg(nparts + 1, 0);
+		for (uint32_t t = 0; t < ntri; ++t) {
+			++partOrg[triPart[t] + 1];
+		}
+		for (uint32_t p = 0; p < nparts; ++p) {
+			partOrg[p + 1] += partOrg[p];
+		}
+		std::vector<uint32_t> partTris(ntri * 3);
+		std::vector<uint32_t> fill(partOrg.begin(), partOrg.end() - 1);
+		for (uint32_t t = 0; t < ntri; ++t) {
+			uint32_t dst = fill[triPart[t]]++;
+			for (int j = 0; j < 3; ++j) {
+				partTris[dst * 3 + j] = tris[t * 3 + j];
+			}
+		}
+		std::vector<uint32_t>().swap(tris);
+
+		size_t nlods = ratios.size();
+		std::vector<SimpLod> partLods(nparts * nlods);
+		TDParallel::for_each(nparts, [&](uint32_t p) {
+			uint32_t num = partOrg[p + 1] - partOrg[p];
+			if (num == 0) { return; }
+			SimpMesh msh(cfg);
+			msh.init(pnts, &partTris[partOrg[p] * 3], num, owner);
+			for (size_t l = 0; l < nlods; ++l) {
+				float ratio = std::min(std::max(ratios[l], 0.0f), 1.0f);
+				msh.run((uint32_t)(num * ratio));
+				msh.snapshot(partLods[p * nlods + l]);
+			}
+		}, 1);
+
+		// stitch partitions back, seam points are shared through their source index
+		std::vector<int32_t> seamMap(pnts.size());
+		lods.resize(nlods);
+		for (size_t l = 0; l < nlods; ++l) {
+			std::vector<Point> outPnts;
+			std::vector<TDGeometry::Poly> outPols;
+			std::fill(seamMap.begin(), seamMap.end(), -1);
+			for (uint32_t p = 0; p < nparts; ++p) {
+				const SimpLod& lod = partLods[p * nlods + l];
+				std::vector<uint32_t> remap(lod.pnts.size());
+				for (size_t i = 0; i < lod.pnts.size(); ++i) {
+					int32_t src = lod.shared[i];
+					if (src >= 0 && seamMap[src] >= 0) {
+						remap[i] = (uint32_t)seamMap[src];
+					} else {
+						remap[i] = (uint32_t)outPnts.size();
+						outPnts.push_back(lod.pnts[i]);
+						if (src >= 0) {
+							seamMap[src] = (int32_t)remap[i];
+						}
+					}
+				}
+				for (size_t t = 0; t < lod.tris.size(); t += 3) {
+					TDGeometry::Poly pol = {};
+					pol.nvtx = 3;
+					for (int j = 0; j < 3; ++j) {
+						pol.ipnt[j] = (int)remap[lod.tris[t + j]];
+					}
+					outPols.push_back(pol);
+				}
+			}
+			lods[l].assign(outPnts, outPols, geo.has_normals());
+		}
+		return true;
+	}
+}
@@ -0,0 +1,29 @@
+/*
+ * TouchDesigner geometry: quadric error mesh simplification
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "TDGeometry.hpp"
+
+namespace TDSimplify {
+	struct Cfg {
+		// Meshes with more triangles than this are split into spatial
+		// partitions which are simplified in parallel; vertices on partition
+		// seams stay locked so the pieces stitch back without cracks.
+		uint32_t partitionTris;
+		// Vertices on open borders and non-manifold edges are never moved.
+		bool lockBorders;
+		// Collapses that turn a triangle normal by more than this (cosine) are rejected.
+		float minNrmCos;
+
+		Cfg() : partitionTris(1 << 16), lockBorders(true), minNrmCos(0.2f) {}
+	};
+
+	// Builds one LOD per ratio (fraction of the source triangle count),
+	// ratios are expected in decreasing order. Point attributes (N, Cd, uv)
+	// are interpolated along collapsed edges. Output polygons are triangles.
+	bool build_lods(const TDGeometry& geo, const std::vector<float>& ratios, std::vector<TDGeometry>& lods, const Cfg& cfg = Cfg());
+}
@@ -0,0 +1,398 @@
+/*
+ * TouchDesigner geometry: table input with streaming decompression
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#include "TDStream.hpp"
+#include "TDParallel.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef TD_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef TD_USE_ZSTD
+#include <zstd.h>
+#endif
+
+static const size_t BLOCK_BYTES = 1 << 20; // inflated block handed to the parser
+static const size_t IN_BYTES = 256 << 10;  // compressed read size
+static const size_t QUEUE_BLOCKS = 4;
+// zstd frames with a known size up to this are decompressed whole, several
+// at a time; bigger or unsized frames are streamed.
+static const size_t FRAME_MAX = 16 << 20;
+static const size_t ZSTD_HEADER_MAX = 18;
+
+class TDInStream::Buf : public std::streambuf {
+public:
+	enum Kind {
+		PLAIN,
+		GZIP,
+		ZSTD
+	};
+
+	Buf() : mKind(PLAIN), mEnd(false), mStop(false) {}
+	~Buf() { close(); }
+
+	bool open(const std::string& path);
+	void close();
+	bool is_open() const { return mIs.is_open(); }
+
+protected:
+	std::ifstream mIs;
+	std::string mPath;
+	Kind mKind;
+	std::vector<char> mCur; // block being parsed
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mCond;
+	std::deque<std::vector<char> > mFull;
+	bool mEnd;
+	bool mStop;
+
+	int_type underflow() override;
+
+	// Worker side: blk is moved to the queue, false when closing.
+	bool push(std::vector<char>& blk);
+	void finish();
+	void inflate_gz();
+	// maxJobs is the opening thread's num_workers().
+	void inflate_zst(uint32_t maxJobs);
+};
+
+bool TDInStream::Buf::open(const std::string& path) {
+	close();
+	mIs.open(path, std::ios::binary);
+	if (!mIs.good()) { return false; }
+	mPath = path;
+
+	unsigned char magic[4] = {};
+	mIs.read((char*)magic, sizeof(magic));
+	size_t num = (size_t)mIs.gcount();
+	mIs.clear();
+	mIs.seekg(0);
+	mKind = PLAIN;
+	if (num >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) {
+		mKind = GZIP;
+	} else if (num >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD) {
+		mKind = ZSTD;
+	}
+
+	if (mKind == GZIP) {
+#ifdef TD_USE_ZLIB
+		mThread = std::thread(&Buf::inflate_gz, this);
+#else
+		std::cout << path << " is gzip compressed, this build has no zlib support" << std::endl;
+		mIs.close();
+		return false;
+#endif
+	} else if (mKind == ZSTD) {
+#ifdef TD_USE_ZSTD
+		mThread = std::thread(&Buf::inflate_zst, this, TDParallel::num_workers());
+#else
+		std::cout << path << " is zstd compressed, this build has no zstd support" << std::endl;
+		mIs.close();
+		return false;
+#endif
+	}
+	return true;
+}
+
+void TDInStream::Buf::close() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mCond.notify_all();
+	if (mThread.joinable()) {
+		mThread.join();
+	}
+	mIs.close();
+	mIs.clear();
+	mFull.clear();
+	mCur.clear();
+	mEnd = false;
+	mStop = false;
+	setg(nullptr, nullptr, nullptr);
+}
+
+TDInStream::Buf::int_type TDInStream::Buf::underflow() {
+	if (gptr() < egptr()) { return traits_type::to_int_type(*gptr()); }
+	mCur.clear();
+	if (mKind == PLAIN) {
+		if (mIs.is_open()) {
+			mCur.resize(BLOCK_BYTES);
+			mIs.read(mCur.data(), mCur.size());
+			mCur.resize((size_t)mIs.gcount());
+		}
+	} else {
+		std::unique_lock<std::mutex> lock(mMutex);
+		mCond.wait(lock, [this] { return !mFull.empty() || mEnd; });
+		if (!mFull.empty()) {
+			mCur.swap(mFull.front());
+			mFull.pop_front();
+		}
+		lock.unlock();
+		mCond.notify_all();
+	}
+	if (mCur.empty()) {
+		setg(nullptr, nullptr, nullptr);
+		return traits_type::eof();
+	}
+	setg(mCur.data(), mCur.data(), mCur.data() + mCur.size());
+	return traits_type::to_int_type(*gptr());
+}
+
+bool TDInStream::Buf::push(std::vector<char>& blk) {
+	std::unique_lock<std::mutex> lock(mMutex);
+	mCond.wait(lock, [this] { return mStop || mFull.size() < QUEUE_BLOCKS; });
+	if (mStop) { return false; }
+	mFull.push_back(std::vector<char>());
+	mFull.back().swap(blk);
+	lock.unlock();
+	mCond.notify_all();
+	return true;
+}
+
+void TDInStream::Buf::finish() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mEnd = true;
+	}
+	mCond.notify_all();
+}
+
+#ifdef TD_USE_ZLIB
+// Concatenated gzip members are read one after another, like gzip does.
+void TDInStream::Buf::inflate_gz() {
+	z_stream zs = {};
+	if (inflateInit2(&zs, 15 + 32) != Z_OK) { // 32: gzip or zlib header
+		finish();
+		return;
+	}
+	std::vector<char> in(IN_BYTES);
+	std::vector<char> out(BLOCK_BYTES);
+	size_t outNum = 0;
+	bool memberEnd = false;
+	bool ok = true;
+	while (true) {
+		if (zs.avail_in == 0) {
+			mIs.read(in.data(), in.size());
+			zs.next_in = (Bytef*)in.data();
+			zs.avail_in = (uInt)mIs.gcount();
+			if (zs.avail_in == 0) {
+				ok = memberEnd;
+				break;
+			}
+		}
+		zs.next_out = (Bytef*)out.data() + outNum;
+		zs.avail_out = (uInt)(out.size() - outNum);
+		int res = inflate(&zs, Z_NO_FLUSH);
+		outNum = out.size() - zs.avail_out;
+		if (res == Z_STREAM_END) {
+			inflateReset(&zs);
+			memberEnd = true;
+		} else if (res == Z_OK || res == Z_BUF_ERROR) {
+			memberEnd = false;
+		} else {
+			ok = memberEnd; // trailing garbage after a complete member is ignored
+			break;
+		}
+		if (outNum == out.size()) {
+			if (!push(out)) {
+				outNum = 0;
+				break;
+			}
+			out.resize(BLOCK_BYTES);
+			outNum = 0;
+		}
+	}
+	if (outNum > 0) {
+		out.resize(outNum);
+		push(out);
+	}
+	inflateEnd(&zs);
+	if (!ok) {
+		std::cout << "Corrupted or truncated data in " << mPath << std::endl;
+	}
+	finish();
+}
+#endif
+
+#ifdef TD_USE_ZSTD
+struct ZstdFrame {
+	size_t org;
+	size_t size;
+	size_t dstSize;
+};
+
+// Sized frames are collected into batches of one per worker and
+// decompressed in parallel while the parser works on the previous batch
+// (pzstd writes such files). A single big frame goes through the streaming
+// decoder instead, so memory stays bounded.
+void TDInStream::Buf::inflate_zst(uint32_t maxJobs) {
+	std::vector<char> in; // compressed data, consumed up to inOrg
+	size_t inOrg = 0;
+	bool eof = false;
+	// makes num bytes past inOrg available if the file has them
+	auto fill = [&](size_t num) -> size_t {
+		while (in.size() - inOrg < num && !eof) {
+			size_t old = in.size();
+			size_t req = std::max(IN_BYTES, num - (old - inOrg));
+			in.resize(old + req);
+			mIs.read(in.data() + old, req);
+			size_t got = (size_t)mIs.gcount();
+			in.resize(old + got);
+			eof = got < req;
+		}
+		return in.size() - inOrg;
+	};
+	// drops the consumed data, only between batches: their frames are
+	// offsets into in
+	auto compact = [&] {
+		in.erase(in.begin(), in.begin() + inOrg);
+		inOrg = 0;
+	};
+
+	TDParallel::WorkerBudget budget(maxJobs);
+	ZSTD_DStream* pStream = nullptr;
+	std::vector<ZstdFrame> batch;
+	std::vector<std::vector<char> > outs;
+	std::vector<size_t> results;
+	bool ok = true;
+	bool stopped = false;
+	while (ok && !stopped) {
+		compact();
+		batch.clear();
+		bool streamNext = false;
+		while (batch.size() < maxJobs) {
+			size_t avail = fill(ZSTD_HEADER_MAX);
+			if (avail == 0) { break; }
+			unsigned long long dstSize = ZSTD_getFrameContentSize(&in[inOrg], avail);
+			if (dstSize == ZSTD_CONTENTSIZE_ERROR) {
+				ok = false;
+				break;
+			}
+			if (dstSize == ZSTD_CONTENTSIZE_UNKNOWN || dstSize > FRAME_MAX) {
+				streamNext = true;
+				break;
+			}
+			size_t size;
+			while (ZSTD_isError(size = ZSTD_findFrameCompressedSize(&in[inOrg], avail))) {
+				size_t more = fill(avail + IN_BYTES);
+				if (more == avail) { break; }
+				avail = more;
+			}
+			if (ZSTD_isError(size)) {
+				ok = false;
+				break;
+			}
+			ZstdFrame frame = { inOrg, size, (size_t)dstSize };
+			batch.push_back(frame);
+			inOrg += size;
+		}
+
+		outs.assign(batch.size(), std::vector<char>());
+		results.assign(batch.size(), 0);
+		TDParallel::for_each((uint32_t)batch.size(), [&](uint32_t i) {
+			outs[i].resize(batch[i].dstSize);
+			results[i] = ZSTD_decompress(outs[i].data(), outs[i].size(), &in[batch[i].org], batch[i].size);
+		}, 1);
+		for (size_t i = 0; i < batch.size() && ok && !stopped; ++i) {
+			if (ZSTD_isError(results[i])) {
+				ok = false;
+				break;
+			}
+			// handed over in parser sized blocks, a whole frame per queue
+			// slot would hold QUEUE_BLOCKS * FRAME_MAX
+			for (size_t org = 0; org < results[i] && !stopped; org += BLOCK_BYTES) {
+				std::vector<char> blk(outs[i].begin() + org, outs[i].begin() + std::min(org + BLOCK_BYTES, results[i]));
+				stopped = !push(blk);
+			}
+			std::vector<char>().swap(outs[i]);
+		}
+
+		if (ok && !stopped && streamNext) {
+			if (pStream == nullptr) {
+				pStream = ZSTD_createDStream();
+			}
+			ZSTD_initDStream(pStream);
+			std::vector<char> out(BLOCK_BYTES);
+			size_t outNum = 0;
+			size_t ret = 1;
+			while (ret != 0) {
+				if (inOrg >= IN_BYTES) {
+					compact();
+				}
+				size_t avail = fill(1);
+				ZSTD_inBuffer zin = { in.data() + inOrg, avail, 0 };
+				ZSTD_outBuffer zout = { out.data(), out.size(), outNum };
+				ret = ZSTD_decompressStream(pStream, &zout, &zin);
+				if (ZSTD_isError(ret)) {
+					ok = false;
+					break;
+				}
+				bool progress = zin.pos > 0 || zout.pos > outNum;
+				inOrg += zin.pos;
+				outNum = zout.pos;
+				if (outNum == out.size() || (ret == 0 && outNum > 0)) {
+					out.resize(outNum);
+					if (!push(out)) {
+						stopped = true;
+						break;
+					}
+					out.resize(BLOCK_BYTES);
+					outNum = 0;
+				}
+				if (!progress && ret != 0) { // truncated
+					ok = false;
+					break;
+				}
+			}
+		}
+
+		if (batch.empty() && !streamNext) { break; }
+	}
+	ZSTD_freeDStream(pStream);
+	if (!ok) {
+		std::cout << "Corrupted or truncated data in " << mPath << std::endl;
+	}
+	finish();
+}
+#endif
+
+TDInStream::TDInStream() : std::istream(nullptr), mpBuf(new Buf()) {
+	rdbuf(mpBuf);
+}
+
+TDInStream::~TDInStream() {
+	delete mpBuf;
+}
+
+void TDInStream::open(const std::string& path) {
+	clear();
+	if (!mpBuf->open(path)) {
+		setstate(std::ios::failbit);
+	}
+}
+
+void TDInStream::close() {
+	mpBuf->close();
+}
+
+bool TDInStream::is_open() const {
+	return mpBuf->is_open();
+}
+
+std::string TDInStream::find(const std::string& path) {
+	static const char* s_exts[] = { "", ".gz", ".zst" };
+	for (const char* pExt : s_exts) {
+		std::ifstream is(path + pExt);
+		if (is.good()) { return path + pExt; }
+	}
+	return path;
+}
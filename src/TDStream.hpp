@@ -0,0 +1,35 @@
+/*
+ * TouchDesigner geometry: table input with streaming decompression
+ * Author: Gleb Novodran <novodran@gmail.com>
+ */
+#pragma once
+
+#include <istream>
+#include <string>
+
+// Input stream for TD tables that may be archived compressed. gzip (built
+// with TD_USE_ZLIB) and zstd (TD_USE_ZSTD) files are recognized by their
+// magic bytes and inflated by a worker thread a block at a time, ahead of
+// the parser and never more than a few blocks at once. Independent zstd
+// frames are decompressed in parallel. Plain files are read directly.
+class TDInStream : public std::istream {
+public:
+	class Buf;
+
+protected:
+	Buf* mpBuf;
+
+public:
+	TDInStream();
+	~TDInStream();
+
+	// Sets failbit when the file can't be opened or is compressed with a
+	// format this build doesn't support.
+	void open(const std::string& path);
+	void close();
+	bool is_open() const;
+
+	// path when it exists, otherwise path.gz or path.zst if one of them
+	// does; path when none is found.
+	static std::string find(const std::string& path);
+};